@@ -41,6 +41,7 @@
 # include <netinet/in.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <fcntl.h>
 # define SOCKETTYPE long
 # define SOCKETFAIL(a) ((a) < 0)
 # define INVSOCK -1 /* INVALID_SOCKET */
@@ -48,6 +49,7 @@
 # define CLOSESOCKET close
 # define SOCKETINIT {}
 # define SOCKERRMSG strerror(errno)
+# define SOCKWOULDBLOCK (errno == EAGAIN || errno == EWOULDBLOCK)
 #else
 # define SOCKETTYPE SOCKET
 # define SOCKETFAIL(a) ((a) == SOCKET_ERROR)
@@ -55,6 +57,11 @@
 # define INVINETADDR INADDR_NONE
 # define CLOSESOCKET closesocket
 # define in_addr_t uint32_t
+# define SOCKWOULDBLOCK (WSAGetLastError() == WSAEWOULDBLOCK)
+#endif
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
 #endif
 
 #define GROUP(g) (toupper(g))
@@ -100,14 +107,16 @@ extern char *opt_api_mcast_addr;
 extern char *opt_api_mcast_code;
 extern char *opt_api_mcast_des;
 extern int opt_api_mcast_port;
+extern int opt_api_push;
+
+extern pthread_mutex_t stats_lock;
+extern double thr_hashrates[MAX_GPUS];
 
 // current stratum...
 extern struct stratum_ctx stratum;
 
 // sysinfos.cpp
 extern int num_cpus;
-extern float cpu_temp(int);
-extern uint32_t cpu_clock(int);
 
 char driver_version[32] = { 0 };
 
@@ -297,7 +306,7 @@ static void syshwinfos()
 {
 	char buf[256];
 
-	int cputc = (int) cpu_temp(0);
+	int cputc = (int) cpu_temp(-1);
 	uint32_t cpuclk = cpu_clock(0);
 
 	memset(buf, 0, sizeof(buf));
@@ -306,6 +315,22 @@ static void syshwinfos()
 	strcat(buffer, buf);
 }
 
+/**
+ * CPU topology and cpu of each mining thread (-1 if not pinned)
+ */
+static void topohwinfos()
+{
+	struct topology_data topo;
+	char *p = buffer + strlen(buffer);
+	topology_get(&topo);
+	p += sprintf(p, "PACKAGES=%d;NODES=%d;L3=%d;CORES=%d;THREADS=%d;PCPUS=%d;ECPUS=%d;PLACEMENT=%s;RESERVED=%d;MAP=",
+		topo.packages, topo.nodes, topo.l3, topo.cores, topo.threads, topo.p_threads, topo.e_threads,
+		topo.placement, topo.reserved);
+	for (int t = 0; t < opt_n_threads && p < buffer + MYBUFSIZ - 64; t++)
+		p += sprintf(p, "%s%d", t ? "," : "", topology_thread_cpu(t));
+	strcat(p, "|");
+}
+
 /**
  * Returns gpu and system (todo) informations
  */
@@ -314,6 +339,7 @@ static char *gethwinfos(char *params)
 	*buffer = '\0';
 	
 	syshwinfos();
+	topohwinfos();
 	return buffer;
 }
 
@@ -361,6 +387,233 @@ static char *getscanlog(char *params)
 	return buffer;
 }
 
+/**
+ * Returns the notify->hashing and share->ack latencies (in us)
+ * and the hashes done on superseded jobs
+ */
+static char *getlatency(char *params)
+{
+	struct latency_data data[LAT_STAGES];
+	char *p = buffer;
+	uint32_t scans = 0;
+	int records = latency_get_stages(data, ARRAY_SIZE(data));
+	double wasted = latency_get_wasted(&scans);
+	*buffer = '\0';
+	for (int i = 0; i < records; i++) {
+		p += sprintf(p, "STAGE=%s;COUNT=%u;AVG=%.1f;P50=%.1f;P90=%.1f;"
+				"P99=%.1f;P999=%.1f;MAX=%.1f|",
+			data[i].name, data[i].count, data[i].avg, data[i].p50, data[i].p90,
+			data[i].p99, data[i].p999, data[i].max);
+	}
+	sprintf(p, "WASTED=%.0f;SCANS=%u|", wasted, scans);
+	return buffer;
+}
+
+/**
+ * Returns the cpu performance counters of each thread (--perf-counters)
+ * with the per hash ratios, values are totals since the thread start
+ */
+static char *getperf(char *params)
+{
+	char *p = buffer;
+	*buffer = '\0';
+	for (int thr_id = 0; thr_id < opt_n_threads && thr_id < MAX_GPUS; thr_id++) {
+		struct perf_data d;
+		double *v = d.values;
+		if (!perf_thread_read(thr_id, &d))
+			continue;
+		p += sprintf(p, "CPU=%d;HASHES=%llu;CYCLES=%.0f;INSTR=%.0f;BRMISS=%.0f;L1DMISS=%.0f;"
+				"IPC=%.3f;CYCPH=%.1f;BRMPH=%.2f;L1DMPH=%.2f|",
+			thr_id, (unsigned long long) d.hashes,
+			v[PERF_CYCLES], v[PERF_INSTRUCTIONS], v[PERF_BRANCH_MISSES], v[PERF_L1D_MISSES],
+			(v[PERF_CYCLES] > 0 && v[PERF_INSTRUCTIONS] >= 0) ? v[PERF_INSTRUCTIONS] / v[PERF_CYCLES] : -1.,
+			(d.hashes && v[PERF_CYCLES] >= 0) ? v[PERF_CYCLES] / d.hashes : -1.,
+			(d.hashes && v[PERF_BRANCH_MISSES] >= 0) ? v[PERF_BRANCH_MISSES] / d.hashes : -1.,
+			(d.hashes && v[PERF_L1D_MISSES] >= 0) ? v[PERF_L1D_MISSES] / d.hashes : -1.);
+	}
+	return buffer;
+}
+
+/**
+ * Returns the cycles spent per phase (--phase-sample)
+ * optional param thread id (default all)
+ */
+static char *getphases(char *params)
+{
+	struct phase_data data[PHASES];
+	int thrid = params ? atoi(params) : -1;
+	char *p = buffer;
+	int records = phase_get_stats(thrid, data, ARRAY_SIZE(data));
+	double total = 0.;
+	*buffer = '\0';
+	if (!opt_phase_sample)
+		return buffer;
+	// cost of a hash including the amortized per scan phases and waits
+	for (int i = 0; i < records; i++) {
+		if (i < PHASE_CLHASH || i >= PHASE_HASH_TOTAL)
+			total += data[i].cph;
+	}
+	for (int i = 0; i < records; i++) {
+		p += sprintf(p, "PHASE=%s;CALLS=%llu;CYCLES=%llu;AVG=%.1f;CPH=%.2f;PCT=%.2f|",
+			data[i].name, (unsigned long long) data[i].calls, (unsigned long long) data[i].cycles,
+			data[i].avg, data[i].cph, total > 0. ? 100. * data[i].cph / total : 0.);
+	}
+	return buffer;
+}
+
+/**
+ * Node of each mining thread and where its memory really is
+ * (-1 if not pinned or unknown), ACTIVE=0 if the job is not replicated
+ */
+static char *getnuma(char *params)
+{
+	char *p = buffer;
+	*buffer = '\0';
+	p += sprintf(p, "ACTIVE=%d;BINDFAIL=%u|", (int) numa_enabled(), numa_bind_failures());
+	for (int thr_id = 0; thr_id < opt_n_threads && thr_id < MAX_GPUS && p < buffer + MYBUFSIZ - 128; thr_id++) {
+		struct numa_data d;
+		if (!numa_get_thread(thr_id, &d))
+			continue;
+		p += sprintf(p, "CPU=%d;PCPU=%d;NODE=%d;JOBNODE=%d;ARENANODE=%d;REFRESH=%u|",
+			thr_id, d.cpu, d.node, d.work_node, d.arena_node, d.refreshes);
+	}
+	return buffer;
+}
+
+/**
+ * Container cpu limits and CFS throttling (cpu.stat)
+ */
+static char *getcgroup(char *params)
+{
+	struct cgroup_data d;
+	*buffer = '\0';
+	if (!cgroup_get(&d))
+		return buffer;
+	sprintf(buffer, "VERSION=%d;QUOTA=%.2f;CPUSET=%s;CPUS=%d;ACTIVE=%d;PERIODS=%llu;THROTTLED=%llu;THROTTLEDMS=%llu|",
+		d.version, d.quota, d.cpuset[0] ? d.cpuset : "all", d.cpus, d.active,
+		(unsigned long long) d.periods, (unsigned long long) d.throttled, (unsigned long long) d.throttled_ms);
+	return buffer;
+}
+
+/**
+ * --thread-parking controller, busy is the steal+irq % of the cpu
+ */
+static char *getparking(char *params)
+{
+	struct park_data d;
+	char *p = buffer;
+	park_get(&d);
+	p += sprintf(p, "ENABLED=%d;BUSY=%.1f;CV=%.3f;PARKED=%d;PARKS=%u;MOVES=%u;REVERTS=%u|",
+		(int) d.enabled, d.busy * 100., d.dispersion, d.parked, d.parks, d.moves, d.reverts);
+	for (int thr_id = 0; thr_id < opt_n_threads && p < buffer + MYBUFSIZ - 128; thr_id++) {
+		struct park_thread_data t;
+		if (!park_get_thread(thr_id, &t))
+			continue;
+		p += sprintf(p, "CPU=%d;PCPU=%d;BUSY=%.1f;KHS=%.2f;SLOW=%d;PARKED=%d|",
+			thr_id, t.cpu, t.busy * 100., t.rate / 1000.0, t.slow, (int) t.parked);
+	}
+	return buffer;
+}
+
+/**
+ * Hashrate per core type of hybrid cpus (any = not hybrid or not pinned)
+ */
+static char *getcoretypes(char *params)
+{
+	int threads[3] = { 0 };
+	double rates[3] = { 0. };
+	char *p = buffer;
+	*buffer = '\0';
+	pthread_mutex_lock(&stats_lock);
+	for (int thr_id = 0; thr_id < opt_n_threads && thr_id < MAX_GPUS; thr_id++) {
+		int type = topology_cpu_type(topology_thread_cpu(thr_id));
+		threads[type]++;
+		rates[type] += thr_hashrates[thr_id];
+	}
+	pthread_mutex_unlock(&stats_lock);
+	for (int type = 0; type < 3; type++) {
+		if (!threads[type])
+			continue;
+		p += sprintf(p, "TYPE=%s;THREADS=%d;KHS=%.2f;KHSPT=%.2f|", topology_core_type_name(type),
+			threads[type], rates[type] / 1000.0, rates[type] / 1000.0 / threads[type]);
+	}
+	return buffer;
+}
+
+/**
+ * Package energy (rapl or amd_energy), HPJ is hashes per joule since
+ * the start and HSPW the current hashrate per watt, then each zone
+ */
+static char *getenergy(char *params)
+{
+	struct energy_data d;
+	char *p = buffer;
+	energy_update();
+	if (!energy_get(&d)) {
+		sprintf(buffer, "ZONES=0|");
+		return buffer;
+	}
+	p += sprintf(p, "PACKAGES=%d;POWER=%.2f;ENERGY=%.1f;TIME=%.0f;HPJ=%.2f;HSPW=%.2f|",
+		d.packages, d.watts, d.joules, d.seconds, d.hpj, d.hpw);
+	for (int z = 0; p < buffer + MYBUFSIZ - 128; z++) {
+		struct energy_zone_data e;
+		if (!energy_get_zone(z, &e))
+			break;
+		p += sprintf(p, "ZONE=%s;PACKAGE=%d;DOMAIN=%d;POWER=%.2f;ENERGY=%.1f|",
+			e.name, e.package, (int) e.domain, e.watts, e.joules);
+	}
+	return buffer;
+}
+
+/**
+ * Temperature (C) and frequency (MHz) of each cpu running a miner thread
+ */
+static char *getsensors(char *params)
+{
+	char *p = buffer;
+	p += sprintf(p, "TEMP=%.1f|", cpu_temp(-1));
+	for (int thr_id = 0; thr_id < opt_n_threads && p < buffer + MYBUFSIZ - 64; thr_id++) {
+		int cpu = topology_thread_cpu(thr_id);
+		int c = max(cpu, 0);
+		p += sprintf(p, "CPU=%d;PCPU=%d;TEMP=%.1f;FREQ=%u|",
+			thr_id, cpu, cpu_temp(c), cpu_clock(c) / 1000);
+	}
+	return buffer;
+}
+
+/**
+ * --max-temp/--max-power governor, step 0 is paused
+ */
+static char *getgovernor(char *params)
+{
+	struct governor_data d;
+	governor_get(&d);
+	sprintf(buffer, "ENABLED=%d;STATE=%s;MAXTEMP=%.1f;MAXPOWER=%.1f;HYST=%d;TEMP=%.1f;POWER=%.2f;"
+		"STEP=%d;STEPS=%d;THREADS=%d;DUTY=%d;HPJ=%.2f;DOWNS=%u;UPS=%u;REVERTS=%u|",
+		(int) d.enabled, d.state, d.max_temp, d.max_power, d.hysteresis, d.temp, d.power,
+		d.step, d.steps, d.threads, d.duty, d.hpj, d.downs, d.ups, d.reverts);
+	return buffer;
+}
+
+/**
+ * --verify-shares, hardware errors (invalid shares) of the threads and their cpu
+ */
+static char *getverify(char *params)
+{
+	struct verify_data d;
+	char *p = buffer;
+	verify_get(&d);
+	p += sprintf(p, "ENABLED=%d;CHECKED=%u;HW=%u;DISABLED=%d;AVGMS=%.3f|",
+		(int) d.enabled, d.checked, d.hw_errors, d.disabled, d.avg_ms);
+	for (int thr_id = 0; thr_id < opt_n_threads && p < buffer + MYBUFSIZ - 128; thr_id++) {
+		int cpu = topology_thread_cpu(thr_id);
+		p += sprintf(p, "CPU=%d;PCPU=%d;HW=%u;PCPUHW=%u;DISABLED=%d|", thr_id, cpu,
+			(uint32_t) thr_info[thr_id].gpu.hw_errors, (uint32_t) verify_cpu_errors(cpu),
+			(int) verify_thread_disabled(thr_id));
+	}
+	return buffer;
+}
+
 /**
  * Some debug infos about memory usage
  */
@@ -422,6 +675,28 @@ static char *remote_seturl(char *params)
 	return buffer;
 }
 
+/**
+ * Pause the mining and tune the threads placement (see --autotune)
+ */
+static char *remote_autotune(char *params)
+{
+	*buffer = '\0';
+	sprintf(buffer, "%s|", autotune_request() ? "ok" : "fail");
+	return buffer;
+}
+
+/**
+ * Grow or shrink the mining threads (up to --max-threads)
+ * setthreads|4|
+ */
+static char *remote_setthreads(char *params)
+{
+	int n = params ? atoi(params) : 0;
+	*buffer = '\0';
+	sprintf(buffer, "%s|", (n > 0 && miner_set_threads(n)) ? "ok" : "fail");
+	return buffer;
+}
+
 /**
  * Ask the miner to quit
  */
@@ -436,6 +711,7 @@ static char *remote_quit(char *params)
 /*****************************************************************************/
 
 static char *gethelp(char *params);
+static char *api_subscribe(char *params);
 struct CMDS {
 	const char *name;
 	char *(*func)(char *);
@@ -448,11 +724,25 @@ struct CMDS {
 	{ "hwinfo",  gethwinfos, false },
 	{ "meminfo", getmeminfo, false },
 	{ "scanlog", getscanlog, false },
+	{ "latency", getlatency, false },
+	{ "perf",    getperf,    false },
+	{ "phases",  getphases,  false },
+	{ "numa",    getnuma,    false },
+	{ "cgroup",  getcgroup,  false },
+	{ "parking", getparking, false },
+	{ "coretypes", getcoretypes, false },
+	{ "energy", getenergy, false },
+	{ "sensors", getsensors, false },
+	{ "governor", getgovernor, false },
+	{ "verify", getverify, false },
+	{ "subscribe", api_subscribe, false },
 
 	/* remote functions */
 	{ "seturl",  remote_seturl, true }, /* prefer switchpool, deprecated */
 	{ "switchpool", remote_switchpool, true },
 	{ "quit", remote_quit, true },
+	{ "autotune", remote_autotune, true },
+	{ "setthreads", remote_setthreads, true },
 
 	/* keep it the last */
 	{ "help",    gethelp, false },
@@ -555,6 +845,33 @@ static size_t base64_encode(const uchar *indata, size_t insize, char *outptr, si
 
 #include "openssl/sha.h"
 
+/* websocket text frame header, returns the header size */
+static uint8_t websocket_frame_header(uchar *hd, uint64_t datalen)
+{
+	uint8_t frames = 2;
+	hd[0] = 129; // 0x1 text frame (FIN + opcode)
+	if (datalen <= 125) {
+		hd[1] = (uchar) (datalen);
+	} else if (datalen <= 65535) {
+		hd[1] = (uchar) 126;
+		hd[2] = (uchar) (datalen >> 8);
+		hd[3] = (uchar) (datalen);
+		frames = 4;
+	} else {
+		hd[1] = (uchar) 127;
+		hd[2] = (uchar) (datalen >> 56);
+		hd[3] = (uchar) (datalen >> 48);
+		hd[4] = (uchar) (datalen >> 40);
+		hd[5] = (uchar) (datalen >> 32);
+		hd[6] = (uchar) (datalen >> 24);
+		hd[7] = (uchar) (datalen >> 16);
+		hd[8] = (uchar) (datalen >> 8);
+		hd[9] = (uchar) (datalen);
+		frames = 10;
+	}
+	return frames;
+}
+
 /* websocket handshake (tested in Chrome) */
 static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
 {
@@ -588,28 +905,8 @@ static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
 	// data result as tcp frame
 
 	uchar hd[10] = { 0 };
-	hd[0] = 129; // 0x1 text frame (FIN + opcode)
 	uint64_t datalen = (uint64_t) strlen(result);
-	uint8_t frames = 2;
-	if (datalen <= 125) {
-		hd[1] = (uchar) (datalen);
-	} else if (datalen <= 65535) {
-		hd[1] = (uchar) 126;
-		hd[2] = (uchar) (datalen >> 8);
-		hd[3] = (uchar) (datalen);
-		frames = 4;
-	} else {
-		hd[1] = (uchar) 127;
-		hd[2] = (uchar) (datalen >> 56);
-		hd[3] = (uchar) (datalen >> 48);
-		hd[4] = (uchar) (datalen >> 40);
-		hd[5] = (uchar) (datalen >> 32);
-		hd[6] = (uchar) (datalen >> 24);
-		hd[7] = (uchar) (datalen >> 16);
-		hd[8] = (uchar) (datalen >> 8);
-		hd[9] = (uchar) (datalen);
-		frames = 10;
-	}
+	uint8_t frames = websocket_frame_header(hd, datalen);
 
 	size_t handlen = strlen(answer);
 	uchar *data = (uchar*) calloc(1, handlen + frames + (size_t) datalen + 1);
@@ -623,12 +920,314 @@ static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
 		// WebSocket Frame - Header + Data
 		memcpy(p, hd, frames);
 		memcpy(p + frames, result, (size_t)datalen);
-		send(c, (const char*)data, (int) (strlen(answer) + frames + datalen + 1), 0);
+		send(c, (const char*)data, (int) (handlen + frames + datalen), 0);
 		free(data);
 	}
 	return 0;
 }
 
+/*****************************************************************************/
+
+/**
+ * Push subscriptions, the socket is kept opened and receives the
+ * updates of the selected topics every --api-push ms:
+ *   subscribe|hashrate,shares,jobs,pools|  or  GET /subscribe/hashrate,jobs
+ * Hashrate ticks are delta encoded (only the changed values are sent),
+ * clients which are not able to follow the event flow are dropped.
+ */
+
+#define PUSH_MAX_CLIENTS 8
+#define PUSH_RING_SIZE   256 /* max pending events per client */
+#define PUSH_EVENT_LEN   224
+#define PUSH_SNDBUF      (64 * 1024)
+
+struct push_event {
+	uint64_t seq;
+	int topic;
+	uint32_t ts;
+	char data[PUSH_EVENT_LEN];
+};
+
+struct push_client {
+	bool used;
+	bool ws;
+	int topics;
+	SOCKETTYPE sock;
+	uint64_t seq; /* next event to send */
+	double khs;
+	double thr_khs[MAX_GPUS];
+	char addr[32];
+};
+
+static const char *push_topic_names[] = { "hashrate", "shares", "jobs", "pools" };
+
+static struct push_event push_ring[PUSH_RING_SIZE];
+static struct push_client push_clients[PUSH_MAX_CLIENTS];
+static volatile int push_nclients = 0;
+static uint64_t push_seq = 0;
+static uint32_t push_drops = 0;
+static int push_topics_req = 0;
+static pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* queue an event for the subscribed clients (any thread) */
+void api_push_event(int topic, const char *fmt, ...)
+{
+	struct push_event *ev;
+	va_list ap;
+
+	if (!push_nclients)
+		return;
+
+	pthread_mutex_lock(&push_lock);
+	ev = &push_ring[push_seq % PUSH_RING_SIZE];
+	ev->seq = push_seq++;
+	ev->topic = topic;
+	ev->ts = (uint32_t) time(NULL);
+	va_start(ap, fmt);
+	vsnprintf(ev->data, sizeof(ev->data), fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&push_lock);
+}
+
+static int push_parse_topics(char *list)
+{
+	int topics = 0;
+	char *tok, *next;
+
+	if (!list || !strlen(list) || !strcmp(list, "*") || !strcasecmp(list, "all"))
+		return API_PUSH_ALL;
+
+	for (tok = list; tok && *tok; tok = next) {
+		next = strpbrk(tok, ",:");
+		if (next)
+			*(next++) = '\0';
+		for (int t = 0; t < ARRAY_SIZE(push_topic_names); t++) {
+			if (!strcasecmp(tok, push_topic_names[t]))
+				topics |= (1 << t);
+		}
+	}
+	return topics;
+}
+
+static void push_drop(struct push_client *cl, const char *reason)
+{
+	push_drops++;
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: push client %s dropped (%s), %u drops",
+			cl->addr, reason, push_drops);
+	CLOSESOCKET(cl->sock);
+	cl->used = false;
+	push_nclients--;
+}
+
+/**
+ * Subscribe to the push events, only check the topics here,
+ * the socket itself is registered in push_add_client()
+ */
+static char *api_subscribe(char *params)
+{
+	char *p = buffer;
+	*buffer = '\0';
+	push_topics_req = opt_api_push > 0 ? push_parse_topics(params) : 0;
+	if (!push_topics_req) {
+		sprintf(buffer, "fail|");
+		return buffer;
+	}
+	p += sprintf(p, "TOPICS=");
+	for (int t = 0; t < ARRAY_SIZE(push_topic_names); t++) {
+		if (push_topics_req & (1 << t))
+			p += sprintf(p, "%s,", push_topic_names[t]);
+	}
+	sprintf(p - 1, ";RATE=%d;SEQ=%llu|", opt_api_push, (unsigned long long) push_seq);
+	return buffer;
+}
+
+/* send the subscribe answer and keep the socket for the push thread */
+static bool push_add_client(SOCKETTYPE c, char *wskey, char *result, char *connectaddr)
+{
+	struct push_client *cl = NULL;
+	int sndbuf = PUSH_SNDBUF;
+
+	pthread_mutex_lock(&push_lock);
+	for (int n = 0; n < PUSH_MAX_CLIENTS; n++) {
+		if (!push_clients[n].used) {
+			cl = &push_clients[n];
+			break;
+		}
+	}
+	if (!cl) {
+		pthread_mutex_unlock(&push_lock);
+		applog(LOG_WARNING, "API: too many push clients, %s refused", connectaddr);
+		if (wskey)
+			websocket_handshake(c, (char*) "fail|", wskey);
+		else
+			send_result(c, (char*) "fail|");
+		return false;
+	}
+
+	if (wskey)
+		websocket_handshake(c, result, wskey);
+	else
+		send_result(c, result);
+
+	// the push thread should never wait for a client
+	setsockopt(c, SOL_SOCKET, SO_SNDBUF, (const char *)(&sndbuf), sizeof(sndbuf));
+#ifdef WIN32
+	u_long nonblock = 1;
+	ioctlsocket(c, FIONBIO, &nonblock);
+#else
+	fcntl(c, F_SETFL, fcntl(c, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	memset(cl, 0, sizeof(*cl));
+	cl->sock = c;
+	cl->ws = (wskey != NULL);
+	cl->topics = push_topics_req;
+	cl->seq = push_seq;
+	cl->khs = -1.;
+	for (int n = 0; n < MAX_GPUS; n++)
+		cl->thr_khs[n] = -1.;
+	snprintf(cl->addr, sizeof(cl->addr), "%s", connectaddr);
+	cl->used = true;
+	push_nclients++;
+	pthread_mutex_unlock(&push_lock);
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: push client %s subscribed (%x)", connectaddr, cl->topics);
+	return true;
+}
+
+/* build and send the pending updates of one client (push_lock held) */
+static void push_client_flush(struct push_client *cl, char *frame, double khs, double *thr_khs, int nthr)
+{
+	const size_t room = MYBUFSIZ - 16;
+	char *data = frame + 10; // leave room for the websocket header
+	size_t len = 0;
+	uint32_t ts = (uint32_t) time(NULL);
+	char rcv[64];
+	int n;
+
+	// detect closed peers and websocket close frames
+	n = recv(cl->sock, rcv, sizeof(rcv), 0);
+	if (n == 0 || (n > 0 && cl->ws && (rcv[0] & 0x0f) == 0x8) || (SOCKETFAIL(n) && !SOCKWOULDBLOCK)) {
+		push_drop(cl, "closed");
+		return;
+	}
+
+	if (push_seq - cl->seq > PUSH_RING_SIZE) {
+		push_drop(cl, "too slow");
+		return;
+	}
+
+	if (cl->topics & API_PUSH_HASHRATE) {
+		size_t mark = len;
+		bool changed = false;
+		len += snprintf(&data[len], room - len, "TOPIC=hashrate;");
+		if (khs != cl->khs) {
+			len += snprintf(&data[len], room - len, "KHS=%.2f;", khs);
+			cl->khs = khs;
+			changed = true;
+		}
+		for (int t = 0; t < nthr && len < room; t++) {
+			if (thr_khs[t] == cl->thr_khs[t])
+				continue;
+			len += snprintf(&data[len], room - len, "T%d=%.2f;", t, thr_khs[t]);
+			cl->thr_khs[t] = thr_khs[t];
+			changed = true;
+		}
+		if (changed && len < room)
+			len += snprintf(&data[len], room - len, "TS=%u|", ts);
+		else
+			len = mark;
+	}
+
+	while (cl->seq < push_seq) {
+		struct push_event *ev = &push_ring[cl->seq % PUSH_RING_SIZE];
+		if (ev->topic & cl->topics) {
+			const char *name = "";
+			for (int t = 0; t < ARRAY_SIZE(push_topic_names); t++) {
+				if (ev->topic & (1 << t))
+					name = push_topic_names[t];
+			}
+			n = snprintf(&data[len], room - len, "TOPIC=%s;SEQ=%llu;%s;TS=%u|",
+				name, (unsigned long long) ev->seq, ev->data, ev->ts);
+			if (len + n >= room)
+				break; // frame full, remaining events on next tick
+			len += n;
+		}
+		cl->seq++;
+	}
+
+	if (!len)
+		return;
+
+	if (cl->ws) {
+		uchar hd[10] = { 0 };
+		uint8_t hdlen = websocket_frame_header(hd, (uint64_t) len);
+		data -= hdlen;
+		memcpy(data, hd, hdlen);
+		len += hdlen;
+	} else {
+		len++; // null terminated, like send_result()
+	}
+
+	n = send(cl->sock, data, (int) len, MSG_NOSIGNAL);
+	if (SOCKETFAIL(n) && !SOCKWOULDBLOCK)
+		push_drop(cl, "send error");
+	else if (n != (int) len)
+		push_drop(cl, "too slow"); // a partial frame can't be resumed
+}
+
+static void *api_push_thread(void *userdata)
+{
+	double thr_khs[MAX_GPUS];
+	char *frame = (char *) calloc(1, MYBUFSIZ);
+
+	pthread_detach(pthread_self());
+
+	while (frame && !bye && !abort_flag) {
+		int nthr = min(opt_n_threads, MAX_GPUS);
+		double khs = 0.;
+
+		usleep(opt_api_push * 1000);
+		if (!push_nclients)
+			continue;
+
+		// rounded to skip the insignificant changes in deltas
+		pthread_mutex_lock(&stats_lock);
+		for (int t = 0; t < nthr; t++) {
+			double rate = stats_get_speed(t, thr_hashrates[t]);
+			thr_khs[t] = round(rate / 10.) / 100.;
+			khs += rate;
+		}
+		pthread_mutex_unlock(&stats_lock);
+		khs = round(khs / 10.) / 100.;
+
+		pthread_mutex_lock(&push_lock);
+		for (int n = 0; n < PUSH_MAX_CLIENTS; n++) {
+			if (push_clients[n].used)
+				push_client_flush(&push_clients[n], frame, khs, thr_khs, nthr);
+		}
+		pthread_mutex_unlock(&push_lock);
+	}
+
+	pthread_mutex_lock(&push_lock);
+	for (int n = 0; n < PUSH_MAX_CLIENTS; n++) {
+		if (push_clients[n].used)
+			push_drop(&push_clients[n], "exit");
+	}
+	pthread_mutex_unlock(&push_lock);
+	free(frame);
+	return NULL;
+}
+
+static void push_init()
+{
+	pthread_t pth;
+	if (unlikely(pthread_create(&pth, NULL, api_push_thread, NULL)))
+		applog(LOG_ERR, "API push thread create failed");
+}
+
 /*
  * Interpret --api-groups G:cmd1:cmd2:cmd3,P:cmd4,*,...
  */
@@ -1182,6 +1781,9 @@ static void api()
 	if (opt_api_mcast)
 		mcast_init();
 
+	if (opt_api_push > 0)
+		push_init();
+
 	buffer = (char *) calloc(1, MYBUFSIZ + 1);
 
 	counter = 0;
@@ -1204,7 +1806,7 @@ static void api()
 				connectaddr, addrok ? "Accepted" : "Ignored");
 
 		if (addrok) {
-			bool fail;
+			bool fail, keep = false;
 			char *wskey = NULL;
 			n = recv(c, &buf[0], SOCK_REC_BUFSZ, 0);
 
@@ -1260,6 +1862,10 @@ static void api()
 								params[strlen(params)-1] = '\0';
 						}
 						result = (cmds[i].func)(params);
+						if (cmds[i].func == api_subscribe && push_topics_req) {
+							keep = push_add_client(c, wskey, result, connectaddr);
+							break;
+						}
 						if (wskey) {
 							websocket_handshake(c, result, wskey);
 							break;
@@ -1269,7 +1875,8 @@ static void api()
 					}
 				}
 			}
-			CLOSESOCKET(c);
+			if (!keep)
+				CLOSESOCKET(c);
 		}
 	}
 
@@ -1284,6 +1891,7 @@ void *api_thread(void *userdata)
 	struct thr_info *mythr = (struct thr_info*)userdata;
 
 	startup = time(NULL);
+	topology_bind_service();
 	api();
 	tq_freeze(mythr->q);
 
@@ -1303,7 +1911,4 @@ void api_set_throughput(int thr_id, uint32_t throughput)
 		cgpu->intensity = 100;
 		if (cgpu->throughput != throughput) cgpu->throughput = throughput;
 	}
-	// to display in bench results
-	if (opt_benchmark)
-		bench_set_throughput(thr_id, throughput);
 }
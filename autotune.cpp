@@ -0,0 +1,428 @@
+/**
+ * Startup auto-tuner (--autotune)
+ *
+ * Runs scanhash_verus on a synthetic job with different thread counts
+ * and placement policies, keeps the fastest configuration and stores
+ * it in a json profile keyed by the cpu model and microcode, so the
+ * next starts only have to load it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "miner.h"
+
+#define TUNE_MIN_TRIALS  3
+#define TUNE_MAX_TRIALS  6
+#define TUNE_MAX_RSE     0.01 /* relative standard error of the mean */
+#define TUNE_WARMUP_MS   300
+#define TUNE_SCAN_NONCES 0x4000
+
+bool opt_tune = false;
+bool opt_tune_force = false;
+char *opt_tune_file = NULL;
+static int opt_tune_ms = 1500; /* per trial */
+
+static volatile bool tune_running = false;
+
+/* miner threads paused by the api autotune */
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tune_cond = PTHREAD_COND_INITIALIZER;
+static int tune_parked = 0;
+#define TUNE_PARK_WAIT   30 /* seconds */
+
+struct tune_thread {
+	pthread_t pth;
+	int thr_id;
+	uint64_t hashes;
+	double seconds;
+};
+
+static volatile bool trial_stop = false;
+
+static void tune_profile_path(char *path, size_t len)
+{
+	if (opt_tune_file) {
+		snprintf(path, len, "%s", opt_tune_file);
+		return;
+	}
+#ifdef WIN32
+	snprintf(path, len, "%s\\ccminer-autotune.json", getenv("APPDATA"));
+#else
+	snprintf(path, len, "%s/.ccminer-autotune.json", getenv("HOME") ? getenv("HOME") : ".");
+#endif
+}
+
+/* cpu model, microcode and cpu count */
+static void tune_host_key(char *key, size_t len)
+{
+	char model[128] = "unknown", ucode[32] = "0";
+	struct topology_data topo;
+#ifdef __linux
+	char line[256];
+	FILE *fd = fopen("/proc/cpuinfo", "r");
+	while (fd && fgets(line, sizeof(line), fd)) {
+		char *v = strchr(line, ':');
+		if (!v) continue;
+		v += strspn(v, ": \t");
+		v[strcspn(v, "\r\n")] = '\0';
+		if (!strncmp(line, "model name", 10))
+			snprintf(model, sizeof(model), "%s", v);
+		else if (!strncmp(line, "microcode", 9)) {
+			snprintf(ucode, sizeof(ucode), "%s", v);
+			break;
+		}
+	}
+	if (fd) fclose(fd);
+#elif defined(WIN32)
+	if (getenv("PROCESSOR_IDENTIFIER"))
+		snprintf(model, sizeof(model), "%s", getenv("PROCESSOR_IDENTIFIER"));
+#endif
+	topology_get(&topo);
+	snprintf(key, len, "%s|%s|%d", model, ucode, topo.allowed);
+}
+
+static bool tune_load(const char *key, struct autotune_result *res)
+{
+	char path[512];
+	json_error_t err;
+	json_t *root, *prof;
+
+	tune_profile_path(path, sizeof(path));
+	root = json_load_file(path, 0, &err);
+	if (!root)
+		return false;
+	prof = json_object_get(root, key);
+	if (!json_is_object(prof) || !json_is_integer(json_object_get(prof, "threads"))) {
+		json_decref(root);
+		return false;
+	}
+	memset(res, 0, sizeof(*res));
+	res->threads = (int) json_integer_value(json_object_get(prof, "threads"));
+	snprintf(res->placement, sizeof(res->placement), "%s",
+		json_string_value(json_object_get(prof, "placement")) ? json_string_value(json_object_get(prof, "placement")) : "cores");
+	res->hashrate = json_number_value(json_object_get(prof, "hashrate"));
+	res->tuned = (uint32_t) json_integer_value(json_object_get(prof, "time"));
+	json_decref(root);
+	return res->threads > 0 && res->threads < MAX_GPUS;
+}
+
+static bool tune_save(const char *key, struct autotune_result *res)
+{
+	char path[512];
+	json_error_t err;
+	json_t *root, *prof;
+	int rc;
+
+	tune_profile_path(path, sizeof(path));
+	root = json_load_file(path, 0, &err);
+	if (!json_is_object(root)) {
+		if (root) json_decref(root);
+		root = json_object();
+	}
+	prof = json_object();
+	json_object_set_new(prof, "threads", json_integer(res->threads));
+	json_object_set_new(prof, "placement", json_string(res->placement));
+	json_object_set_new(prof, "hashrate", json_real(res->hashrate));
+	json_object_set_new(prof, "time", json_integer(res->tuned));
+	json_object_set_new(root, key, prof);
+	rc = json_dump_file(root, path, JSON_INDENT(2));
+	json_decref(root);
+	if (rc)
+		applog(LOG_WARNING, "Unable to save the tuning profile %s", path);
+	return rc == 0;
+}
+
+static void *tune_thread(void *userdata)
+{
+	struct tune_thread *tt = (struct tune_thread *) userdata;
+	struct work work;
+	uint64_t tm_start, now;
+	bool warm = false;
+
+	topology_bind_miner(tt->thr_id);
+
+	// synthetic verus 2.2 job, the target can't be reached
+	bench_work(&work, tt->thr_id);
+
+	tm_start = latency_now();
+	while (!trial_stop) {
+		unsigned long hashes_done = 0;
+		numa_restart(tt->thr_id)->restart = 0;
+		work.valid_nonces = 0;
+		scanhash_verus(tt->thr_id, &work, TUNE_SCAN_NONCES, &hashes_done);
+		now = latency_now();
+		if (!warm) {
+			// the first scans are not counted (frequency ramp, caches)
+			if (now - tm_start >= TUNE_WARMUP_MS * 1000000ULL) {
+				warm = true;
+				tm_start = now;
+			}
+			continue;
+		}
+		tt->hashes += hashes_done;
+		tt->seconds = 1e-9 * (double) (now - tm_start);
+	}
+	return NULL;
+}
+
+/* one trial, returns the total hashrate */
+static double tune_trial(int nthreads)
+{
+	struct tune_thread tt[MAX_GPUS];
+	double rate = 0.;
+	int started = 0;
+
+	memset(tt, 0, sizeof(tt));
+	trial_stop = false;
+	for (int t = 0; t < nthreads; t++) {
+		tt[t].thr_id = t;
+		if (pthread_create(&tt[t].pth, NULL, tune_thread, &tt[t]))
+			break;
+		started++;
+	}
+	usleep((TUNE_WARMUP_MS + opt_tune_ms) * 1000);
+	trial_stop = true;
+	for (int t = 0; t < started; t++) {
+		pthread_join(tt[t].pth, NULL);
+		if (tt[t].seconds > 0.)
+			rate += (double) tt[t].hashes / tt[t].seconds;
+	}
+	return started == nthreads ? rate : 0.;
+}
+
+/* repeat the trials until the mean is stable enough */
+static double tune_config(int nthreads, const char *placement, double *rse)
+{
+	double rates[TUNE_MAX_TRIALS], mean = 0., var = 0.;
+	int n;
+
+	topology_set_placement(placement);
+	topology_compute(nthreads);
+	for (n = 0; n < TUNE_MAX_TRIALS && !abort_flag; n++) {
+		rates[n] = tune_trial(nthreads);
+		mean = var = 0.;
+		for (int i = 0; i <= n; i++)
+			mean += rates[i] / (double) (n + 1);
+		for (int i = 0; i <= n; i++)
+			var += (rates[i] - mean) * (rates[i] - mean) / (double) max(n, 1);
+		*rse = mean > 0. ? sqrt(var / (double) (n + 1)) / mean : 1.;
+		if (n + 1 >= TUNE_MIN_TRIALS && *rse < TUNE_MAX_RSE)
+			break;
+	}
+	return mean;
+}
+
+static void add_count(int *counts, int *n, int v)
+{
+	if (v < 1 || v >= MAX_GPUS)
+		return;
+	for (int i = 0; i < *n; i++)
+		if (counts[i] == v) return;
+	counts[(*n)++] = v;
+}
+
+/**
+ * Sweep the thread counts and placements, fixed_threads > 0 to only
+ * compare the placements
+ */
+static bool tune_sweep(int fixed_threads, struct autotune_result *best)
+{
+	const char *placements[] = { "cores", "scatter", "compact" };
+	struct topology_data topo;
+	struct work_restart *saved = work_restart;
+	int counts[8], ncounts = 0;
+	char buf[64], prev[16];
+
+	topology_read();
+	topology_get(&topo);
+	if (!topo.allowed)
+		return false;
+	// no trial above the cgroup cpu quota
+	if (cgroup_effective_cpus()) {
+		topo.allowed = min(topo.allowed, cgroup_effective_cpus());
+		topo.allowed_cores = min(topo.allowed_cores, topo.allowed);
+	}
+
+	if (fixed_threads)
+		add_count(counts, &ncounts, fixed_threads);
+	else {
+		int cores = max(topo.allowed_cores, 1);
+		add_count(counts, &ncounts, max(cores / 2, 1));
+		add_count(counts, &ncounts, cores);
+		add_count(counts, &ncounts, (cores + topo.allowed) / 2);
+		add_count(counts, &ncounts, topo.allowed);
+	}
+
+	// the trials change the placement, the best one is applied by the caller
+	snprintf(prev, sizeof(prev), "%s", topology_placement_name());
+
+	// the miner threads may not be started yet
+	if (!work_restart)
+		work_restart = (struct work_restart *) calloc(MAX_GPUS, sizeof(*work_restart));
+
+	memset(best, 0, sizeof(*best));
+	for (int c = 0; c < ncounts && !abort_flag; c++) {
+		for (int p = 0; p < (int) ARRAY_SIZE(placements) && !abort_flag; p++) {
+			double rse = 0., rate;
+			// same cpu set, only the order differs
+			if (p && counts[c] >= topo.allowed)
+				break;
+			rate = tune_config(counts[c], placements[p], &rse);
+			format_hashrate(rate, buf);
+			applog(LOG_INFO, "autotune: %d threads, %s placement: %s (+/- %.1f%%)",
+				counts[c], placements[p], buf, rse * 100.);
+			// prefer less threads if the difference is not significant
+			if (rate > best->hashrate * (1. + TUNE_MAX_RSE)) {
+				best->threads = counts[c];
+				best->hashrate = rate;
+				snprintf(best->placement, sizeof(best->placement), "%s", placements[p]);
+			}
+		}
+	}
+
+	if (!saved) {
+		free(work_restart);
+		work_restart = NULL;
+	}
+	topology_set_placement(prev);
+	topology_compute(opt_n_threads);
+	best->tuned = (uint32_t) time(NULL);
+	return best->threads > 0 && !abort_flag;
+}
+
+bool autotune_running()
+{
+	return tune_running;
+}
+
+static void tune_deadline(struct timespec *ts, int secs)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	ts->tv_sec = now.tv_sec + secs;
+	ts->tv_nsec = now.tv_usec * 1000;
+}
+
+/**
+ * Called by the miner threads while autotune_running(), the trials reuse
+ * their thr_id (key arena, restart flag) so they can't scan until the end
+ */
+void autotune_park()
+{
+	struct timespec ts;
+	pthread_mutex_lock(&tune_lock);
+	tune_parked++;
+	pthread_cond_broadcast(&tune_cond);
+	while (tune_running && !abort_flag) {
+		tune_deadline(&ts, 1);
+		pthread_cond_timedwait(&tune_cond, &tune_lock, &ts);
+	}
+	tune_parked--;
+	pthread_mutex_unlock(&tune_lock);
+}
+
+/* wait for all the miner threads to leave their scan */
+static bool tune_wait_parked()
+{
+	struct timespec ts;
+	time_t end = time(NULL) + TUNE_PARK_WAIT;
+	bool ok;
+	pthread_mutex_lock(&tune_lock);
+	while (tune_parked < miner_threads_started() && !abort_flag && time(NULL) < end) {
+		tune_deadline(&ts, 1);
+		pthread_cond_timedwait(&tune_cond, &tune_lock, &ts);
+	}
+	ok = tune_parked >= miner_threads_started();
+	pthread_mutex_unlock(&tune_lock);
+	return ok;
+}
+
+static void tune_resume()
+{
+	pthread_mutex_lock(&tune_lock);
+	tune_running = false;
+	pthread_cond_broadcast(&tune_cond);
+	pthread_mutex_unlock(&tune_lock);
+}
+
+/**
+ * Called at startup, before the mining threads are started
+ * threads is the -t value, 0 if not set
+ */
+bool autotune_startup(int *threads)
+{
+	struct autotune_result res;
+	char key[192], buf[64];
+
+	topology_read();
+	tune_host_key(key, sizeof(key));
+	if (!opt_tune_force && tune_load(key, &res) && (!*threads || *threads == res.threads)) {
+		format_hashrate(res.hashrate, buf);
+		applog(LOG_INFO, "Tuning profile loaded: %d threads, %s placement (%s)",
+			res.threads, res.placement, buf);
+	} else {
+		applog(LOG_INFO, "Tuning %s, it can take a few minutes...", key);
+		tune_running = true;
+		if (!tune_sweep(*threads, &res)) {
+			tune_running = false;
+			applog(LOG_WARNING, "autotune failed, using the default settings");
+			return false;
+		}
+		tune_running = false;
+		format_hashrate(res.hashrate, buf);
+		applog(LOG_NOTICE, "autotune: best is %d threads with %s placement, %s",
+			res.threads, res.placement, buf);
+		tune_save(key, &res);
+	}
+	*threads = res.threads;
+	topology_set_placement(res.placement);
+	return true;
+}
+
+/* api "autotune" command, the miners are paused during the sweep */
+static void *tune_runtime_thread(void *userdata)
+{
+	struct autotune_result res;
+	char key[192], buf[64];
+
+	memset(&res, 0, sizeof(res));
+	tune_host_key(key, sizeof(key));
+	restart_threads();
+	if (!tune_wait_parked()) {
+		applog(LOG_WARNING, "autotune: the mining threads did not pause, cancelled");
+		tune_resume();
+		return NULL;
+	}
+	applog(LOG_NOTICE, "autotune: mining paused, tuning %s", key);
+	if (tune_sweep(0, &res)) {
+		format_hashrate(res.hashrate, buf);
+		applog(LOG_NOTICE, "autotune: best is %d threads with %s placement, %s",
+			res.threads, res.placement, buf);
+		tune_save(key, &res);
+		topology_set_placement(res.placement);
+	}
+	// rebind the mining threads
+	topology_compute(opt_n_threads);
+	tune_resume();
+	if (res.threads && res.threads != opt_n_threads && !miner_set_threads(res.threads))
+		applog(LOG_WARNING, "autotune: restart the miner to use %d threads", res.threads);
+	return NULL;
+}
+
+bool autotune_request()
+{
+	pthread_t pth;
+	if (tune_running)
+		return false;
+	tune_running = true;
+	if (pthread_create(&pth, NULL, tune_runtime_thread, NULL)) {
+		tune_running = false;
+		return false;
+	}
+	pthread_detach(pth);
+	return true;
+}
@@ -1,170 +1,253 @@
 /**
- * Made to benchmark and test algo switch
+ * Verus benchmark (--benchmark)
+ *
+ * Each thread hashes a synthetic verus 2.2 job (block header version 4,
+ * solution version 7 with a pbaas header, so the merged mining layout
+ * is cleared like on the real merged mined jobs). The hashes of each
+ * thread are sampled every second after the warm-up, the result is the
+ * mean rate with the 95% confidence interval of the samples, logged and
+ * written in json (--bench-json).
  *
  * 2015 - tpruvot@github
  */
 
+#include <ccminer-config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <unistd.h>
 
 #include "miner.h"
 #include "algos.h"
-
-#ifdef __APPLE__
-#include "compat/pthreads/pthread_barrier.hpp"
-#endif
-
-int bench_algo = -1;
-
-static double algo_hashrates[MAX_GPUS][ALGO_COUNT] = { 0 };
-static uint32_t algo_throughput[MAX_GPUS][ALGO_COUNT] = { 0 };
-static int algo_mem_used[MAX_GPUS][ALGO_COUNT] = { 0 };
-static int device_mem_free[MAX_GPUS] = { 0 };
-
-static pthread_barrier_t miner_barr;
-static pthread_barrier_t algo_barr;
-static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
-
-extern double thr_hashrates[MAX_GPUS];
-
-void bench_init(int threads)
+#include "equi/equihash.h"
+
+#define BENCH_SCAN_NONCES 0x4000
+#define BENCH_SAMPLE_MS   1000
+#define BENCH_MAX_SAMPLES 3600
+
+int opt_bench_warmup = 3;       /* seconds */
+uint64_t opt_bench_hashes = 0;  /* stop after N hashes, 0 = --time-limit */
+char *opt_bench_json = NULL;    /* "-" for stdout */
+
+struct bench_thread {
+	pthread_t pth;
+	int thr_id;
+	volatile uint64_t hashes;
+	uint64_t last;
+	double sum, sum2; /* of the sampled rates */
+	uint64_t total;   /* after the warm-up */
+};
+
+extern int opt_time_limit;
+
+static volatile bool bench_stop = false;
+static double rates[BENCH_MAX_SAMPLES]; /* total of each sample, for the comparisons */
+
+/* student t (97.5%) for 1 to 30 degrees of freedom */
+static const double t975[30] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static uint32_t bench_rand(uint32_t *state)
 {
-	bench_algo = opt_algo = (enum sha_algos) 0; /* first */
-	applog(LOG_BLUE, "Starting benchmark mode with %s", algo_names[opt_algo]);
-	pthread_barrier_init(&miner_barr, NULL, threads);
-	pthread_barrier_init(&algo_barr, NULL, threads);
-	// required for usage of first algo.
-	
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
 }
 
-void bench_free()
+/**
+ * Synthetic verus 2.2 job, the same for each run (per thread data) and
+ * with a target which can't be reached
+ */
+void bench_work(struct work *work, int thr_id)
 {
-	pthread_barrier_destroy(&miner_barr);
-	pthread_barrier_destroy(&algo_barr);
+	uint32_t seed = 0x56525553U ^ ((uint32_t) thr_id * 0x9e3779b9U);
+	memset(work, 0, sizeof(*work));
+	for (int i = 0; i < 35; i++)
+		work->data[i] = bench_rand(&seed);
+	work->data[0] = 4;                   // block version
+	for (int i = 0; i < 1344; i++)
+		work->solution[i] = (uint8_t) bench_rand(&seed);
+	work->solution[0] = 7;               // solution version (v2.2)
+	work->solution[1] = work->solution[2] = work->solution[3] = 0;
+	work->solution[4] = 0;               // descriptor bits
+	work->solution[5] = 1;               // one pbaas header, merged mining
+	work->solution[6] = work->solution[7] = 0;
+	snprintf(work->job_id, sizeof(work->job_id), "bench%d", thr_id);
+	work->targetdiff = 1e12;
 }
 
-// required to switch algos
-void algo_free_all(int thr_id)
+static void *bench_thread(void *userdata)
 {
-	// only initialized algos will be freed
-
-
+	struct bench_thread *bt = (struct bench_thread *) userdata;
+	struct work work;
+
+	topology_bind_miner(bt->thr_id);
+	bench_work(&work, bt->thr_id);
+	while (!bench_stop) {
+		unsigned long hashes_done = 0;
+		numa_restart(bt->thr_id)->restart = 0;
+		work.valid_nonces = 0;
+		work.data[EQNONCE_OFFSET + 2]++; // another nonce space per scan
+		scanhash_verus(bt->thr_id, &work, BENCH_SCAN_NONCES, &hashes_done);
+		bt->hashes += hashes_done;
+	}
+	return NULL;
+}
 
+static double ci95(double sum, double sum2, int n)
+{
+	double mean, var;
+	if (n < 2)
+		return 0.;
+	mean = sum / n;
+	var = max(0., (sum2 - n * mean * mean) / (n - 1));
+	return (n <= 31 ? t975[n - 2] : 1.96) * sqrt(var / n);
 }
 
-// benchmark all algos (called once per mining thread)
-bool bench_algo_switch_next(int thr_id)
+static void bench_write_json(struct bench_thread *bt, int nthreads, int samples,
+	double seconds, double mean, double ci)
 {
-	int algo = (int) opt_algo;
-	int prev_algo = algo;
-	int dev_id = device_map[thr_id % MAX_GPUS];
-	int mfree, mused;
-	// doesnt seems enough to prevent device slow down
-	// after some algo switchs
-	bool need_reset = (gpu_threads == 1);
-
-	algo++;
-
-	// skip some duplicated algos
-	if (algo == ALGO_C11) algo++; // same as x11
-	if (algo == ALGO_DMD_GR) algo++; // same as groestl
-	if (algo == ALGO_HEAVY) algo++; // dead
-	if (algo == ALGO_MJOLLNIR) algo++; // same as heavy
-	if (algo == ALGO_KECCAKC) algo++; // same as keccak
-	if (algo == ALGO_WHIRLCOIN) algo++; // same as whirlpool
-	if (algo == ALGO_WHIRLPOOLX) algo++; // disabled
-	// todo: algo switch from RPC 2.0
-	if (algo == ALGO_CRYPTOLIGHT) algo++;
-	if (algo == ALGO_CRYPTONIGHT) algo++;
-	if (algo == ALGO_WILDKECCAK) algo++;
-	if (algo == ALGO_QUARK) algo++; // to fix
-	if (algo == ALGO_LBRY ) algo++;
-
-	if (device_sm[dev_id] && device_sm[dev_id] < 300) {
-		// incompatible SM 2.1 kernels...
-		if (algo == ALGO_GROESTL) algo++;
-		if (algo == ALGO_MYR_GR) algo++;
-		if (algo == ALGO_NEOSCRYPT) algo++;
-		if (algo == ALGO_WHIRLPOOLX) algo++;
+	json_t *root = json_object(), *arr = json_array(), *runs = json_array();
+	uint64_t hashes = 0;
+	int rc = 0;
+
+	for (int t = 0; t < nthreads; t++) {
+		json_t *th = json_object();
+		double rate = samples ? bt[t].sum / samples : 0.;
+		hashes += bt[t].total;
+		json_object_set_new(th, "thread", json_integer(t));
+		json_object_set_new(th, "cpu", json_integer(topology_thread_cpu(t)));
+		json_object_set_new(th, "hashes", json_integer((json_int_t) bt[t].total));
+		json_object_set_new(th, "hashrate", json_real(rate));
+		json_object_set_new(th, "ci95", json_real(ci95(bt[t].sum, bt[t].sum2, samples)));
+		json_array_append_new(arr, th);
 	}
-	// and unwanted ones...
-	if (algo == ALGO_SCRYPT) algo++;
-	if (algo == ALGO_SCRYPT_JANE) algo++;
-
-	// free current algo memory and track mem usage
-	mused = 10;
-	algo_free_all(thr_id);
-	
-
-	// device can take some time to free
-	mfree = 10;
-	if (device_mem_free[thr_id] > mfree) {
-		sleep(1);
-		mfree = 10;
+	json_object_set_new(root, "algo", json_string("verus"));
+	json_object_set_new(root, "job", json_string("2.2"));
+	json_object_set_new(root, "version", json_string(PACKAGE_VERSION));
+#ifdef __VERSION__
+	json_object_set_new(root, "compiler", json_string(__VERSION__));
+#endif
+	json_object_set_new(root, "threads", json_integer(nthreads));
+	json_object_set_new(root, "placement", json_string(topology_placement_name()));
+	json_object_set_new(root, "warmup", json_integer(opt_bench_warmup));
+	json_object_set_new(root, "seconds", json_real(seconds));
+	json_object_set_new(root, "samples", json_integer(samples));
+	json_object_set_new(root, "hashes", json_integer((json_int_t) hashes));
+	json_object_set_new(root, "hashrate", json_real(mean));
+	json_object_set_new(root, "ci95", json_real(ci));
+	json_object_set_new(root, "per_thread", arr);
+	for (int i = 0; i < samples; i++)
+		json_array_append_new(runs, json_real(rates[i]));
+	json_object_set_new(root, "rates", runs);
+
+	if (!strcmp(opt_bench_json, "-")) {
+		char *s = json_dumps(root, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+		if (s) {
+			printf("%s\n", s);
+			fflush(stdout);
+			free(s);
+		}
+	} else {
+		rc = json_dump_file(root, opt_bench_json, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
 	}
+	json_decref(root);
+	if (rc)
+		applog(LOG_ERR, "Unable to write the benchmark result to %s", opt_bench_json);
+}
 
-	// we need to wait completion on all cards before the switch
-	if (opt_n_threads > 1) {
-		pthread_barrier_wait(&miner_barr);
+/**
+ * Run the benchmark, instead of the pool connection and the miners
+ */
+int bench_run(int nthreads)
+{
+	struct bench_thread *bt;
+	double sum = 0., sum2 = 0., seconds = 0., mean, ci;
+	uint64_t tm_prev, now, total = 0;
+	int duration = opt_time_limit > 0 ? opt_time_limit : 30;
+	int samples = 0, started = 0;
+	char rate[32], err[32];
+
+	nthreads = min(nthreads, MAX_GPUS);
+	bt = (struct bench_thread *) calloc(nthreads, sizeof(*bt));
+	if (!bt)
+		return EXIT_CODE_SW_INIT_ERROR;
+
+	applog(LOG_BLUE, "Benchmark: verus 2.2 job, %d thread%s, %ds warm-up, %s", nthreads,
+		nthreads > 1 ? "s" : "", opt_bench_warmup, opt_bench_hashes ? "hash count" : "duration");
+	bench_stop = false;
+	for (int t = 0; t < nthreads; t++) {
+		bt[t].thr_id = t;
+		if (pthread_create(&bt[t].pth, NULL, bench_thread, &bt[t])) {
+			applog(LOG_ERR, "benchmark thread %d create failed", t);
+			break;
+		}
+		started++;
 	}
 
-	char rate[32] = { 0 };
-	double hashrate = stats_get_speed(thr_id, thr_hashrates[thr_id]);
-	format_hashrate(hashrate, rate);
-	gpulog(LOG_NOTICE, thr_id, "%s hashrate = %s", algo_names[prev_algo], rate);
-
-	// ensure memory leak is still real after the barrier
-	
-
-	// check if there is memory leak
-	
-	// store used memory per algo
-	algo_mem_used[thr_id][opt_algo] = device_mem_free[thr_id] - mused;
-	device_mem_free[thr_id] = mfree;
-
-	// store to dump a table per gpu later
-	algo_hashrates[thr_id][prev_algo] = hashrate;
-
-	// wait the other threads to display logs correctly
-	if (opt_n_threads > 1) {
-		pthread_barrier_wait(&algo_barr);
+	sleep(opt_bench_warmup);
+	for (int t = 0; t < started; t++)
+		bt[t].last = bt[t].hashes;
+	tm_prev = latency_now();
+
+	while (!abort_flag && samples < BENCH_MAX_SAMPLES) {
+		double dt, window = 0.;
+		usleep(BENCH_SAMPLE_MS * 1000);
+		now = latency_now();
+		dt = 1e-9 * (double) (now - tm_prev);
+		tm_prev = now;
+		for (int t = 0; t < started; t++) {
+			uint64_t h = bt[t].hashes, delta = h - bt[t].last;
+			double r = (double) delta / dt;
+			bt[t].last = h;
+			bt[t].total += delta;
+			bt[t].sum += r;
+			bt[t].sum2 += r * r;
+			window += r;
+			total += delta;
+		}
+		rates[samples] = window;
+		sum += window;
+		sum2 += window * window;
+		seconds += dt;
+		samples++;
+		if (opt_bench_hashes ? total >= opt_bench_hashes : seconds >= duration)
+			break;
 	}
-
-	if (algo == ALGO_AUTO)
-		return false; // all algos done
-
-	// mutex primary used for the stats purge
-	pthread_mutex_lock(&bench_lock);
-	stats_purge_all();
-
-	opt_algo = (enum sha_algos) algo;
-	global_hashrate = 0;
-	thr_hashrates[thr_id] = 0; // reset for minmax64
-	pthread_mutex_unlock(&bench_lock);
-
-	
-
-	if (thr_id == 0)
-		applog(LOG_BLUE, "Benchmark algo %s...", algo_names[algo]);
-
-	return true;
+	bench_stop = true;
+	for (int t = 0; t < started; t++)
+		pthread_join(bt[t].pth, NULL);
+
+	mean = samples ? sum / samples : 0.;
+	ci = ci95(sum, sum2, samples);
+	for (int t = 0; t < started && !opt_quiet; t++) {
+		format_hashrate(samples ? bt[t].sum / samples : 0., rate);
+		format_hashrate(ci95(bt[t].sum, bt[t].sum2, samples), err);
+		applog(LOG_INFO, "CPU T%d: %s +/- %s", t, rate, err);
+	}
+	format_hashrate(mean, rate);
+	format_hashrate(ci, err);
+	applog(LOG_NOTICE, "Benchmark: %s +/- %s (95%%), %d samples of %ds", rate, err,
+		samples, BENCH_SAMPLE_MS / 1000);
+
+	if (opt_bench_json)
+		bench_write_json(bt, started, samples, seconds, mean, ci);
+	free(bt);
+	return started == nthreads ? EXIT_CODE_OK : EXIT_CODE_SW_INIT_ERROR;
 }
 
-void bench_set_throughput(int thr_id, uint32_t throughput)
+// required to switch algos
+void algo_free_all(int thr_id)
 {
-	algo_throughput[thr_id][opt_algo] = throughput;
-}
+	// only initialized algos will be freed
+
+
 
-void bench_display_results()
-{
-	for (int n=0; n < opt_n_threads; n++)
-	{
-		int dev_id = device_map[n];
-		applog(LOG_BLUE, "Benchmark results for GPU #%d - %s:", dev_id, device_name[dev_id]);
-		for (int i=0; i < ALGO_COUNT-1; i++) {
-			double rate = algo_hashrates[n][i];
-			if (rate == 0.0) continue;
-			applog(LOG_INFO, "%12s : %12.1f kH/s, %5d MB, %8u thr.", algo_names[i],
-				rate / 1024., algo_mem_used[n][i], algo_throughput[n][i]);
-		}
-	}
 }
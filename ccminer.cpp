@@ -117,6 +117,7 @@ static json_t *opt_config;
 static const bool opt_time = true;
 volatile enum sha_algos opt_algo = ALGO_AUTO;
 int opt_n_threads = 0;
+int opt_max_threads = 0;
 int gpu_threads = 1;
 int64_t opt_affinity = -1L;
 int opt_priority = 0;
@@ -195,6 +196,13 @@ volatile bool abort_flag = false;
 struct work_restart *work_restart = NULL;
 static int app_exit_code = EXIT_CODE_OK;
 
+/* runtime thread count, see miner_set_threads() */
+static int thr_max = 0;          /* miner slots of thr_info */
+static int thr_started = 0;      /* miner threads created */
+static volatile uint32_t thr_partition = 0; /* nonce ranges generation */
+static pthread_mutex_t thr_resize_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t thr_resize_signal = 0;
+
 pthread_mutex_t applog_lock;
 pthread_mutex_t stats_lock;
 double thr_hashrates[MAX_GPUS] = { 0 };
@@ -228,6 +236,9 @@ char *opt_api_mcast_addr = strdup(API_MCAST_ADDR);
 char *opt_api_mcast_code = strdup(API_MCAST_CODE);
 char *opt_api_mcast_des = strdup("");
 int opt_api_mcast_port = 4068;
+int opt_api_push = 1000; /* ms between push updates, 0 to disable */
+bool opt_perf_counters = false;
+uint32_t opt_phase_sample = 0; /* power of 2, 0 to disable */
 
 bool opt_stratum_stats = false;
 
@@ -322,6 +333,7 @@ Options:\n\
       --cert=FILE       certificate for mining server using SSL\n\
   -x, --proxy=[PROTOCOL://]HOST[:PORT]  connect through a proxy\n\
   -t, --threads=N       number of miner threads (default: number of nVidia GPUs)\n\
+      --max-threads=N   limit of the threads added at runtime (default: cpus)\n\
   -r, --retries=N       number of times to retry if a network call fails\n\
                           (default: retry indefinitely)\n\
   -R, --retry-pause=N   time to pause between retries, in seconds (default: 30)\n\
@@ -343,10 +355,31 @@ Options:\n\
   -P, --protocol-dump   verbose dump of protocol-level activities\n\
       --cpu-affinity    set process affinity to cpu core(s), mask 0x3 for cores 0 and 1\n\
       --cpu-priority    set process priority (default: 3) 0 idle, 2 normal to 5 highest\n\
+      --cpu-placement=P threads placement: cores (default, smt siblings last), compact,\n\
+                        scatter (across L3 domains), linear (thread n on cpu n) or none\n\
+      --cpu-exclude=L   cpus not used by the miner threads, ex: 0,8-11\n\
+      --cpu-reserve     reserve a core for the network, api and log threads\n\
+      --core-type=T     hybrid cpus: mine on the P or E cores only (default: any)\n\
+      --autotune[=force] pick the threads count and placement with short hashing\n\
+                        trials, the result is stored in a profile for the next starts\n\
+      --autotune-file=F tuning profiles file (default: ~/.ccminer-autotune.json)\n\
+      --no-numa         do not replicate the job and restart flags on each numa node\n\
+      --no-cgroup       ignore the cgroup cpu quota and cpuset (containers)\n\
+      --thread-parking  move or pause the threads on cpus with steal/irq time\n\
+      --verify-shares   hash the shares again with the portable code before the submit\n\
+      --verify-disable=N stop a thread once its cpu has N hardware errors (default: 0, never)\n\
+      --verify-server[=PATH] verify the shares of a pool on stdin or on a unix socket\n\
+      --perf-counters   sample the cpu performance counters of each thread (linux, see api)\n\
+      --phase-sample=N  account the cycles of each hash phase every N hashes (see api)\n\
+      --log-rate=N      limit the info and debug log lines to N per second\n\
+      --sync-log        write the log lines from the calling thread (no log thread)\n\
   -b, --api-bind=port   IP:port for the miner API (default: 127.0.0.1:4068), 0 disabled\n\
       --api-remote      Allow remote control, like pool switching, imply --api-allow=0/0\n\
       --api-allow=...   IP/mask of the allowed api client(s), 0/0 for all\n\
-      --max-temp=N      Only mine if gpu temp is less than specified value\n\
+      --api-push=N      delay in ms between api subscription updates (default: 1000), 0 disabled\n\
+      --max-temp=N      Keep the cpu package temperature under N (C), see --resume-temp\n\
+      --max-power=N     Keep the cpu packages power under N watts (rapl)\n\
+      --governor-hysteresis=N  % under the limits to mine more again (default: 5)\n\
       --max-rate=N[KMG] Only mine if net hashrate is less than specified value\n\
       --max-diff=N      Only mine if net difficulty is less than specified value\n\
                         Can be tuned with --resume-diff=N to set a resume value\n\
@@ -374,7 +407,14 @@ Options:\n\
 "\
       --hide-diff       hide submitted block and net difficulty (old mode)\n\
   -B, --background      run the miner in the background\n\
-      --benchmark       run in offline benchmark mode\n\
+      --benchmark       run in offline benchmark mode (see --time-limit)\n\
+      --bench-hashes=N  stop the benchmark after N hashes\n\
+      --bench-warmup=N  seconds not counted at the benchmark start (default: 3)\n\
+      --bench-json=FILE write the benchmark result in json, - for stdout\n\
+      --bench-stratum[=N] benchmark the stratum path on N messages (default: 100000)\n\
+      --record=FILE     record the stratum session lines in FILE\n\
+      --replay=FILE     replay a recorded stratum session on a local socket\n\
+      --replay-speed=X  replay X times faster (default: 1, 0 for max speed)\n\
       --cputest         debug hashes from cpu algorithms\n\
   -c, --config=FILE     load a JSON-format configuration file\n\
   -V, --version         display version information and exit\n\
@@ -398,13 +438,37 @@ struct option options[] = {
 	{ "api-mcast-code", 1, NULL, 1035 },
 	{ "api-mcast-port", 1, NULL, 1036 },
 	{ "api-mcast-des", 1, NULL, 1037 },
+	{ "api-push", 1, NULL, 1038 },
 	{ "background", 0, NULL, 'B' },
 	{ "benchmark", 0, NULL, 1005 },
+	{ "bench-hashes", 1, NULL, 1058 },
+	{ "bench-warmup", 1, NULL, 1059 },
+	{ "bench-json", 1, NULL, 1066 },
+	{ "bench-stratum", 2, NULL, 1078 },
+	{ "record", 1, NULL, 1067 },
+	{ "replay", 1, NULL, 1068 },
+	{ "replay-speed", 1, NULL, 1069 },
 	{ "cert", 1, NULL, 1001 },
 	{ "config", 1, NULL, 'c' },
 	{ "cputest", 0, NULL, 1006 },
 	{ "cpu-affinity", 1, NULL, 1020 },
 	{ "cpu-priority", 1, NULL, 1021 },
+	{ "perf-counters", 0, NULL, 1039 },
+	{ "phase-sample", 1, NULL, 1040 },
+	{ "log-rate", 1, NULL, 1041 },
+	{ "sync-log", 0, NULL, 1042 },
+	{ "cpu-placement", 1, NULL, 1043 },
+	{ "cpu-exclude", 1, NULL, 1044 },
+	{ "cpu-reserve", 0, NULL, 1045 },
+	{ "autotune", 2, NULL, 1046 },
+	{ "autotune-file", 1, NULL, 1047 },
+	{ "no-numa", 0, NULL, 1048 },
+	{ "no-cgroup", 0, NULL, 1049 },
+	{ "thread-parking", 0, NULL, 1052 },
+	{ "verify-shares", 0, NULL, 1076 },
+	{ "verify-disable", 1, NULL, 1077 },
+	{ "verify-server", 2, NULL, 1079 },
+	{ "core-type", 1, NULL, 1053 },
 	{ "cuda-schedule", 1, NULL, 1025 },
 	{ "debug", 0, NULL, 'D' },
 	{ "help", 0, NULL, 'h' },
@@ -423,6 +487,8 @@ struct option options[] = {
 	{ "scratchpad", 1, NULL, 'k' },    // bbr
 	{ "bfactor", 1, NULL, 1055 },      // xmr
 	{ "max-temp", 1, NULL, 1060 },
+	{ "max-power", 1, NULL, 1054 },
+	{ "governor-hysteresis", 1, NULL, 1056 },
 	{ "max-diff", 1, NULL, 1061 },
 	{ "max-rate", 1, NULL, 1062 },
 	{ "resume-diff", 1, NULL, 1063 },
@@ -462,6 +528,7 @@ struct option options[] = {
 	{ "shares-limit", 1, NULL, 1009 },
 	{ "time-limit", 1, NULL, 1008 },
 	{ "threads", 1, NULL, 't' },
+	{ "max-threads", 1, NULL, 1057 },
 	{ "vote", 1, NULL, 1022 },
 	{ "trust-pool", 0, NULL, 1023 },
 	{ "timeout", 1, NULL, 'T' },
@@ -533,27 +600,8 @@ static inline void drop_policy(void) {
 		sched_setscheduler(0, SCHED_BATCH, &param);
 #endif
 }
-
-static void affine_to_cpu(int id) {
-	cpu_set_t set;
-	CPU_ZERO(&set);
-	CPU_SET(id, &set);
-	// thread only
-#if !(defined(__ANDROID__) || (__ANDROID_API__ > 23))
-		pthread_setaffinity_np(thr_info[id].pth, sizeof(&set), &set);
-#else
-		sched_setaffinity(0, sizeof(&set), &set);
-#endif
-}
-#elif defined(__FreeBSD__) /* FreeBSD specific policy and affinity management */
-#include <sys/cpuset.h>
+#elif defined(__FreeBSD__) /* FreeBSD specific policy (affinity in topology.cpp) */
 static inline void drop_policy(void) { }
-static void affine_to_cpu(int id) {
-	cpuset_t set;
-	CPU_ZERO(&set);
-	CPU_SET(id, &set);
-	cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1, sizeof(cpuset_t), &set);
-}
 #elif defined(WIN32) /* Windows */
 static inline void drop_policy(void) { }
 static void affine_to_cpu_mask(int id, unsigned long mask) {
@@ -602,6 +650,9 @@ void proper_exit(int reason)
 		reason = app_exit_code;
 	}
 
+	latency_log_summary();
+	record_close();
+
 	pthread_mutex_lock(&stats_lock);
 	if (check_dups)
 		hashlog_purge_all();
@@ -852,6 +903,11 @@ int share_result(int result, int pooln, double sharediff, const char *reason)
 		sprintf(solved, " solved: %u", p->solved_count);
 	}
 
+	api_push_event(API_PUSH_SHARES, "ACC=%d;POOL=%d;DIFF=%.6f;SOLV=%d;PING=%u;REASON=%s",
+		result ? 1 : 0, pooln, sharediff, solved[0] ? 1 : 0,
+		stratum.answer_msec, reason ? reason : "");
+	PROBE4(share_result, result, pooln, stratum.answer_msec, reason);
+
 	applog(LOG_NOTICE, "accepted: %lu/%lu (%s), %s %s%s",
 			p->accepted_count,
 			p->accepted_count + p->rejected_count,
@@ -1126,6 +1182,7 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 						algo_names[opt_algo], work->height);
 				}
 				g_work.height = work->height;
+				numa_work_updated();
 			}
 		}
 	}
@@ -1373,6 +1430,8 @@ static void *workio_thread(void *userdata)
 	CURL *curl;
 	bool ok = true;
 
+	topology_bind_service();
+
 	curl = curl_easy_init();
 	if (unlikely(!curl)) {
 		applog(LOG_ERR, "CURL initialization failed");
@@ -1428,18 +1487,7 @@ bool get_work(struct thr_info *thr, struct work *work)
 	struct work *work_heap;
 
 	if (opt_benchmark) {
-		memset(work->data, 0x55, 76);
-		//work->data[17] = swab32((uint32_t)time(NULL));
-		memset(work->data + 19, 0x00, 52);
-		if (opt_algo == ALGO_DECRED) {
-			memset(&work->data[35], 0x00, 52);
-		} else if (opt_algo == ALGO_LBRY) {
-			work->data[28] = 0x80000000;
-		} else {
-			work->data[20] = 0x80000000;
-			work->data[31] = 0x00000280;
-		}
-		memset(work->target, 0x00, sizeof(work->target));
+		bench_work(work, thr->id);
 		return true;
 	}
 
@@ -1470,9 +1518,10 @@ bool get_work(struct thr_info *thr, struct work *work)
 	return true;
 }
 
-static bool submit_work(struct thr_info *thr, const struct work *work_in)
+bool submit_work(struct thr_info *thr, const struct work *work_in)
 {
 	struct workio_cmd *wc;
+	uint64_t tsc = opt_phase_sample ? phase_tsc() : 0;
 	/* fill out work request message */
 	wc = (struct workio_cmd *)calloc(1, sizeof(*wc));
 	if (!wc)
@@ -1491,6 +1540,8 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
 	if (!tq_push(thr_info[work_thr_id].q, wc))
 		goto err_out;
 
+	if (tsc)
+		phase_add(thr->id, PHASE_QUEUE_WAIT, phase_tsc() - tsc);
 	return true;
 
 err_out:
@@ -1498,7 +1549,7 @@ err_out:
 	return false;
 }
 
-static bool stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
+bool stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 {
 	uchar merkle_root[64] = { 0 };
 	int i;
@@ -1654,6 +1705,7 @@ static bool stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 		// applog(LOG_DEBUG, "DEBUG: vote=%hx reward=%hx", ext[0], ext[1]);
 	}
 
+	PROBE4(job_publish, work->job_id, work->height, sctx->job.clean, sctx->pooln);
 	pthread_mutex_unlock(&stratum_work_lock);
 
 	if (opt_debug && opt_algo != ALGO_DECRED && opt_algo != ALGO_EQUIHASH && opt_algo != ALGO_SIA) {
@@ -1724,8 +1776,18 @@ void restart_threads(void)
 	if (opt_debug && !opt_quiet)
 		applog(LOG_DEBUG,"%s", __FUNCTION__);
 
-	for (int i = 0; i < opt_n_threads && work_restart; i++)
-		work_restart[i].restart = 1;
+	for (int i = 0; i < max(opt_n_threads, thr_started) && work_restart; i++)
+		numa_restart_thread(i);
+}
+
+/* the threads above can be paused (cgroup quota, contention) */
+static int last_mining_thread()
+{
+	for (int i = opt_n_threads - 1; i > 0; i--)
+		if (!cgroup_thread_parked(i) && !park_thread_parked(i) && !governor_thread_parked(i) &&
+		    !verify_thread_disabled(i))
+			return i;
+	return 0;
 }
 
 static bool wanna_mine(int thr_id)
@@ -1791,7 +1853,10 @@ static void *miner_thread(void *userdata)
 	struct work work;
 	uint64_t loopcnt = 0;
 	uint32_t max_nonce;
-	uint32_t end_nonce = UINT32_MAX / opt_n_threads * (thr_id + 1) - (thr_id + 1);
+	// a thread added at runtime can start before opt_n_threads is raised
+	uint32_t part_gen = thr_partition;
+	uint32_t end_nonce = UINT32_MAX / max(opt_n_threads, thr_id + 1) * (thr_id + 1) - (thr_id + 1);
+	bool repartition = false;
 	time_t tm_rate_log = 0;
 	bool work_done = false;
 	bool extrajob = false;
@@ -1832,11 +1897,16 @@ static void *miner_thread(void *userdata)
 		drop_policy();
 	}
 
-	/* Cpu thread affinity */
+	/* Cpu thread affinity, see topology_init() */
+	uint32_t topo_gen = topology_generation();
+	bool parked = false;
 	if (num_cpus > 1) {
-		affine_to_cpu(thr_id);
+		topology_bind_miner(thr_id);
 	}
 
+	if (opt_perf_counters)
+		perf_thread_init(thr_id);
+
 
 
 	while (!abort_flag) {
@@ -1845,6 +1915,7 @@ static void *miner_thread(void *userdata)
 		uint32_t start_nonce;
 		uint32_t scan_time = have_longpoll ? LP_SCANTIME : opt_scantime;
 		uint64_t max64, minmax = 0x100000;
+		uint64_t tsc_lock = 0;
 		int nodata_check_oft = 0;
 		bool regen = false;
 
@@ -1865,6 +1936,26 @@ static void *miner_thread(void *userdata)
 			wcmplen = 4+32+32;
 		}
 
+		/* paused during the api autotune trials */
+		if (autotune_running()) {
+			autotune_park();
+			continue;
+		}
+
+		/* SIGUSR1/SIGUSR2 */
+		if (!thr_id && thr_resize_signal) {
+			int n = opt_n_threads + thr_resize_signal;
+			thr_resize_signal = 0;
+			miner_set_threads(n);
+		}
+
+		/* the thread count changed, split the nonce space again */
+		if (part_gen != thr_partition) {
+			part_gen = thr_partition;
+			end_nonce = UINT32_MAX / max(opt_n_threads, thr_id + 1) * (thr_id + 1) - (thr_id + 1);
+			repartition = true;
+		}
+
 		if (have_stratum) {
 			uint32_t sleeptime = 0;
 
@@ -1881,6 +1972,7 @@ static void *miner_thread(void *userdata)
 			if (sleeptime && opt_debug && !opt_quiet)
 				applog(LOG_DEBUG, "sleeptime: %u ms", sleeptime*100);
 			//nonceptr = (uint32_t*) (((char*)work.data) + wcmplen);
+			tsc_lock = opt_phase_sample ? phase_tsc() : 0;
 			pthread_mutex_lock(&g_work_lock);
 			extrajob |= work_done;
 
@@ -1895,18 +1987,22 @@ static void *miner_thread(void *userdata)
 				extrajob = false;
 				if (stratum_gen_work(&stratum, &g_work))
 					g_work_time = time(NULL);
+				numa_work_updated();
 				if (opt_algo == ALGO_CRYPTONIGHT || opt_algo == ALGO_CRYPTOLIGHT)
 					nonceptr[0] += 0x100000;
 			}
 		} else {
 			uint32_t secs = 0;
+			tsc_lock = opt_phase_sample ? phase_tsc() : 0;
 			pthread_mutex_lock(&g_work_lock);
 			secs = (uint32_t) (time(NULL) - g_work_time);
 			if (secs >= scan_time || nonceptr[0] >= (end_nonce - 0x100)) {
 				if (opt_debug && g_work_time && !opt_quiet)
 					applog(LOG_DEBUG, "work time %u/%us nonce %x/%x", secs, scan_time, nonceptr[0], end_nonce);
 				/* obtain new work from internal workio thread */
-				if (unlikely(!get_work(mythr, &g_work))) {
+				bool got = get_work(mythr, &g_work);
+				numa_work_updated();
+				if (unlikely(!got)) {
 					pthread_mutex_unlock(&g_work_lock);
 					if (switchn != pool_switch_count) {
 						switchn = pool_switch_count;
@@ -1920,36 +2016,45 @@ static void *miner_thread(void *userdata)
 			}
 		}
 
+		if (tsc_lock)
+			phase_add(thr_id, PHASE_LOCK_WAIT, phase_tsc() - tsc_lock);
+
+		// node local copy of g_work
+		struct work *gw = numa_work_local(thr_id, &g_work);
+
 		// reset shares id counter on new job
-		if (strcmp(work.job_id, g_work.job_id))
+		if (strcmp(work.job_id, gw->job_id)) {
 			stratum.job.shares_count = 0;
+			PROBE2(thread_job, thr_id, gw->job_id);
+		}
 
-		if (!opt_benchmark && (g_work.height != work.height || memcmp(work.target, g_work.target, sizeof(work.target))))
+		if (!opt_benchmark && (gw->height != work.height || memcmp(work.target, gw->target, sizeof(work.target))))
 		{
 			if (opt_debug) {
-				uint64_t target64 = g_work.target[7] * 0x100000000ULL + g_work.target[6];
-				applog(LOG_DEBUG, "job %s target change: %llx (%.1f)", g_work.job_id, target64, g_work.targetdiff);
+				uint64_t target64 = gw->target[7] * 0x100000000ULL + gw->target[6];
+				applog(LOG_DEBUG, "job %s target change: %llx (%.1f)", gw->job_id, target64, gw->targetdiff);
 			}
-			memcpy(work.target, g_work.target, sizeof(work.target));
-			work.targetdiff = g_work.targetdiff;
-			work.height = g_work.height;
+			memcpy(work.target, gw->target, sizeof(work.target));
+			work.targetdiff = gw->targetdiff;
+			work.height = gw->height;
 			//nonceptr[0] = (UINT32_MAX / opt_n_threads) * thr_id; // 0 if single thr
 		}
 
-		if (memcmp(&work.data[wcmpoft], &g_work.data[wcmpoft], wcmplen)) {
+		if (repartition || memcmp(&work.data[wcmpoft], &gw->data[wcmpoft], wcmplen)) {
 			#if 0
 			if (opt_debug) {
 				for (int n=0; n <= (wcmplen-8); n+=8) {
-					if (memcmp(work.data + n, g_work.data + n, 8)) {
-						applog(LOG_DEBUG, "job %s work updated at offset %d:", g_work.job_id, n);
+					if (memcmp(work.data + n, gw->data + n, 8)) {
+						applog(LOG_DEBUG, "job %s work updated at offset %d:", gw->job_id, n);
 						applog_hash((uchar*) &work.data[n]);
-						applog_compare_hash((uchar*) &g_work.data[n], (uchar*) &work.data[n]);
+						applog_compare_hash((uchar*) &gw->data[n], (uchar*) &work.data[n]);
 					}
 				}
 			}
 			#endif
-			memcpy(&work, &g_work, sizeof(struct work));
-			nonceptr[0] = (UINT32_MAX / opt_n_threads) * thr_id; // 0 if single thr
+			memcpy(&work, gw, sizeof(struct work));
+			nonceptr[0] = (UINT32_MAX / max(opt_n_threads, thr_id + 1)) * thr_id; // 0 if single thr
+			repartition = false;
 		} else
 			nonceptr[0]++; //??
 
@@ -1959,6 +2064,7 @@ static void *miner_thread(void *userdata)
 			//applog_hex(&work.data[27], 32);
 		} 
 
+		latency_job_attach(thr_id);
 		pthread_mutex_unlock(&g_work_lock);
 
 		// --benchmark [-a all]
@@ -1975,6 +2081,26 @@ static void *miner_thread(void *userdata)
 		}
 		
 
+		/* removed, above the cgroup cpu quota, on a contended cpu, too hot or faulty */
+		if (thr_id >= opt_n_threads || cgroup_thread_parked(thr_id) || park_thread_parked(thr_id) ||
+		    governor_thread_parked(thr_id) || verify_thread_disabled(thr_id)) {
+			if (!parked) {
+				pthread_mutex_lock(&stats_lock);
+				thr_hashrates[thr_id] = 0;
+				stats_ignore_thread(thr_id);
+				pthread_mutex_unlock(&stats_lock);
+				parked = true;
+			}
+			sleep(1);
+			continue;
+		}
+		parked = false;
+		if (topo_gen != topology_generation()) {
+			topo_gen = topology_generation();
+			if (num_cpus > 1)
+				topology_bind_miner(thr_id);
+		}
+
 		/* conditional mining */
 		if (!wanna_mine(thr_id))
 		{
@@ -2011,7 +2137,11 @@ static void *miner_thread(void *userdata)
 
 		pool_on_hold = false;
 
-		work_restart[thr_id].restart = 0;
+		numa_restart(thr_id)->restart = 0;
+		/* autotune_request() raised the flag before this reset */
+		__sync_synchronize();
+		if (autotune_running())
+			continue;
 
 		/* adjust max_nonce to meet target scan time */
 		if (have_stratum)
@@ -2088,6 +2218,10 @@ static void *miner_thread(void *userdata)
 			}
 		}
 
+		/* short scans to follow the governor duty cycle */
+		if (governor_duty_cycle())
+			max64 = min(max64, 1);
+
 		max64 *= (uint32_t)thr_hashrates[thr_id];
 
 		/* on start, max64 should not be 0,
@@ -2203,6 +2337,7 @@ static void *miner_thread(void *userdata)
 		//	gpulog(LOG_WARNING, thr_id, "%s", cudaGetErrorString(err));
 
 		work.valid_nonces = 0;
+		latency_scan_start(thr_id);
 
 		/* scan nonces for a proof-of-work hash */
 		switch (opt_algo) {
@@ -2218,14 +2353,19 @@ static void *miner_thread(void *userdata)
 			goto out;
 		}
 
-		
+		latency_scan_end(thr_id, hashes_done);
+		perf_thread_add_hashes(thr_id, hashes_done);
+		if (opt_phase_sample)
+			phase_add_hashes(thr_id, hashes_done);
 
 		if (abort_flag)
 			break; // time to leave the mining loop...
 
-		if (work_restart[thr_id].restart)
+		if (numa_restart(thr_id)->restart)
 			continue;
 
+		governor_duty_pause(&tv_start);
+
 		/* record scanhash elapsed time */
 		gettimeofday(&tv_end, NULL);
 
@@ -2287,13 +2427,13 @@ static void *miner_thread(void *userdata)
 		}
 
 		/* ignore first loop hashrate */
-		if (firstwork_time && thr_id == (opt_n_threads - 1)) {
+		if (firstwork_time && thr_id == last_mining_thread()) {
 			double hashrate = 0.;
 			pthread_mutex_lock(&stats_lock);
-			for (int i = 0; i < opt_n_threads && thr_hashrates[i]; i++)
-				hashrate += stats_get_speed(i, thr_hashrates[i]);
+			for (int i = 0; i < opt_n_threads; i++)
+				if (thr_hashrates[i]) hashrate += stats_get_speed(i, thr_hashrates[i]);
 			pthread_mutex_unlock(&stats_lock);
-			if (opt_benchmark && bench_algo == -1 && loopcnt > 2) {
+			if (opt_benchmark && loopcnt > 2) {
 				format_hashrate(hashrate, s);
 				applog(LOG_NOTICE, "Total: %s", s);
 			}
@@ -2318,7 +2458,7 @@ static void *miner_thread(void *userdata)
 
 			work.submit_nonce_id = 0;
 			nonceptr[0] = work.nonces[0];
-			if (!submit_work(mythr, &work))
+			if (!verify_submit(mythr, &work))
 				break;
 			nonceptr[0] = curnonce;
 
@@ -2340,7 +2480,7 @@ static void *miner_thread(void *userdata)
 					work.data[0] = work.data[22]; // pok
 					work.data[22] = 0;
 				}
-				if (!submit_work(mythr, &work))
+				if (!verify_submit(mythr, &work))
 					break;
 				nonceptr[0] = curnonce;
 				work.nonces[1] = 0; // reset
@@ -2356,6 +2496,73 @@ out:
 	return NULL;
 }
 
+static bool start_miner_thread(int i)
+{
+	struct thr_info *thr = &thr_info[i];
+
+	thr->id = i;
+	thr->gpu.thr_id = i;
+	thr->gpu.gpu_id = (uint8_t) device_map[i];
+	//thr->gpu.gpu_arch = (uint16_t) device_sm[device_map[i]];
+	thr->q = tq_new();
+	if (!thr->q)
+		return false;
+
+	pthread_mutex_init(&thr->gpu.monitor.lock, NULL);
+	pthread_cond_init(&thr->gpu.monitor.sampling_signal, NULL);
+
+	if (unlikely(pthread_create(&thr->pth, NULL, miner_thread, thr))) {
+		applog(LOG_ERR, "thread %d create failed", i);
+		return false;
+	}
+	return true;
+}
+
+/* the most threads miner_set_threads() can start (--max-threads) */
+int miner_thread_slots()
+{
+	return thr_max;
+}
+
+/* miner threads created, the parked ones included */
+int miner_threads_started()
+{
+	return thr_started;
+}
+
+/**
+ * Change the number of mining threads at runtime (api "setthreads",
+ * SIGUSR1/SIGUSR2). Missing threads are created up to --max-threads,
+ * the removed ones are parked, and all the threads restart their scan
+ * in the new nonce ranges. The submitted shares are not affected.
+ */
+bool miner_set_threads(int n)
+{
+	int prev;
+	if (n < 1 || n > thr_max || autotune_running() || !thr_started)
+		return false;
+	pthread_mutex_lock(&thr_resize_lock);
+	prev = opt_n_threads;
+	if (n == prev) {
+		pthread_mutex_unlock(&thr_resize_lock);
+		return true;
+	}
+	for (; thr_started < n; thr_started++) {
+		if (!start_miner_thread(thr_started))
+			break;
+	}
+	opt_n_threads = min(n, thr_started);
+	thr_partition++;
+	topology_compute(opt_n_threads);
+	park_set_threads(opt_n_threads);
+	governor_set_threads(opt_n_threads);
+	cgroup_set_threads(opt_n_threads);
+	restart_threads();
+	pthread_mutex_unlock(&thr_resize_lock);
+	applog(LOG_NOTICE, "Mining threads: %d -> %d", prev, opt_n_threads);
+	return opt_n_threads == n;
+}
+
 static void *longpoll_thread(void *userdata)
 {
 	struct thr_info *mythr = (struct thr_info *)userdata;
@@ -2366,6 +2573,8 @@ static void *longpoll_thread(void *userdata)
 	bool need_slash = false;
 	int pooln, switchn;
 
+	topology_bind_service();
+
 	curl = curl_easy_init();
 	if (unlikely(!curl)) {
 		applog(LOG_ERR, "%s() CURL init failed", __func__);
@@ -2444,6 +2653,7 @@ longpoll_retry:
 			submit_old = soval ? json_is_true(soval) : false;
 			pthread_mutex_lock(&g_work_lock);
 			if (work_decode(json_object_get(val, "result"), &g_work)) {
+				numa_work_updated();
 				restart_threads();
 				if (!opt_quiet) {
 					char netinfo[64] = { 0 };
@@ -2533,6 +2743,7 @@ static bool stratum_handle_response(char *buf)
 	timeval_subtract(&diff, &tv_answer, &stratum.tv_submit);
 	// store time required to the pool to answer to a submit
 	stratum.answer_msec = (1000 * diff.tv_sec) + (uint32_t) (0.001 * diff.tv_usec);
+	latency_share_answer((uint32_t) num);
 
 	
 		if (!res_val)
@@ -2557,6 +2768,8 @@ static void *stratum_thread(void *userdata)
 	int pooln, switchn;
 	char *s;
 
+	topology_bind_service();
+
 wait_stratum_url:
 	stratum.url = (char*)tq_pop(mythr->q, NULL);
 	if (!stratum.url)
@@ -2587,6 +2800,7 @@ wait_stratum_url:
 			pthread_mutex_lock(&g_work_lock);
 			g_work_time = 0;
 			g_work.data[0] = 0;
+			numa_work_updated();
 			pthread_mutex_unlock(&g_work_lock);
 			restart_threads();
 
@@ -2621,8 +2835,13 @@ wait_stratum_url:
 		if (stratum.job.job_id &&
 		    (!g_work_time || strncmp(stratum.job.job_id, g_work.job_id + 8, sizeof(g_work.job_id)-8))) {
 			pthread_mutex_lock(&g_work_lock);
-			if (stratum_gen_work(&stratum, &g_work))
+			if (stratum_gen_work(&stratum, &g_work)) {
 				g_work_time = time(NULL);
+				numa_work_updated();
+				latency_job_published();
+				api_push_event(API_PUSH_JOBS, "JOB=%s;H=%u;DIFF=%.6f;CLEAN=%d",
+					stratum.job.job_id, stratum.job.height, stratum_diff, (int) stratum.job.clean);
+			}
 			if (stratum.job.clean) {
 				static uint32_t last_block_height;
 				if ((!opt_quiet || !firstwork_time) && stratum.job.height != last_block_height) {
@@ -2633,6 +2852,8 @@ wait_stratum_url:
 					else
 						applog(LOG_BLUE, "%s %s block %d", pool->short_url, algo_names[opt_algo],
 							stratum.job.height);
+					if (opt_debug)
+						latency_log_summary();
 				}
 				restart_threads();
 				if (check_dups || opt_showdiff)
@@ -2828,6 +3049,67 @@ void parse_arg(int key, char *arg)
 			show_usage_and_exit(1);
 		opt_api_mcast_port = v;
 		break;
+	case 1039: /* --perf-counters */
+		opt_perf_counters = true;
+		break;
+	case 1040: /* --phase-sample */
+		v = atoi(arg);
+		if (v < 0 || v > (1 << 30))
+			show_usage_and_exit(1);
+		// rounded up to a power of 2 (nonce mask)
+		opt_phase_sample = 0;
+		if (v > 0) for (opt_phase_sample = 1; opt_phase_sample < (uint32_t) v; opt_phase_sample <<= 1);
+		break;
+	case 1041: /* --log-rate */
+		v = atoi(arg);
+		if (v < 0)
+			show_usage_and_exit(1);
+		opt_log_rate = v;
+		break;
+	case 1042: /* --sync-log */
+		opt_sync_log = true;
+		break;
+	case 1043: /* --cpu-placement */
+		if (!topology_set_placement(arg)) {
+			applog(LOG_ERR, "Unknown cpu placement '%s'", arg);
+			show_usage_and_exit(1);
+		}
+		break;
+	case 1044: /* --cpu-exclude */
+		free(opt_cpu_exclude);
+		opt_cpu_exclude = strdup(arg);
+		break;
+	case 1045: /* --cpu-reserve */
+		opt_cpu_reserve = true;
+		break;
+	case 1046: /* --autotune[=force] */
+		opt_tune = true;
+		if (arg && !strcasecmp(arg, "force"))
+			opt_tune_force = true;
+		break;
+	case 1047: /* --autotune-file */
+		free(opt_tune_file);
+		opt_tune_file = strdup(arg);
+		break;
+	case 1048: /* --no-numa */
+		opt_no_numa = true;
+		break;
+	case 1049: /* --no-cgroup */
+		opt_no_cgroup = true;
+		break;
+	case 1052: /* --thread-parking */
+		opt_thread_parking = true;
+		break;
+	case 1053: /* --core-type */
+		if (!topology_set_core_type(arg))
+			show_usage_and_exit(1);
+		break;
+	case 1038: /* --api-push */
+		v = atoi(arg);
+		if (v < 0 || v > 60000) // sanity check
+			show_usage_and_exit(1);
+		opt_api_push = v;
+		break;
 	case 'B':
 		opt_background = true;
 		break;
@@ -2907,6 +3189,58 @@ void parse_arg(int key, char *arg)
 			show_usage_and_exit(1);
 		opt_n_threads = v;
 		break;
+	case 1058: // --bench-hashes
+		opt_bench_hashes = strtoull(arg, &p, 10);
+		if (p && (*p == 'K' || *p == 'k')) opt_bench_hashes *= 1000;
+		if (p && (*p == 'M' || *p == 'm')) opt_bench_hashes *= 1000000;
+		break;
+	case 1059: // --bench-warmup
+		v = atoi(arg);
+		if (v < 0 || v > 600)
+			show_usage_and_exit(1);
+		opt_bench_warmup = v;
+		break;
+	case 1066: // --bench-json
+		free(opt_bench_json);
+		opt_bench_json = strdup(arg);
+		break;
+	case 1079: // --verify-server[=PATH]
+		free(opt_verify_server);
+		opt_verify_server = strdup(arg && strlen(arg) ? arg : "-");
+		opt_benchmark = true;
+		want_longpoll = false;
+		want_stratum = false;
+		have_stratum = false;
+		break;
+	case 1078: // --bench-stratum[=N]
+		opt_bench_stratum = arg ? atoi(arg) : 100000;
+		if (opt_bench_stratum < 1 || opt_bench_stratum > 10000000)
+			show_usage_and_exit(1);
+		opt_benchmark = true;
+		want_longpoll = false;
+		want_stratum = false;
+		have_stratum = false;
+		break;
+	case 1067: // --record
+		free(opt_record);
+		opt_record = strdup(arg);
+		break;
+	case 1068: // --replay
+		free(opt_replay);
+		opt_replay = strdup(arg);
+		break;
+	case 1069: // --replay-speed
+		d = atof(arg);
+		if (d < 0.)
+			show_usage_and_exit(1);
+		opt_replay_speed = d;
+		break;
+	case 1057: // --max-threads
+		v = atoi(arg);
+		if (v < 0 || v > MAX_GPUS)
+			show_usage_and_exit(1);
+		opt_max_threads = v;
+		break;
 	case 1022: // --vote
 		v = atoi(arg);
 		if (v < 0 || v > 8192)	/* sanity check */
@@ -3150,6 +3484,28 @@ void parse_arg(int key, char *arg)
 		d = atof(arg);
 		opt_max_temp = d;
 		break;
+	case 1054: // max-power
+		d = atof(arg);
+		if (d < 0.)
+			show_usage_and_exit(1);
+		opt_max_power = d;
+		break;
+	case 1076: // --verify-shares
+		opt_verify_shares = true;
+		break;
+	case 1077: // --verify-disable
+		v = atoi(arg);
+		if (v < 0 || v > 65535)
+			show_usage_and_exit(1);
+		opt_verify_disable = v;
+		opt_verify_shares = true;
+		break;
+	case 1056: // governor-hysteresis
+		v = atoi(arg);
+		if (v < 0 || v > 50)
+			show_usage_and_exit(1);
+		opt_gov_hysteresis = v;
+		break;
 	case 1061: // max-diff
 		d = atof(arg);
 		opt_max_diff = d;
@@ -3392,6 +3748,13 @@ static void signal_handler(int sig)
 		applog(LOG_INFO, "SIGTERM received, exiting");
 		proper_exit(EXIT_CODE_KILLED);
 		break;
+	case SIGUSR1:
+	case SIGUSR2:
+		// done by the first miner thread, wake it up
+		thr_resize_signal += (sig == SIGUSR1) ? 1 : -1;
+		if (work_restart)
+			numa_restart_thread(0);
+		break;
 	}
 }
 #else
@@ -3441,6 +3804,9 @@ int main(int argc, char *argv[])
 
 	// get opt_quiet early
 	parse_single_opt('q', argc, argv);
+	// and move the logs to stderr if stdout is for the verdicts
+	parse_single_opt(1079, argc, argv);
+	verify_server_stdio();
 	
 	Clear();
 	printf("*************************************************************\n");	
@@ -3504,6 +3870,23 @@ int main(int argc, char *argv[])
 	/* parse command line */
 	parse_cmdline(argc, argv);
 
+	if (opt_replay) {
+		char *url;
+		if (strlen(rpc_url)) {
+			fprintf(stderr, "%s: --replay can't be used with a pool url\n", argv[0]);
+			show_usage_and_exit(1);
+		}
+		url = replay_start(opt_replay);
+		if (!url)
+			proper_exit(EXIT_CODE_USAGE);
+		parse_arg('o', url);
+		if (!rpc_user || !strlen(rpc_user))
+			parse_arg('u', (char*) "replay");
+		free(url);
+	}
+	if (opt_record && !record_open(opt_record))
+		proper_exit(EXIT_CODE_USAGE);
+
 	if (!opt_benchmark && !strlen(rpc_url)) {
 		// try default config file (user then binary folder)
 		char defconfig[MAX_PATH] = { 0 };
@@ -3584,6 +3967,9 @@ int main(int argc, char *argv[])
 #ifndef WIN32
 	/* Always catch Ctrl+C */
 	signal(SIGINT, signal_handler);
+	/* one mining thread more or less */
+	signal(SIGUSR1, signal_handler);
+	signal(SIGUSR2, signal_handler);
 #else
 	SetConsoleCtrlHandler((PHANDLER_ROUTINE)ConsoleHandler, TRUE);
 	if (opt_priority > 0) {
@@ -3621,6 +4007,11 @@ int main(int argc, char *argv[])
 		applog(LOG_ERR, "No CUDA devices found! terminating.");
 		exit(1);
 	}
+	// container cpu quota and cpuset
+	cgroup_init();
+	if (opt_tune && !opt_benchmark)
+		autotune_startup(&opt_n_threads);
+	opt_n_threads = cgroup_thread_count(opt_n_threads);
 	if (!opt_n_threads)
 		opt_n_threads = active_gpus;
 	else if (active_gpus > opt_n_threads)
@@ -3629,6 +4020,10 @@ int main(int argc, char *argv[])
 	// generally doesn't work well...
 	gpu_threads = max(gpu_threads, opt_n_threads / active_gpus);
 
+	// slots for the threads added at runtime
+	thr_max = opt_max_threads ? opt_max_threads : max(opt_n_threads, num_cpus);
+	thr_max = min(max(thr_max, opt_n_threads), MAX_GPUS);
+
 
 
 #ifdef HAVE_SYSLOG_H
@@ -3636,16 +4031,42 @@ int main(int argc, char *argv[])
 		openlog(opt_syslog_pfx, LOG_PID, LOG_USER);
 #endif
 
-	work_restart = (struct work_restart *)calloc(opt_n_threads, sizeof(*work_restart));
+	topology_init(opt_n_threads);
+
+	// from now, the log output is done by a dedicated thread
+	log_async_start();
+
+	// also used by the autotune trials at runtime
+	work_restart = (struct work_restart *)calloc(max(opt_n_threads, MAX_GPUS), sizeof(*work_restart));
 	if (!work_restart)
 		return EXIT_CODE_SW_INIT_ERROR;
 
-	thr_info = (struct thr_info *)calloc(opt_n_threads + 5, sizeof(*thr));
+	// replicas of g_work and work_restart on the mining nodes
+	numa_init(opt_n_threads);
+
+	// offline, no pool and no api
+	if (opt_verify_server) {
+		int rc = verify_server_run(opt_n_threads);
+		proper_exit(rc);
+		return rc;
+	}
+	if (opt_bench_stratum) {
+		int rc = bench_stratum_run();
+		proper_exit(rc);
+		return rc;
+	}
+	if (opt_benchmark) {
+		int rc = bench_run(opt_n_threads);
+		proper_exit(rc);
+		return rc;
+	}
+
+	thr_info = (struct thr_info *)calloc(thr_max + 5, sizeof(*thr));
 	if (!thr_info)
 		return EXIT_CODE_SW_INIT_ERROR;
 
 	/* longpoll thread */
-	longpoll_thr_id = opt_n_threads + 1;
+	longpoll_thr_id = thr_max + 1;
 	thr = &thr_info[longpoll_thr_id];
 	thr->id = longpoll_thr_id;
 	thr->q = tq_new();
@@ -3659,7 +4080,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* stratum thread */
-	stratum_thr_id = opt_n_threads + 2;
+	stratum_thr_id = thr_max + 2;
 	thr = &thr_info[stratum_thr_id];
 	thr->id = stratum_thr_id;
 	thr->q = tq_new();
@@ -3673,7 +4094,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* init workio thread */
-	work_thr_id = opt_n_threads;
+	work_thr_id = thr_max;
 	thr = &thr_info[work_thr_id];
 	thr->id = work_thr_id;
 	thr->q = tq_new();
@@ -3694,7 +4115,7 @@ int main(int argc, char *argv[])
 
 	if (opt_api_port) {
 		/* api thread */
-		api_thr_id = opt_n_threads + 3;
+		api_thr_id = thr_max + 3;
 		thr = &thr_info[api_thr_id];
 		thr->id = api_thr_id;
 		thr->q = tq_new();
@@ -3712,37 +4133,34 @@ int main(int argc, char *argv[])
 
 	/* start mining threads */
 	for (i = 0; i < opt_n_threads; i++) {
-		thr = &thr_info[i];
-
-		thr->id = i;
-		thr->gpu.thr_id = i;
-		thr->gpu.gpu_id = (uint8_t) device_map[i];
-		//thr->gpu.gpu_arch = (uint16_t) device_sm[device_map[i]];
-		thr->q = tq_new();
-		if (!thr->q)
+		if (!start_miner_thread(i))
 			return EXIT_CODE_SW_INIT_ERROR;
-
-		pthread_mutex_init(&thr->gpu.monitor.lock, NULL);
-		pthread_cond_init(&thr->gpu.monitor.sampling_signal, NULL);
-
-		if (unlikely(pthread_create(&thr->pth, NULL, miner_thread, thr))) {
-			applog(LOG_ERR, "thread %d create failed", i);
-			return EXIT_CODE_SW_INIT_ERROR;
-		}
 	}
+	thr_started = opt_n_threads;
 
 	applog(LOG_INFO, "%d miner thread%s started, "
 		"using '%s' algorithm.",
 		opt_n_threads, opt_n_threads > 1 ? "s":"",
 		algo_names[opt_algo]);
 
+	/* cgroup quota changes */
+	cgroup_start(opt_n_threads);
+	/* --thread-parking controller */
+	park_start(opt_n_threads);
+	/* rapl counters sampling */
+	energy_start();
+	/* --max-temp and --max-power */
+	governor_start(opt_n_threads);
+	/* --verify-shares */
+	verify_start();
+
 	/* main loop - simply wait for workio thread to exit */
 	pthread_join(thr_info[work_thr_id].pth, NULL);
 
 	abort_flag = true;
 
 	/* wait for mining threads */
-	for (i = 0; i < opt_n_threads; i++) {
+	for (i = 0; i < thr_started; i++) {
 		struct cgpu_info *cgpu = &thr_info[i].gpu;
 		if (monitor_thr_id != -1 && cgpu) {
 			pthread_cond_signal(&cgpu->monitor.sampling_signal);
@@ -0,0 +1,397 @@
+/**
+ * Container limits (linux cgroup v1 and v2)
+ *
+ * The cpu quota (cpu.max, cpu.cfs_quota_us) and the cpuset of the
+ * process cgroup are used to size the mining threads, a monitor thread
+ * checks them again every CG_CHECK_SECS and parks the threads above
+ * the quota, so the miner is not throttled by the CFS bandwidth control.
+ * When the count comes from the cgroup (no -t), threads are added if the
+ * limits grow, up to --max-threads.
+ *
+ * With CCMINER_SYSFS, the cgroup files are read from its fs/cgroup.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "miner.h"
+
+#define CG_CHECK_SECS 10
+#define CG_THROTTLE_WARN 0.20 /* ratio of throttled periods */
+
+extern int num_cpus;
+
+struct cg_stat {
+	uint64_t periods;
+	uint64_t throttled;
+	uint64_t throttled_us;
+};
+
+static int cg_version = 0;    /* 0 = not found */
+static char cg_cpu_mount[64];
+static char cg_cpu_dir[256];  /* relative to the sysfs root */
+static char cg_set_dir[256];
+static double cg_quota = 0.;  /* in cpus, 0 if not limited */
+static char cg_cpuset[256];   /* cpu list or empty */
+static int cg_active = 0;     /* threads allowed to mine, 0 = all */
+static int cg_threads = 0;
+static bool cg_auto = false;  /* thread count from the cgroup, not -t */
+static struct cg_stat cg_last;
+
+bool opt_no_cgroup = false;
+
+static bool cg_dir_exists(const char *dir, const char *file)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s/%s", sysfs_root(), dir, file);
+	return access(path, R_OK) == 0;
+}
+
+/* cgroup path of a controller in /proc/self/cgroup ("" for v2) */
+static bool cg_self_path(const char *controller, char *path, size_t len)
+{
+	char line[512];
+	bool found = false;
+	FILE *fd;
+	if (getenv("CCMINER_SYSFS")) {
+		// the fake tree is the process cgroup
+		snprintf(path, len, "%s", "");
+		return true;
+	}
+	fd = fopen("/proc/self/cgroup", "r");
+	if (!fd)
+		return false;
+	while (!found && fgets(line, sizeof(line), fd)) {
+		char *ctrl = strchr(line, ':'), *p;
+		if (!ctrl || !(p = strchr(++ctrl, ':')))
+			continue;
+		*p++ = '\0';
+		p[strcspn(p, "\r\n")] = '\0';
+		if (!controller) {
+			found = (line[0] == '0' && !*ctrl);
+		} else {
+			for (char *tok = strtok(ctrl, ","); tok && !found; tok = strtok(NULL, ","))
+				found = !strcmp(tok, controller);
+		}
+		if (found)
+			snprintf(path, len, "%s", strcmp(p, "/") ? p : "");
+	}
+	fclose(fd);
+	return found;
+}
+
+/* process cgroup dir under a mount, or the mount itself (container ns) */
+static bool cg_find_dir(const char *mount, const char *controller, const char *file, char *dir, size_t len)
+{
+	char path[256] = "";
+	if (!cg_self_path(controller, path, sizeof(path)))
+		return false;
+	snprintf(dir, len, "%s%s", mount, path);
+	if (cg_dir_exists(dir, file))
+		return true;
+	snprintf(dir, len, "%s", mount);
+	return cg_dir_exists(dir, file);
+}
+
+static void cg_detect()
+{
+	cg_version = 0;
+	cg_cpu_dir[0] = cg_set_dir[0] = '\0';
+	if (cg_dir_exists("fs/cgroup", "cgroup.controllers")) {
+		if (cg_find_dir("fs/cgroup", NULL, "cgroup.controllers", cg_cpu_dir, sizeof(cg_cpu_dir))) {
+			snprintf(cg_cpu_mount, sizeof(cg_cpu_mount), "fs/cgroup");
+			snprintf(cg_set_dir, sizeof(cg_set_dir), "%s", cg_cpu_dir);
+			cg_version = 2;
+		}
+		return;
+	}
+	const char *mounts[] = { "fs/cgroup/cpu,cpuacct", "fs/cgroup/cpu" };
+	for (int m = 0; m < (int) ARRAY_SIZE(mounts) && !cg_version; m++) {
+		if (cg_find_dir(mounts[m], "cpu", "cpu.cfs_quota_us", cg_cpu_dir, sizeof(cg_cpu_dir))) {
+			snprintf(cg_cpu_mount, sizeof(cg_cpu_mount), "%s", mounts[m]);
+			cg_version = 1;
+		}
+	}
+	if (cg_find_dir("fs/cgroup/cpuset", "cpuset", "cpuset.cpus", cg_set_dir, sizeof(cg_set_dir)))
+		cg_version = max(cg_version, 1);
+}
+
+/* quota of one level in cpus, 0 if none */
+static double cg_read_quota(const char *dir)
+{
+	char path[320], buf[64];
+	if (cg_version == 2) {
+		long long quota = 0, period = 0;
+		snprintf(path, sizeof(path), "%s/cpu.max", dir);
+		if (!sysfs_read(path, buf, sizeof(buf)) || !strncmp(buf, "max", 3))
+			return 0.;
+		if (sscanf(buf, "%lld %lld", &quota, &period) != 2 || quota <= 0 || period <= 0)
+			return 0.;
+		return (double) quota / (double) period;
+	} else {
+		int quota, period;
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+		quota = sysfs_read_int(path, -1);
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		period = sysfs_read_int(path, 0);
+		if (quota <= 0 || period <= 0)
+			return 0.;
+		return (double) quota / (double) period;
+	}
+}
+
+/* the lowest quota of the cgroup and its parents */
+static double cg_read_quotas()
+{
+	char dir[256];
+	double quota = 0.;
+	if (!cg_cpu_dir[0])
+		return 0.;
+	snprintf(dir, sizeof(dir), "%s", cg_cpu_dir);
+	for (;;) {
+		double q = cg_read_quota(dir);
+		char *slash;
+		if (q > 0. && (quota == 0. || q < quota))
+			quota = q;
+		slash = strrchr(dir, '/');
+		// up to the mount point
+		if (!slash || strlen(dir) <= strlen(cg_cpu_mount))
+			break;
+		*slash = '\0';
+	}
+	return quota;
+}
+
+static void cg_read_cpuset(char *list, size_t len)
+{
+	char path[320];
+	list[0] = '\0';
+	if (!cg_set_dir[0])
+		return;
+	snprintf(path, sizeof(path), "%s/%s", cg_set_dir,
+		cg_version == 2 ? "cpuset.cpus.effective" : "cpuset.effective_cpus");
+	if (sysfs_read(path, list, len))
+		return;
+	snprintf(path, sizeof(path), "%s/cpuset.cpus", cg_set_dir);
+	if (!sysfs_read(path, list, len))
+		list[0] = '\0';
+}
+
+static bool cg_read_stat(struct cg_stat *st)
+{
+	char path[512], key[64];
+	unsigned long long v;
+	FILE *fd;
+	memset(st, 0, sizeof(*st));
+	if (!cg_cpu_dir[0])
+		return false;
+	snprintf(path, sizeof(path), "%s/%s/cpu.stat", sysfs_root(), cg_cpu_dir);
+	fd = fopen(path, "r");
+	if (!fd)
+		return false;
+	while (fscanf(fd, "%63s %llu", key, &v) == 2) {
+		if (!strcmp(key, "nr_periods"))
+			st->periods = v;
+		else if (!strcmp(key, "nr_throttled"))
+			st->throttled = v;
+		else if (!strcmp(key, "throttled_usec"))
+			st->throttled_us = v;
+		else if (!strcmp(key, "throttled_time")) // v1, ns
+			st->throttled_us = v / 1000;
+	}
+	fclose(fd);
+	return true;
+}
+
+/* cpus usable by the mining threads, 0 if not limited */
+static int cg_effective_cpus()
+{
+	struct topology_data topo;
+	bool set[1024];
+	int cpus;
+	if (!cg_version)
+		return 0;
+	topology_read();
+	topology_get(&topo);
+	// the root cgroup cpuset lists all the cpus
+	memset(set, 0, sizeof(set));
+	if (cg_quota == 0. && (!cg_cpuset[0] || cpulist_parse(cg_cpuset, set, ARRAY_SIZE(set)) >= topo.threads))
+		return 0;
+	cpus = topo.allowed ? topo.allowed : num_cpus;
+	if (cg_quota > 0.)
+		cpus = min(cpus, (int) ceil(cg_quota - 0.01));
+	return max(cpus, 1);
+}
+
+/**
+ * Read the cgroup limits, before the topology and the thread count
+ */
+void cgroup_init()
+{
+	if (opt_no_cgroup)
+		return;
+	cg_detect();
+	if (!cg_version)
+		return;
+	cg_quota = cg_read_quotas();
+	cg_read_cpuset(cg_cpuset, sizeof(cg_cpuset));
+	cg_read_stat(&cg_last);
+	if (cg_effective_cpus()) {
+		char quota[32] = "none";
+		if (cg_quota > 0.)
+			snprintf(quota, sizeof(quota), "%.2f cpus", cg_quota);
+		applog(LOG_INFO, "cgroup v%d limits: quota %s, cpuset %s", cg_version, quota,
+			cg_cpuset[0] ? cg_cpuset : "all");
+	}
+}
+
+/* cpuset of the cgroup, false if unknown */
+bool cgroup_cpuset(bool *set, int max)
+{
+	if (!cg_cpuset[0])
+		return false;
+	memset(set, 0, max * sizeof(bool));
+	return cpulist_parse(cg_cpuset, set, max) > 0;
+}
+
+/* 0 if not limited */
+int cgroup_effective_cpus()
+{
+	return cg_effective_cpus();
+}
+
+/**
+ * Default thread count (0 if -t is not set) and cap an explicit one,
+ * more threads than the quota are only throttled
+ */
+int cgroup_thread_count(int threads)
+{
+	int cpus = cg_effective_cpus();
+	if (!cpus)
+		return threads;
+	if (!threads) {
+		applog(LOG_INFO, "Using %d threads (cgroup cpus)", cpus);
+		cg_auto = true;
+		return cpus;
+	}
+	if (threads > cpus) {
+		applog(LOG_WARNING, "%d threads for %d cgroup cpus, reduced to %d", threads, cpus, cpus);
+		return cpus;
+	}
+	return threads;
+}
+
+/* miner threads above the current quota wait */
+bool cgroup_thread_parked(int thr_id)
+{
+	return cg_active > 0 && thr_id >= cg_active;
+}
+
+static void cg_check()
+{
+	char cpuset[256];
+	double quota = cg_read_quotas();
+	struct cg_stat st;
+	bool changed = false;
+	int cpus;
+
+	cg_read_cpuset(cpuset, sizeof(cpuset));
+	if (strcmp(cpuset, cg_cpuset)) {
+		applog(LOG_NOTICE, "cgroup cpuset changed to %s", cpuset[0] ? cpuset : "all");
+		snprintf(cg_cpuset, sizeof(cg_cpuset), "%s", cpuset);
+		// new allowed cpus, the miners rebind on the next scan
+		topology_reload(cg_threads);
+		changed = true;
+	}
+	if (fabs(quota - cg_quota) > 0.005) {
+		if (quota > 0.)
+			applog(LOG_NOTICE, "cgroup cpu quota changed to %.2f cpus", quota);
+		else
+			applog(LOG_NOTICE, "cgroup cpu quota removed");
+		cg_quota = quota;
+		changed = true;
+	}
+	if (changed) {
+		cpus = cg_effective_cpus();
+		cg_active = (cpus && cpus < cg_threads) ? cpus : 0;
+		applog(LOG_INFO, "%d of %d threads mining", cg_active ? cg_active : cg_threads, cg_threads);
+		if (cg_active)
+			restart_threads();
+	}
+	// more cpus than threads (0 is no limit), retried on the next checks if refused (autotune)
+	cpus = cg_effective_cpus();
+	if (!cpus)
+		cpus = num_cpus;
+	if (cg_auto && cpus > cg_threads && cg_threads < miner_thread_slots()) {
+		int n = min(cpus, miner_thread_slots());
+		if (miner_set_threads(n))
+			applog(LOG_NOTICE, "cgroup allows %d cpus, %d mining threads", cpus, n);
+	}
+
+	if (cg_read_stat(&st) && st.periods > cg_last.periods) {
+		double ratio = (double) (st.throttled - cg_last.throttled) / (double) (st.periods - cg_last.periods);
+		if (ratio > CG_THROTTLE_WARN)
+			applog(LOG_WARNING, "cgroup: throttled in %.0f%% of the periods (%u ms lost)",
+				ratio * 100., (uint32_t) ((st.throttled_us - cg_last.throttled_us) / 1000));
+		cg_last = st;
+	}
+}
+
+static void *cgroup_thread(void *userdata)
+{
+	topology_bind_service();
+	while (!abort_flag) {
+		sleep(CG_CHECK_SECS);
+		cg_check();
+	}
+	return NULL;
+}
+
+/* watch the limits changes, nthreads is the started miners count */
+void cgroup_start(int nthreads)
+{
+	pthread_t pth;
+	cg_threads = nthreads;
+	if (!cg_version)
+		return;
+	if (pthread_create(&pth, NULL, cgroup_thread, NULL)) {
+		applog(LOG_WARNING, "cgroup monitor thread create failed");
+		return;
+	}
+	pthread_detach(pth);
+}
+
+/* the miners count changed at runtime, the threads above the quota wait */
+void cgroup_set_threads(int nthreads)
+{
+	int cpus;
+	cg_threads = nthreads;
+	if (!cg_version)
+		return;
+	cpus = cg_effective_cpus();
+	cg_active = (cpus && cpus < cg_threads) ? cpus : 0;
+	if (cg_active)
+		applog(LOG_INFO, "%d of %d threads mining (cgroup cpus)", cg_active, cg_threads);
+}
+
+bool cgroup_get(struct cgroup_data *data)
+{
+	struct cg_stat st;
+	memset(data, 0, sizeof(*data));
+	data->version = cg_version;
+	if (!cg_version)
+		return false;
+	data->quota = cg_quota;
+	data->cpuset = cg_cpuset;
+	data->cpus = cg_effective_cpus();
+	data->active = cg_active ? cg_active : cg_threads;
+	if (cg_read_stat(&st)) {
+		data->periods = st.periods;
+		data->throttled = st.throttled;
+		data->throttled_ms = st.throttled_us / 1000;
+	}
+	return true;
+}
@@ -277,6 +277,7 @@ bool equi_stratum_submit(struct pool_infos *pool, struct work *work)
 	char _ALIGN(64) timehex[16] = { 0 };
 	char *jobid, *noncestr, *solhex;
 	int idnonce = work->submit_nonce_id;
+	uint64_t tm_submit = latency_now();
 
 	// scanned nonce
 	work->data[EQNONCE_OFFSET] = work->nonces[idnonce];
@@ -315,6 +316,8 @@ bool equi_stratum_submit(struct pool_infos *pool, struct work *work)
 		applog(LOG_ERR, "%s stratum_send_line failed", __func__);
 		return false;
 	}
+	latency_share_sent(work->tm_found, tm_submit, stratum.job.shares_count + 10);
+	PROBE3(share_submit, jobid, stratum.job.shares_count + 10, idnonce);
 
 	stratum.sharediff = work->sharediff[idnonce];
 	stratum.job.shares_count++;
@@ -142,9 +142,9 @@ static void cb_hashdone(int thr_id) {
 	if (!valid_sols[thr_id]) valid_sols[thr_id] = -1;
 }
 static bool cb_cancel(int thr_id) {
-	if (work_restart[thr_id].restart)
+	if (numa_restart(thr_id)->restart)
 		valid_sols[thr_id] = -1;
-	return work_restart[thr_id].restart;
+	return numa_restart(thr_id)->restart;
 }
 
 extern "C" int scanhash_equihash(int thr_id, struct work *work, uint32_t max_nonce, unsigned long *hashes_done)
@@ -258,7 +258,7 @@ extern "C" int scanhash_equihash(int thr_id, struct work *work, uint32_t max_non
 
 		endiandata[NONCE_OFT] += nonce_increment;
 
-	} while (!work_restart[thr_id].restart);
+	} while (!numa_restart(thr_id)->restart);
 
 out:
 	gettimeofday(&tv_end, NULL);
@@ -0,0 +1,293 @@
+/**
+ * Thermal and power governor (--max-temp, --max-power)
+ *
+ * Each GOV_INTERVAL, reads the hottest package temperature and the rapl
+ * package power. Above a limit, the governor steps down: one mining
+ * thread less, then the last thread only mines a part of the time (duty
+ * cycle), then all the threads wait. Under the limits minus the
+ * hysteresis for GOV_HOLD samples, it steps up again.
+ *
+ * With a power cap, each step keeps its measured hashes per joule and
+ * a step up which is less efficient than the current one (by more than
+ * the hysteresis) is reverted, so the miner stays on the most efficient
+ * step of the envelope.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "miner.h"
+
+#define GOV_INTERVAL  2   /* seconds between the samples */
+#define GOV_HOLD      3   /* samples under the limits before a step up */
+#define GOV_SETTLE    2   /* samples after a step before stepping down again */
+#define GOV_COOLDOWN  60  /* samples before trying an inefficient step again */
+#define GOV_MAX_PAUSE 4000 /* ms */
+
+#define GOV_MAX_STEPS (MAX_GPUS + 4)
+
+extern pthread_mutex_t stats_lock;
+extern double thr_hashrates[MAX_GPUS];
+
+/* steps 1..3 are 1 thread at 25/50/75% of the time, then 1..n threads */
+static const int duty_steps[4] = { 0, 25, 50, 75 };
+
+struct gov_step {
+	double hpj;   /* measured hashes per joule, 0 if unknown */
+	int cooldown;
+};
+
+static struct gov_step steps[GOV_MAX_STEPS];
+static int gov_threads = 0;
+static int top_step = 0;
+static volatile int cur_step = 0;
+static volatile bool gov_running = false;
+static int under = 0;
+static int settle = 0;
+static double gov_temp = 0., gov_power = 0.;
+static uint32_t down_count = 0, up_count = 0, revert_count = 0;
+static const char *gov_state = "off";
+
+/* step up being measured */
+static int trial_from = -1;
+static int trial_age = 0;
+static double trial_hashes = 0., trial_joules = 0.;
+
+double opt_max_power = 0.;
+int opt_gov_hysteresis = 5;
+
+extern double opt_max_temp;
+extern double opt_resume_temp;
+
+static int step_threads(int step)
+{
+	return step <= 3 ? min(step, 1) : step - 3;
+}
+
+static int step_duty(int step)
+{
+	return step <= 3 ? duty_steps[step] : 100;
+}
+
+static double thread_rates()
+{
+	double total = 0.;
+	pthread_mutex_lock(&stats_lock);
+	for (int t = 0; t < gov_threads; t++)
+		total += thr_hashrates[t];
+	pthread_mutex_unlock(&stats_lock);
+	return total;
+}
+
+static void gov_set_step(int step, const char *why)
+{
+	cur_step = max(0, min(step, top_step));
+	settle = GOV_SETTLE;
+	if (!cur_step)
+		applog(LOG_WARNING, "governor: %s (%.1fC %.1fW), mining paused", why, gov_temp, gov_power);
+	else
+		applog(LOG_NOTICE, "governor: %s (%.1fC %.1fW), %d thread%s at %d%%", why, gov_temp, gov_power,
+			step_threads(cur_step), step_threads(cur_step) > 1 ? "s" : "", step_duty(cur_step));
+}
+
+static bool gov_over()
+{
+	return (opt_max_temp > 0. && gov_temp > opt_max_temp) ||
+		(opt_max_power > 0. && gov_power > opt_max_power);
+}
+
+static bool gov_under()
+{
+	double h = 1. - opt_gov_hysteresis / 100.;
+	double resume = opt_resume_temp > 0. ? opt_resume_temp : opt_max_temp * h;
+	return (opt_max_temp <= 0. || gov_temp < resume) &&
+		(opt_max_power <= 0. || gov_power < opt_max_power * h);
+}
+
+/* keep a step up only if its hashes per joule are not worse */
+static void gov_check_trial()
+{
+	double h = 1. - opt_gov_hysteresis / 100.;
+	struct gov_step *s = &steps[cur_step];
+	if (trial_joules <= 0.) {
+		trial_from = -1;
+		return;
+	}
+	s->hpj = trial_hashes / trial_joules;
+	if (steps[trial_from].hpj > 0. && s->hpj < steps[trial_from].hpj * h) {
+		s->cooldown = GOV_COOLDOWN;
+		revert_count++;
+		gov_set_step(trial_from, "less efficient");
+	}
+	trial_from = -1;
+}
+
+static void gov_sample()
+{
+	struct energy_data e;
+	double rate;
+
+	gov_temp = cpu_temp(-1);
+	energy_update();
+	energy_get(&e);
+	gov_power = e.watts;
+	rate = thread_rates();
+
+	for (int s = 0; s <= top_step; s++)
+		if (steps[s].cooldown) steps[s].cooldown--;
+	if (!gov_over())
+		settle = 0;
+
+	if (gov_over()) {
+		under = 0;
+		trial_from = -1;
+		gov_state = "over";
+		// let the temperature follow the last step, the power follows at once
+		if (settle && !(opt_max_power > 0. && gov_power > opt_max_power)) {
+			settle--;
+			return;
+		}
+		if (cur_step > 0) {
+			down_count++;
+			gov_set_step(cur_step - 1, opt_max_temp > 0. && gov_temp > opt_max_temp ? "too hot" : "power cap");
+		}
+		return;
+	}
+
+	if (trial_from >= 0) {
+		gov_state = "trial";
+		// the first sample is the thread ramp up
+		if (trial_age++ < 0)
+			return;
+		trial_hashes += rate * GOV_INTERVAL;
+		trial_joules += gov_power * GOV_INTERVAL;
+		if (trial_age >= GOV_HOLD)
+			gov_check_trial();
+		return;
+	}
+
+	if (!gov_under() || cur_step >= top_step) {
+		under = 0;
+		gov_state = cur_step >= top_step ? "ok" : "hold";
+		return;
+	}
+	gov_state = "hold";
+	if (++under < GOV_HOLD || steps[cur_step + 1].cooldown)
+		return;
+	under = 0;
+	up_count++;
+	// measure the efficiency of the current step if not known yet
+	if (opt_max_power > 0. && e.packages && e.watts > 0. && !steps[cur_step].hpj)
+		steps[cur_step].hpj = rate / e.watts;
+	gov_set_step(cur_step + 1, "cooled down");
+	if (opt_max_power > 0. && e.packages) {
+		trial_from = cur_step - 1;
+		trial_age = -1;
+		trial_hashes = trial_joules = 0.;
+	}
+}
+
+static void *gov_thread(void *userdata)
+{
+	topology_bind_service();
+	while (!abort_flag) {
+		sleep(GOV_INTERVAL);
+		if (!autotune_running())
+			gov_sample();
+	}
+	return NULL;
+}
+
+void governor_start(int nthreads)
+{
+	struct energy_data e;
+	pthread_t pth;
+
+	gov_threads = min(nthreads, MAX_GPUS);
+	top_step = gov_threads + 3;
+	cur_step = top_step;
+	if (opt_max_temp <= 0. && opt_max_power <= 0.)
+		return;
+
+	if (opt_max_temp > 0. && cpu_temp(-1) <= 0.) {
+		applog(LOG_WARNING, "governor: no cpu temperature sensor, --max-temp ignored");
+		opt_max_temp = 0.;
+	}
+	if (opt_max_power > 0. && !energy_get(&e)) {
+		applog(LOG_WARNING, "governor: no rapl energy counter, --max-power ignored");
+		opt_max_power = 0.;
+	}
+	if (opt_max_temp <= 0. && opt_max_power <= 0.)
+		return;
+
+	gov_state = "ok";
+	if (pthread_create(&pth, NULL, gov_thread, NULL)) {
+		applog(LOG_WARNING, "governor thread create failed");
+		gov_state = "off";
+		return;
+	}
+	pthread_detach(pth);
+	gov_running = true;
+}
+
+/* thread count changed at runtime, keep all the threads if not limited */
+void governor_set_threads(int nthreads)
+{
+	bool top = cur_step >= top_step;
+	gov_threads = min(nthreads, MAX_GPUS);
+	top_step = gov_threads + 3;
+	memset(steps, 0, sizeof(steps));
+	trial_from = -1;
+	cur_step = top ? top_step : min((int) cur_step, top_step);
+}
+
+bool governor_thread_parked(int thr_id)
+{
+	return gov_running && thr_id >= step_threads(cur_step);
+}
+
+/* cap the scan time to keep the duty cycle period */
+bool governor_duty_cycle()
+{
+	return gov_running && step_duty(cur_step) < 100;
+}
+
+/**
+ * Pause after a scan of the last thread to mine only a part of the
+ * time, called before the scan end time so the rate includes it
+ */
+void governor_duty_pause(struct timeval *tv_start)
+{
+	struct timeval now, diff;
+	int duty = step_duty(cur_step);
+	uint64_t ms;
+	if (!gov_running || duty >= 100 || duty <= 0)
+		return;
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, tv_start);
+	ms = (uint64_t) diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	ms = min(ms * (100 - duty) / duty, (uint64_t) GOV_MAX_PAUSE);
+	usleep((useconds_t) ms * 1000);
+}
+
+/* api */
+void governor_get(struct governor_data *data)
+{
+	memset(data, 0, sizeof(*data));
+	data->enabled = gov_running;
+	data->state = gov_state;
+	data->max_temp = opt_max_temp;
+	data->max_power = opt_max_power;
+	data->hysteresis = opt_gov_hysteresis;
+	data->temp = gov_temp;
+	data->power = gov_power;
+	data->step = cur_step;
+	data->steps = top_step;
+	data->threads = step_threads(cur_step);
+	data->duty = step_duty(cur_step);
+	data->hpj = steps[cur_step].hpj;
+	data->downs = down_count;
+	data->ups = up_count;
+	data->reverts = revert_count;
+}
@@ -0,0 +1,300 @@
+/**
+ * Critical path latencies (monotonic clock)
+ *
+ * notify: line received -> job parsed -> work published -> thread hashing
+ * share:  nonce found -> submit sent -> pool answer
+ *
+ * Each stage is stored in a log-linear (HDR like) histogram,
+ * 16 sub-buckets per power of 2, so ~6% max error on percentiles.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "miner.h"
+
+#define LAT_SUB_BITS  4
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_MAX_EXP   41 /* 2^44 ns, ~4.8 hours */
+#define LAT_BINS      ((LAT_MAX_EXP + 1) * LAT_SUB_COUNT)
+
+#define LAT_PENDING_SHARES 32
+
+struct lat_histo {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t bins[LAT_BINS];
+};
+
+struct lat_thread {
+	uint32_t seq;      /* job attached to the thread work */
+	uint32_t seq_seen; /* last job recorded as hashed */
+	uint64_t tm_pub;
+	uint64_t tm_recv;
+	uint64_t tm_start;
+};
+
+struct lat_share {
+	uint32_t id;
+	uint64_t tm_found;
+	uint64_t tm_sent;
+};
+
+static const char *lat_stage_names[LAT_STAGES] = {
+	"notify_parse", "notify_work", "notify_hash", "notify_total",
+	"share_queue", "share_send", "share_ack", "share_total"
+};
+
+static struct lat_histo histos[LAT_STAGES];
+static struct lat_thread thr_lat[MAX_GPUS];
+static struct lat_share pending[LAT_PENDING_SHARES];
+
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* stratum thread only */
+static uint64_t tm_line = 0;
+static uint64_t tm_job_recv = 0;
+static uint64_t tm_job_parsed = 0;
+static bool job_pending = false;
+
+/* current published job */
+static uint32_t job_seq = 0;
+static uint64_t job_tm_pub = 0;
+static uint64_t job_tm_recv = 0;
+static uint64_t clean_tm_recv = 0;
+
+static double wasted_hashes = 0.;
+static uint32_t wasted_scans = 0;
+
+uint64_t latency_now()
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t) ((double) now.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static int lat_bin(uint64_t v)
+{
+	int msb = 0, e;
+	if (v < LAT_SUB_COUNT)
+		return (int) v;
+	while ((v >> msb) > 1) msb++;
+	e = msb - LAT_SUB_BITS + 1;
+	if (e > LAT_MAX_EXP)
+		return LAT_BINS - 1;
+	return (e << LAT_SUB_BITS) + (int) ((v >> (e - 1)) & (LAT_SUB_COUNT - 1));
+}
+
+/* middle value of a bin */
+static uint64_t lat_bin_value(int bin)
+{
+	int e = bin >> LAT_SUB_BITS;
+	uint64_t sub = (uint64_t) (bin & (LAT_SUB_COUNT - 1));
+	if (e == 0)
+		return sub;
+	return ((LAT_SUB_COUNT + sub) << (e - 1)) + ((1ULL << (e - 1)) >> 1);
+}
+
+/* lat_lock must be held */
+static void lat_record(int stage, uint64_t tm_from, uint64_t tm_to)
+{
+	struct lat_histo *h = &histos[stage];
+	uint64_t ns;
+	if (!tm_from || tm_to < tm_from)
+		return;
+	ns = tm_to - tm_from;
+	h->bins[lat_bin(ns)]++;
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max) h->max = ns;
+}
+
+static uint64_t lat_percentile(struct lat_histo *h, double pct)
+{
+	uint64_t rank = (uint64_t) (pct * (double) h->count + 0.5), cumul = 0;
+	if (!h->count)
+		return 0;
+	if (rank < 1) rank = 1;
+	for (int b = 0; b < LAT_BINS; b++) {
+		cumul += h->bins[b];
+		if (cumul >= rank)
+			return min(lat_bin_value(b), h->max);
+	}
+	return h->max;
+}
+
+/**
+ * Notify path (stratum thread)
+ */
+void latency_mark_recv()
+{
+	tm_line = latency_now();
+}
+
+void latency_job_notified(bool clean)
+{
+	uint64_t now = latency_now();
+	pthread_mutex_lock(&lat_lock);
+	lat_record(LAT_NOTIFY_PARSE, tm_line, now);
+	tm_job_recv = tm_line;
+	tm_job_parsed = now;
+	job_pending = true;
+	if (clean)
+		clean_tm_recv = tm_line;
+	pthread_mutex_unlock(&lat_lock);
+}
+
+/* new g_work generated from the last notify, g_work_lock held */
+void latency_job_published()
+{
+	uint64_t now = latency_now();
+	if (!job_pending)
+		return;
+	pthread_mutex_lock(&lat_lock);
+	lat_record(LAT_NOTIFY_WORK, tm_job_parsed, now);
+	job_seq++;
+	job_tm_pub = now;
+	job_tm_recv = tm_job_recv;
+	job_pending = false;
+	pthread_mutex_unlock(&lat_lock);
+}
+
+/**
+ * Mining threads
+ */
+
+/* thread work copied from g_work, g_work_lock held */
+void latency_job_attach(int thr_id)
+{
+	struct lat_thread *t = &thr_lat[thr_id % MAX_GPUS];
+	pthread_mutex_lock(&lat_lock);
+	t->seq = job_seq;
+	t->tm_pub = job_tm_pub;
+	t->tm_recv = job_tm_recv;
+	pthread_mutex_unlock(&lat_lock);
+}
+
+void latency_scan_start(int thr_id)
+{
+	struct lat_thread *t = &thr_lat[thr_id % MAX_GPUS];
+	uint64_t now = latency_now();
+	if (t->seq && t->seq != t->seq_seen) {
+		pthread_mutex_lock(&lat_lock);
+		lat_record(LAT_NOTIFY_HASH, t->tm_pub, now);
+		lat_record(LAT_NOTIFY_TOTAL, t->tm_recv, now);
+		pthread_mutex_unlock(&lat_lock);
+		t->seq_seen = t->seq;
+	}
+	t->tm_start = now;
+}
+
+/* count the hashes done after a clean job replaced the scanned one */
+void latency_scan_end(int thr_id, unsigned long hashes_done)
+{
+	struct lat_thread *t = &thr_lat[thr_id % MAX_GPUS];
+	uint64_t now = latency_now(), tm_sup;
+	if (!t->seq || !hashes_done || now <= t->tm_start)
+		return;
+	pthread_mutex_lock(&lat_lock);
+	if (clean_tm_recv > t->tm_pub) {
+		tm_sup = max(clean_tm_recv, t->tm_start);
+		if (tm_sup < now) {
+			wasted_hashes += (double) hashes_done * (double) (now - tm_sup) / (double) (now - t->tm_start);
+			wasted_scans++;
+		}
+	}
+	pthread_mutex_unlock(&lat_lock);
+}
+
+/**
+ * Share path
+ */
+void latency_share_sent(uint64_t tm_found, uint64_t tm_submit, uint32_t id)
+{
+	struct lat_share *s = &pending[id % LAT_PENDING_SHARES];
+	uint64_t now = latency_now();
+	pthread_mutex_lock(&lat_lock);
+	lat_record(LAT_SHARE_QUEUE, tm_found, tm_submit);
+	lat_record(LAT_SHARE_SEND, tm_submit, now);
+	s->id = id;
+	s->tm_found = tm_found;
+	s->tm_sent = now;
+	pthread_mutex_unlock(&lat_lock);
+}
+
+void latency_share_answer(uint32_t id)
+{
+	struct lat_share *s = &pending[id % LAT_PENDING_SHARES];
+	uint64_t now = latency_now();
+	pthread_mutex_lock(&lat_lock);
+	if (s->id == id && s->tm_sent) {
+		lat_record(LAT_SHARE_ACK, s->tm_sent, now);
+		lat_record(LAT_SHARE_TOTAL, s->tm_found, now);
+		s->tm_sent = 0;
+	}
+	pthread_mutex_unlock(&lat_lock);
+}
+
+/**
+ * Export the stages stats (in microseconds)
+ */
+int latency_get_stages(struct latency_data *data, int max_records)
+{
+	int records = min(max_records, LAT_STAGES);
+	pthread_mutex_lock(&lat_lock);
+	for (int n = 0; n < records; n++) {
+		struct lat_histo *h = &histos[n];
+		data[n].name = lat_stage_names[n];
+		data[n].count = (uint32_t) h->count;
+		data[n].avg = h->count ? 1e-3 * (double) h->sum / (double) h->count : 0.;
+		data[n].p50 = 1e-3 * (double) lat_percentile(h, 0.50);
+		data[n].p90 = 1e-3 * (double) lat_percentile(h, 0.90);
+		data[n].p99 = 1e-3 * (double) lat_percentile(h, 0.99);
+		data[n].p999 = 1e-3 * (double) lat_percentile(h, 0.999);
+		data[n].max = 1e-3 * (double) h->max;
+	}
+	pthread_mutex_unlock(&lat_lock);
+	return records;
+}
+
+double latency_get_wasted(uint32_t *scans)
+{
+	double hashes;
+	pthread_mutex_lock(&lat_lock);
+	hashes = wasted_hashes;
+	if (scans) *scans = wasted_scans;
+	pthread_mutex_unlock(&lat_lock);
+	return hashes;
+}
+
+void latency_log_summary()
+{
+	struct latency_data data[LAT_STAGES];
+	uint32_t scans = 0;
+	double wasted = latency_get_wasted(&scans);
+	latency_get_stages(data, LAT_STAGES);
+
+	if (data[LAT_NOTIFY_TOTAL].count)
+		applog(LOG_INFO, "notify->hash latency p50 %.2f ms, p99 %.2f ms, max %.2f ms (%u jobs)",
+			data[LAT_NOTIFY_TOTAL].p50 / 1000., data[LAT_NOTIFY_TOTAL].p99 / 1000.,
+			data[LAT_NOTIFY_TOTAL].max / 1000., data[LAT_NOTIFY_TOTAL].count);
+	if (data[LAT_SHARE_TOTAL].count)
+		applog(LOG_INFO, "share->ack latency p50 %.2f ms, p99 %.2f ms, max %.2f ms (%u shares)",
+			data[LAT_SHARE_TOTAL].p50 / 1000., data[LAT_SHARE_TOTAL].p99 / 1000.,
+			data[LAT_SHARE_TOTAL].max / 1000., data[LAT_SHARE_TOTAL].count);
+	if (scans)
+		applog(LOG_INFO, "%.0f hashes wasted on superseded jobs (%u scans)", wasted, scans);
+}
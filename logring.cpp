@@ -0,0 +1,253 @@
+/**
+ * Asynchronous applog output
+ *
+ * Each thread formats its message in its own single producer ring,
+ * a writer thread merges the rings (global sequence order) and does
+ * the terminal/syslog i/o. A full ring drops the line, the calling
+ * thread never waits on the output.
+ *
+ * Lines logged before log_async_start() or after log_async_stop(),
+ * from a signal handler or when all ring slots are taken are still
+ * written synchronously.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "miner.h"
+
+#define LOG_RING_SIZE  (64 * 1024) /* power of 2 */
+#define LOG_RING_MASK  (LOG_RING_SIZE - 1)
+#define LOG_MAX_RINGS  128
+#define LOG_MAX_LINE   (LOG_RING_SIZE / 8)
+#define LOG_ALIGN(x)   (((x) + 15) & ~15U)
+#define LOG_PADDING    -1
+
+/* 16 bytes, the ring offsets are always aligned on it */
+struct log_rec {
+	uint32_t size; /* aligned record size */
+	int32_t prio;  /* or LOG_PADDING up to the ring end */
+	uint32_t seq;
+	uint32_t time;
+};
+
+struct log_ring {
+	std::atomic<uint32_t> head; /* written by the owner thread */
+	char _pad1[60];
+	std::atomic<uint32_t> tail; /* written by the log thread */
+	char _pad2[60];
+	char buf[LOG_RING_SIZE];
+};
+
+static struct log_ring *rings[LOG_MAX_RINGS];
+static std::atomic<int> rings_count(0);
+static std::atomic<uint32_t> log_seq(0);
+static std::atomic<uint32_t> drop_full(0);
+static uint32_t drop_rate = 0;
+
+static __thread struct log_ring *thr_ring = NULL;
+static __thread bool thr_noring = false;
+static __thread bool thr_pushing = false;
+
+static volatile bool log_running = false;
+static volatile bool log_stopping = false;
+static pthread_t log_thr;
+
+int opt_log_rate = 0; /* info/debug lines per second, 0 = no limit */
+bool opt_sync_log = false;
+
+static struct log_ring* log_ring_get()
+{
+	int slot;
+	if (thr_ring || thr_noring)
+		return thr_ring;
+	slot = rings_count.fetch_add(1);
+	if (slot >= LOG_MAX_RINGS) {
+		thr_noring = true;
+		return NULL;
+	}
+	thr_ring = (struct log_ring*) calloc(1, sizeof(struct log_ring));
+	if (!thr_ring) {
+		thr_noring = true;
+		return NULL;
+	}
+	// the log thread skips the slot until it is set
+	std::atomic_thread_fence(std::memory_order_release);
+	rings[slot] = thr_ring;
+	return thr_ring;
+}
+
+/**
+ * Queue a formatted line, false if the caller has to write it
+ */
+bool log_async_push(int prio, const char *msg)
+{
+	struct log_ring *r;
+	struct log_rec *rec;
+	uint32_t head, tail, pos, room, need;
+	size_t len;
+
+	if (!log_running || thr_pushing)
+		return false;
+	r = log_ring_get();
+	if (!r)
+		return false;
+
+	thr_pushing = true;
+	len = strlen(msg);
+	if (len > LOG_MAX_LINE)
+		len = LOG_MAX_LINE;
+	need = LOG_ALIGN((uint32_t) (sizeof(struct log_rec) + len + 1));
+
+	head = r->head.load(std::memory_order_relaxed);
+	tail = r->tail.load(std::memory_order_acquire);
+	pos = head & LOG_RING_MASK;
+	room = LOG_RING_SIZE - pos;
+	if (room < need) {
+		// no wrapped records, pad the end of the ring
+		if (head - tail + room + need > LOG_RING_SIZE)
+			goto full;
+		rec = (struct log_rec*) &r->buf[pos];
+		rec->size = room;
+		rec->prio = LOG_PADDING;
+		head += room;
+		pos = 0;
+	} else if (head - tail + need > LOG_RING_SIZE) {
+		goto full;
+	}
+
+	rec = (struct log_rec*) &r->buf[pos];
+	rec->size = need;
+	rec->prio = prio;
+	rec->seq = log_seq.fetch_add(1, std::memory_order_relaxed);
+	rec->time = (uint32_t) time(NULL);
+	memcpy(&rec[1], msg, len);
+	((char*) &rec[1])[len] = '\0';
+	r->head.store(head + need, std::memory_order_release);
+	thr_pushing = false;
+	return true;
+
+full:
+	drop_full++;
+	thr_pushing = false;
+	return true;
+}
+
+/* first record of a ring, skipping the end padding */
+static struct log_rec* log_ring_peek(struct log_ring *r)
+{
+	uint32_t tail = r->tail.load(std::memory_order_relaxed);
+	uint32_t head = r->head.load(std::memory_order_acquire);
+	while (tail != head) {
+		struct log_rec *rec = (struct log_rec*) &r->buf[tail & LOG_RING_MASK];
+		if (rec->prio != LOG_PADDING)
+			return rec;
+		tail += rec->size;
+		r->tail.store(tail, std::memory_order_release);
+	}
+	return NULL;
+}
+
+/* token bucket, only applied to the info and debug lines */
+static bool log_rate_allow(int prio, struct timeval *now)
+{
+	static double tokens = 0.;
+	static struct timeval last = { 0 };
+	double elapsed;
+	if (!opt_log_rate || (prio != LOG_INFO && prio != LOG_DEBUG))
+		return true;
+	elapsed = (double) (now->tv_sec - last.tv_sec) + 1e-6 * (double) (now->tv_usec - last.tv_usec);
+	last = *now;
+	tokens = min(tokens + elapsed * opt_log_rate, (double) opt_log_rate);
+	if (tokens < 1.)
+		return false;
+	tokens -= 1.;
+	return true;
+}
+
+/* write all the queued lines, in sequence order */
+static int log_drain()
+{
+	struct timeval now;
+	int count = 0;
+	gettimeofday(&now, NULL);
+	for (;;) {
+		struct log_ring *r, *first = NULL;
+		struct log_rec *rec, *oldest = NULL;
+		int n = min(rings_count.load(std::memory_order_acquire), LOG_MAX_RINGS);
+		for (int i = 0; i < n; i++) {
+			r = rings[i];
+			if (!r || !(rec = log_ring_peek(r)))
+				continue;
+			if (!oldest || (int32_t) (rec->seq - oldest->seq) < 0) {
+				oldest = rec;
+				first = r;
+			}
+		}
+		if (!oldest)
+			break;
+		if (log_rate_allow(oldest->prio, &now))
+			applog_output(oldest->prio, (time_t) oldest->time, (char*) &oldest[1]);
+		else
+			drop_rate++;
+		first->tail.store(first->tail.load(std::memory_order_relaxed) + oldest->size,
+			std::memory_order_release);
+		count++;
+	}
+	return count;
+}
+
+static void *log_thread(void *userdata)
+{
+	uint32_t reported = 0;
+	time_t tm_report = 0;
+	topology_bind_service();
+	while (!log_stopping) {
+		if (!log_drain())
+			usleep(20 * 1000);
+		uint32_t dropped = drop_full.load() + drop_rate;
+		if (dropped != reported && time(NULL) - tm_report >= 10) {
+			char msg[96];
+			snprintf(msg, sizeof(msg), "%u log lines dropped (%u rate limited)", dropped, drop_rate);
+			applog_output(LOG_WARNING, time(NULL), msg);
+			reported = dropped;
+			tm_report = time(NULL);
+		}
+	}
+	log_drain();
+	return NULL;
+}
+
+void log_async_start()
+{
+	if (log_running || opt_sync_log)
+		return;
+	log_stopping = false;
+	if (pthread_create(&log_thr, NULL, log_thread, NULL)) {
+		applog(LOG_ERR, "log thread create failed");
+		return;
+	}
+	log_running = true;
+	atexit(log_async_stop);
+}
+
+/* flush the rings and return to synchronous writes */
+void log_async_stop()
+{
+	if (!log_running)
+		return;
+	log_running = false;
+	log_stopping = true;
+	if (pthread_equal(pthread_self(), log_thr))
+		return;
+	pthread_join(log_thr, NULL);
+	// lines queued during the last drain
+	log_drain();
+}
+
+uint32_t log_async_dropped()
+{
+	return drop_full.load() + drop_rate;
+}
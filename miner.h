@@ -1,12 +1,15 @@
 #ifndef __MINER_H__
 #define __MINER_H__
 
+#include <ccminer-config.h>
+
+/* sys/sdt.h defines templates in c++, it can't have a C linkage */
+#include "probes.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#include <ccminer-config.h>
-
 #include <stdbool.h>
 #include <inttypes.h>
 #include <sys/time.h>
@@ -292,6 +295,14 @@ void algo_free_all(int thr_id);
 /* api related */
 void *api_thread(void *userdata);
 void api_set_throughput(int thr_id, uint32_t throughput);
+void api_push_event(int topic, const char *fmt, ...);
+
+/* api push topics */
+#define API_PUSH_HASHRATE 1
+#define API_PUSH_SHARES   2
+#define API_PUSH_JOBS     4
+#define API_PUSH_POOLS    8
+#define API_PUSH_ALL      0xF
 void gpu_increment_reject(int thr_id);
 
 struct monitor_info {
@@ -370,6 +381,140 @@ struct hashlog_data {
 	uint32_t tm_sent;
 };
 
+struct latency_data {
+	const char *name;
+	uint32_t count;
+	/* in microseconds */
+	double avg;
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+	double max;
+};
+
+struct perf_data {
+	uint64_t hashes;
+	double values[4]; /* PERF_COUNTERS, -1 if unavailable */
+};
+
+struct topology_data {
+	int packages;
+	int nodes;
+	int l3;
+	int cores;
+	int threads;
+	int allowed;       /* cpus usable by the miners */
+	int allowed_cores; /* first smt thread of a core */
+	const char *placement;
+	int reserved; /* cpu or -1 */
+	int p_threads; /* hybrid cpus, 0 if not */
+	int e_threads;
+};
+
+enum core_types {
+	CORE_TYPE_ANY = 0,
+	CORE_TYPE_P,
+	CORE_TYPE_E
+};
+
+
+struct cgroup_data {
+	int version;  /* 0 if not found */
+	double quota; /* in cpus, 0 if not limited */
+	const char *cpuset;
+	int cpus;     /* effective, 0 if not limited */
+	int active;   /* mining threads */
+	uint64_t periods;
+	uint64_t throttled;
+	uint64_t throttled_ms;
+};
+
+struct park_data {
+	bool enabled;
+	double busy;       /* host steal+irq ratio */
+	double dispersion; /* coefficient of variation of the thread rates */
+	int parked;
+	uint32_t parks;
+	uint32_t moves;
+	uint32_t reverts;
+};
+
+struct park_thread_data {
+	int cpu;
+	double busy; /* steal+irq ratio of the cpu */
+	double rate;
+	int slow;    /* consecutive slow samples */
+	bool parked;
+};
+
+struct energy_data {
+	int packages;   /* package zones with an energy counter */
+	double watts;   /* sum of the packages, last sample */
+	double joules;  /* since the start */
+	double hashes;  /* hashrate integrated over the same time */
+	double seconds;
+	double hpj;     /* hashes per joule */
+	double hpw;     /* current hashrate per watt */
+};
+
+struct energy_zone_data {
+	const char *name;
+	int package;    /* -1 for psys */
+	bool domain;    /* sub zone of the package (core, dram...) */
+	double watts;
+	double joules;
+};
+
+struct governor_data {
+	bool enabled;
+	const char *state; /* ok, over, hold (waiting to step up), trial */
+	double max_temp;
+	double max_power;
+	int hysteresis;    /* % */
+	double temp;
+	double power;
+	int step;          /* 0 = paused, steps = all the threads */
+	int steps;
+	int threads;
+	int duty;          /* % of the time the last thread mines */
+	double hpj;        /* measured hashes per joule of the step */
+	uint32_t downs;
+	uint32_t ups;
+	uint32_t reverts;
+};
+
+struct verify_data {
+	bool enabled;
+	uint32_t checked;
+	uint32_t hw_errors;
+	int disabled;      /* threads */
+	double avg_ms;     /* of a verification */
+};
+
+struct autotune_result {
+	int threads;
+	char placement[16];
+	double hashrate;
+	uint32_t tuned;
+};
+
+struct numa_data {
+	int cpu;        /* pinned cpu or -1 */
+	int node;       /* node of the cpu, -1 if not replicated */
+	int work_node;  /* node of the job snapshot pages */
+	int arena_node; /* node of the thread key arena */
+	uint32_t refreshes;
+};
+
+struct phase_data {
+	const char *name;
+	uint64_t cycles;
+	uint64_t calls;
+	double avg; /* cycles per call */
+	double cph; /* cycles per hash */
+};
+
 /* end of api */
 
 struct thr_info {
@@ -499,6 +644,15 @@ extern void format_hashrate(double hashrate, char *output);
 extern void format_hashrate_unit(double hashrate, char *output, const char* unit);
 extern void applog(int prio, const char *fmt, ...);
 extern void gpulog(int prio, int thr_id, const char *fmt, ...);
+void applog_output(int prio, time_t now, const char *msg);
+
+/* logring.cpp */
+extern int opt_log_rate;
+extern bool opt_sync_log;
+bool log_async_push(int prio, const char *msg);
+void log_async_start();
+void log_async_stop();
+uint32_t log_async_dropped();
 
 void get_defconfig_path(char *out, size_t bufsize, char *argv0);
 extern void cbin2hex(char *out, const char *in, size_t len);
@@ -521,12 +675,11 @@ void bn_set_target_ratio(struct work* work, uint32_t* hash, int nonce);
 void work_set_target_ratio(struct work* work, uint32_t* hash);
 
 // bench
-extern int bench_algo;
-void bench_init(int threads);
-void bench_free();
-bool bench_algo_switch_next(int thr_id);
-void bench_set_throughput(int thr_id, uint32_t throughput);
-void bench_display_results();
+extern int opt_bench_warmup;
+extern uint64_t opt_bench_hashes;
+extern char *opt_bench_json;
+void bench_work(struct work *work, int thr_id);
+int  bench_run(int nthreads);
 
 struct stratum_job {
 	char *job_id;
@@ -614,6 +767,9 @@ struct work {
 	uint32_t scanned_from;
 	uint32_t scanned_to;
 
+	/* monotonic time of the (first) nonce found, see latency.cpp */
+	uint64_t tm_found;
+
 	/* pok getwork txs */
 	uint32_t tx_count;
 	struct tx txs[POK_MAX_TXS];
@@ -731,8 +887,180 @@ double stats_get_gpu_speed(int gpu_id);
 int  stats_get_history(int thr_id, struct stats_data *data, int max_records);
 void stats_purge_old(void);
 void stats_purge_all(void);
+void stats_ignore_thread(int thr_id);
 void stats_getmeminfo(uint64_t *mem, uint32_t *records);
 
+enum latency_stages {
+	LAT_NOTIFY_PARSE = 0,
+	LAT_NOTIFY_WORK,
+	LAT_NOTIFY_HASH,
+	LAT_NOTIFY_TOTAL,
+	LAT_SHARE_QUEUE,
+	LAT_SHARE_SEND,
+	LAT_SHARE_ACK,
+	LAT_SHARE_TOTAL,
+	LAT_STAGES
+};
+
+uint64_t latency_now();
+void latency_mark_recv();
+void latency_job_notified(bool clean);
+void latency_job_published();
+void latency_job_attach(int thr_id);
+void latency_scan_start(int thr_id);
+void latency_scan_end(int thr_id, unsigned long hashes_done);
+void latency_share_sent(uint64_t tm_found, uint64_t tm_submit, uint32_t id);
+void latency_share_answer(uint32_t id);
+int  latency_get_stages(struct latency_data *data, int max_records);
+double latency_get_wasted(uint32_t *scans);
+void latency_log_summary();
+
+enum perf_counters {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_COUNTERS
+};
+
+bool perf_thread_init(int thr_id);
+void perf_thread_add_hashes(int thr_id, uint64_t hashes);
+bool perf_thread_read(int thr_id, struct perf_data *data);
+
+enum verus_phases {
+	PHASE_HASH_HALF = 0,
+	PHASE_GEN_KEY,
+	PHASE_CLHASH,
+	PHASE_HARAKA,
+	PHASE_FIXKEY,
+	PHASE_TARGET,
+	PHASE_HASH_TOTAL,
+	PHASE_LOCK_WAIT,
+	PHASE_QUEUE_WAIT,
+	PHASES
+};
+
+/* topology.cpp */
+extern char *opt_cpu_exclude;
+extern bool opt_cpu_reserve;
+extern int opt_core_type;
+const char* sysfs_root();
+bool sysfs_read(const char *path, char *buf, size_t len);
+int sysfs_read_int(const char *path, int defval);
+int cpulist_parse(const char *list, bool *set, int max);
+bool topology_set_placement(const char *name);
+const char* topology_placement_name();
+void topology_read();
+int  topology_compute(int nthreads);
+int  topology_reload(int nthreads);
+void topology_init(int nthreads);
+uint32_t topology_generation();
+void topology_get(struct topology_data *data);
+int topology_thread_cpu(int thr_id);
+int topology_cpu_node(int cpu);
+int topology_cpu_count();
+int topology_cpu_type(int cpu);
+const char* topology_core_type_name(int type);
+bool topology_set_core_type(const char *name);
+bool topology_cpu_allowed(int cpu);
+void topology_move_thread(int thr_id, int cpu);
+void topology_bind_miner(int thr_id);
+void topology_bind_service();
+
+/* cgroup.cpp */
+extern bool opt_no_cgroup;
+void cgroup_init();
+void cgroup_start(int nthreads);
+void cgroup_set_threads(int nthreads);
+bool cgroup_cpuset(bool *set, int max);
+int  cgroup_effective_cpus();
+int  cgroup_thread_count(int threads);
+bool cgroup_thread_parked(int thr_id);
+bool cgroup_get(struct cgroup_data *data);
+
+/* park.cpp */
+extern bool opt_thread_parking;
+void park_start(int nthreads);
+void park_set_threads(int nthreads);
+bool park_thread_parked(int thr_id);
+void park_get(struct park_data *data);
+bool park_get_thread(int thr_id, struct park_thread_data *data);
+
+/* sysinfos.cpp */
+float cpu_temp(int core);
+uint32_t cpu_clock(int core);
+int cpu_fanpercent();
+void energy_start();
+void energy_update();
+bool energy_get(struct energy_data *data);
+bool energy_get_zone(int index, struct energy_zone_data *data);
+
+/* governor.cpp */
+extern double opt_max_power;
+extern int opt_gov_hysteresis;
+void governor_start(int nthreads);
+void governor_set_threads(int nthreads);
+bool governor_thread_parked(int thr_id);
+bool governor_duty_cycle();
+void governor_duty_pause(struct timeval *tv_start);
+void governor_get(struct governor_data *data);
+
+/* verify.cpp */
+extern bool opt_verify_shares;
+extern int opt_verify_disable;
+void verify_start();
+bool verify_submit(struct thr_info *thr, const struct work *work);
+bool verify_thread_disabled(int thr_id);
+void verify_get(struct verify_data *data);
+uint16_t verify_cpu_errors(int cpu);
+
+/* replay.cpp */
+extern char *opt_record;
+extern char *opt_replay;
+extern double opt_replay_speed;
+bool record_open(const char *path);
+void record_line(int pooln, bool sent, const char *line);
+void record_close();
+char *replay_start(const char *path);
+
+/* verifyserver.cpp */
+extern char *opt_verify_server;
+void verify_server_stdio();
+int verify_server_run(int nthreads);
+
+/* stratumbench.cpp */
+extern int opt_bench_stratum;
+int bench_stratum_run();
+
+/* autotune.cpp */
+extern bool opt_tune;
+extern bool opt_tune_force;
+extern char *opt_tune_file;
+bool autotune_startup(int *threads);
+bool autotune_request();
+bool autotune_running();
+void autotune_park();
+
+/* numa.cpp */
+extern bool opt_no_numa;
+void numa_init(int nthreads);
+bool numa_enabled();
+uint32_t numa_bind_failures();
+int  numa_mem_node(const void *ptr);
+int  numa_thread_node(int thr_id);
+void numa_work_updated();
+struct work* numa_work_local(int thr_id, struct work *gw);
+struct work_restart* numa_restart(int thr_id);
+void numa_restart_thread(int thr_id);
+void* numa_thread_arena(int thr_id, size_t size);
+bool numa_get_thread(int thr_id, struct numa_data *data);
+
+extern uint32_t opt_phase_sample;
+uint64_t phase_tsc();
+void phase_add(int thr_id, int phase, uint64_t cycles);
+void phase_add_hashes(int thr_id, uint64_t hashes);
+int  phase_get_stats(int thr_id, struct phase_data *data, int max_records);
+
 struct thread_q;
 
 extern struct thread_q *tq_new(void);
@@ -752,8 +1080,13 @@ extern void tq_thaw(struct thread_q *tq);
 #define EXIT_CODE_KILLED        7
 
 void parse_arg(int key, char *arg);
+bool miner_set_threads(int n);
+int  miner_thread_slots();
+int  miner_threads_started();
 void proper_exit(int reason);
 void restart_threads(void);
+bool submit_work(struct thr_info *thr, const struct work *work_in);
+bool stratum_gen_work(struct stratum_ctx *sctx, struct work *work);
 
 size_t time2str(char* buf, time_t timer);
 char* atime2str(time_t timer);
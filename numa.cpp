@@ -0,0 +1,267 @@
+/**
+ * NUMA placement of the shared mining data (linux mbind/get_mempolicy)
+ *
+ * On a multi node host, each node gets its own copy of the current job
+ * (refreshed once per job by the first thread of the node which sees
+ * it), its own block of restart flags, and each mining thread gets a
+ * key arena allocated on its node. Single node hosts and unpinned
+ * threads keep using g_work and work_restart.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+
+#include "miner.h"
+
+#ifdef __linux
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#define NUMA_MAX_NODES 64
+
+struct numa_node {
+	bool used;
+	struct work *work;            /* job replica */
+	uint32_t work_seq;
+	uint32_t refreshes;
+	struct work_restart *restart; /* restart_count entries */
+	int bind_node;                /* node of the allocations, -1 if not bound */
+};
+
+struct numa_arena {
+	void *ptr;
+	size_t size;
+	int node;
+};
+
+static struct numa_node nodes[NUMA_MAX_NODES];
+static struct numa_arena arenas[MAX_GPUS];
+static int restart_count = 0;
+static bool numa_active = false;
+static uint32_t bind_failures = 0;
+static std::atomic<uint32_t> work_seq(0);
+
+extern struct work _ALIGN(64) g_work;
+
+bool opt_no_numa = false;
+
+static size_t page_round(size_t size)
+{
+	const size_t page = 4096;
+	return (size + page - 1) & ~(page - 1);
+}
+
+/* page aligned and zeroed, preferred on node (if >= 0) */
+static void* numa_alloc_node(size_t size, int node)
+{
+#ifdef __linux
+	void *p;
+	size = page_round(size);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if (node >= 0) {
+		unsigned long mask = 1UL << node;
+		if (syscall(__NR_mbind, p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0)) {
+			if (!bind_failures++ && opt_debug)
+				applog(LOG_DEBUG, "numa: mbind on node %d failed, %s", node, strerror(errno));
+		}
+	}
+	// fault the pages now, according to the policy
+	memset(p, 0, size);
+	return p;
+#else
+	return aligned_calloc((int) size);
+#endif
+}
+
+static void numa_free(void *p, size_t size)
+{
+	if (!p) return;
+#ifdef __linux
+	munmap(p, page_round(size));
+#else
+	aligned_free(p);
+#endif
+}
+
+/* node of the page containing ptr, -1 if unknown */
+int numa_mem_node(const void *ptr)
+{
+#ifdef __linux
+	int node = -1;
+	if (!ptr || syscall(__NR_get_mempolicy, &node, NULL, 0, ptr, MPOL_F_NODE | MPOL_F_ADDR))
+		return -1;
+	return node;
+#else
+	return -1;
+#endif
+}
+
+/* node of the cpu the thread is pinned to, -1 if not numa or not pinned */
+int numa_thread_node(int thr_id)
+{
+	int cpu, node;
+	if (!numa_active)
+		return -1;
+	cpu = topology_thread_cpu(thr_id);
+	if (cpu < 0)
+		return -1;
+	node = topology_cpu_node(cpu);
+	if (node < 0 || node >= NUMA_MAX_NODES || !nodes[node].used)
+		return -1;
+	return node;
+}
+
+/**
+ * Called once the mining threads are placed, allocates the replicas
+ * of the nodes having mining cpus
+ */
+void numa_init(int nthreads)
+{
+	struct topology_data topo;
+	int count = 0;
+
+	topology_get(&topo);
+	if (opt_no_numa || topo.nodes < 2)
+		return;
+
+	restart_count = max(nthreads, MAX_GPUS);
+	for (int t = 0; t < nthreads; t++) {
+		int cpu = topology_thread_cpu(t);
+		int node = cpu >= 0 ? topology_cpu_node(cpu) : -1;
+		struct numa_node *nn;
+		if (node < 0 || node >= NUMA_MAX_NODES || nodes[node].used)
+			continue;
+		nn = &nodes[node];
+		nn->work = (struct work*) numa_alloc_node(sizeof(struct work), node);
+		nn->restart = (struct work_restart*) numa_alloc_node(restart_count * sizeof(struct work_restart), node);
+		if (!nn->work || !nn->restart) {
+			numa_free(nn->work, sizeof(struct work));
+			numa_free(nn->restart, restart_count * sizeof(struct work_restart));
+			nn->work = NULL;
+			nn->restart = NULL;
+			continue;
+		}
+		nn->work_seq = UINT32_MAX; // never copied
+		nn->bind_node = numa_mem_node(nn->work);
+		nn->used = true;
+		count++;
+	}
+
+	// nothing to replicate if all the threads are on the same node
+	numa_active = count > 1;
+	if (!numa_active) {
+		for (int n = 0; n < NUMA_MAX_NODES; n++) {
+			if (!nodes[n].used) continue;
+			numa_free(nodes[n].work, sizeof(struct work));
+			numa_free(nodes[n].restart, restart_count * sizeof(struct work_restart));
+			memset(&nodes[n], 0, sizeof(struct numa_node));
+		}
+		return;
+	}
+	applog(LOG_INFO, "NUMA: job and restart flags replicated on %d nodes", count);
+}
+
+/* to call after each g_work change, the replicas are refreshed lazily */
+void numa_work_updated()
+{
+	work_seq++;
+}
+
+/**
+ * Job snapshot to read for this thread, g_work_lock must be held
+ */
+struct work* numa_work_local(int thr_id, struct work *gw)
+{
+	int node = numa_thread_node(thr_id);
+	struct numa_node *nn;
+	uint32_t seq;
+	if (node < 0)
+		return gw;
+	nn = &nodes[node];
+	seq = work_seq.load();
+	if (nn->work_seq != seq) {
+		// single remote read per node and job
+		memcpy(nn->work, gw, sizeof(struct work));
+		nn->work_seq = seq;
+		nn->refreshes++;
+	}
+	return nn->work;
+}
+
+/* restart flag polled by the thread */
+struct work_restart* numa_restart(int thr_id)
+{
+	int node = numa_thread_node(thr_id);
+	if (node < 0 || thr_id >= restart_count)
+		return &work_restart[thr_id];
+	return &nodes[node].restart[thr_id];
+}
+
+/* the thread placement can change (autotune), so set all the copies */
+void numa_restart_thread(int thr_id)
+{
+	work_restart[thr_id].restart = 1;
+	if (!numa_active || thr_id >= restart_count)
+		return;
+	for (int n = 0; n < NUMA_MAX_NODES; n++)
+		if (nodes[n].used)
+			nodes[n].restart[thr_id].restart = 1;
+}
+
+/**
+ * Per thread scratch memory (verus key), allocated on the thread node
+ * and kept between the scans. NULL if the caller has to allocate it.
+ */
+void* numa_thread_arena(int thr_id, size_t size)
+{
+	struct numa_arena *a;
+	int node;
+	if (thr_id < 0 || thr_id >= MAX_GPUS)
+		return NULL;
+	a = &arenas[thr_id];
+	node = numa_thread_node(thr_id);
+	if (a->ptr && (a->size < size || a->node != node)) {
+		numa_free(a->ptr, a->size);
+		a->ptr = NULL;
+	}
+	if (!a->ptr) {
+		a->ptr = numa_alloc_node(size, node);
+		a->size = a->ptr ? size : 0;
+		a->node = node;
+	}
+	return a->ptr;
+}
+
+/* api: requested and actual node of the thread memory */
+bool numa_get_thread(int thr_id, struct numa_data *data)
+{
+	memset(data, 0, sizeof(*data));
+	if (thr_id < 0 || thr_id >= MAX_GPUS)
+		return false;
+	data->node = numa_thread_node(thr_id);
+	data->cpu = topology_thread_cpu(thr_id);
+	data->arena_node = numa_mem_node(arenas[thr_id].ptr);
+	if (data->node >= 0) {
+		data->work_node = nodes[data->node].bind_node;
+		data->refreshes = nodes[data->node].refreshes;
+	} else {
+		data->work_node = numa_mem_node(&g_work);
+	}
+	return true;
+}
+
+bool numa_enabled()
+{
+	return numa_active;
+}
+
+uint32_t numa_bind_failures()
+{
+	return bind_failures;
+}
@@ -0,0 +1,355 @@
+/**
+ * Contention controller (--thread-parking)
+ *
+ * Samples the steal and irq time of each cpu (/proc/stat) and the rate
+ * of each mining thread. A thread which stays slow (on a stolen or irq
+ * loaded cpu, or far below the median rate) is first moved to a free
+ * quiet cpu, else parked. Each action is checked after PARK_HOLD
+ * samples and reverted if the total hashrate did not improve, parked
+ * threads are resumed when the host steal time is low again.
+ *
+ * The proc root can be changed with CCMINER_PROCFS (tests).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "miner.h"
+
+#define PARK_INTERVAL   5    /* seconds between the samples */
+#define PARK_MAX_CPUS   1024
+#define PARK_BUSY_HIGH  0.10 /* steal+irq ratio of a contended cpu */
+#define PARK_BUSY_LOW   0.03 /* host ratio to resume the parked threads */
+#define PARK_SLOW_RATIO 0.70 /* of the median thread rate */
+#define PARK_HOLD       3    /* samples before an action and its check */
+#define PARK_GAIN       0.02 /* required improvement of the total rate */
+#define PARK_COOLDOWN   24   /* samples before acting again on a reverted thread */
+
+extern pthread_mutex_t stats_lock;
+extern double thr_hashrates[MAX_GPUS];
+
+struct park_cpu {
+	uint64_t total;
+	uint64_t steal;
+	uint64_t irq;
+	double busy; /* steal+irq ratio of the last sample */
+};
+
+struct park_thread {
+	volatile bool parked;
+	int slow;     /* consecutive slow samples */
+	int cooldown;
+	double rate;
+};
+
+enum park_action {
+	PARK_NONE = 0,
+	PARK_PARK,
+	PARK_MOVE,
+	PARK_RESUME
+};
+
+static struct park_cpu pcpu[PARK_MAX_CPUS];
+static struct park_cpu pall;
+static struct park_thread pthr[MAX_GPUS];
+static int park_threads = 0;
+static double park_dispersion = 0.;
+static uint32_t park_count = 0, move_count = 0, revert_count = 0;
+
+/* pending action, checked after PARK_HOLD samples */
+static int act_type = PARK_NONE;
+static int act_thread = -1;
+static int act_from = -1; /* previous cpu of a move */
+static int act_age = 0;
+static double act_before = 0.;
+static double act_after = 0.;
+static int calm = 0;
+
+bool opt_thread_parking = false;
+
+static const char* procfs_root()
+{
+	const char *root = getenv("CCMINER_PROCFS");
+	return (root && strlen(root)) ? root : "/proc";
+}
+
+static void park_update_cpu(struct park_cpu *c, uint64_t total, uint64_t steal, uint64_t irq)
+{
+	if (c->total && total > c->total)
+		c->busy = (double) ((steal - c->steal) + (irq - c->irq)) / (double) (total - c->total);
+	c->total = total;
+	c->steal = steal;
+	c->irq = irq;
+}
+
+static bool park_read_stat()
+{
+	char path[512], line[512];
+	FILE *fd;
+	snprintf(path, sizeof(path), "%s/stat", procfs_root());
+	fd = fopen(path, "r");
+	if (!fd)
+		return false;
+	while (fgets(line, sizeof(line), fd)) {
+		unsigned long long v[8] = { 0 };
+		uint64_t total = 0;
+		int cpu = -1, n;
+		char *p = line + 3;
+		if (strncmp(line, "cpu", 3))
+			break;
+		if (isdigit(*p))
+			cpu = (int) strtol(p, &p, 10);
+		// user nice system idle iowait irq softirq steal
+		n = sscanf(p, "%llu %llu %llu %llu %llu %llu %llu %llu",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+		if (n < 4)
+			continue;
+		for (int i = 0; i < 8; i++)
+			total += v[i];
+		if (cpu < 0)
+			park_update_cpu(&pall, total, v[7], v[5] + v[6]);
+		else if (cpu < PARK_MAX_CPUS)
+			park_update_cpu(&pcpu[cpu], total, v[7], v[5] + v[6]);
+	}
+	fclose(fd);
+	return true;
+}
+
+static double cpu_busy(int cpu)
+{
+	return (cpu >= 0 && cpu < PARK_MAX_CPUS) ? pcpu[cpu].busy : pall.busy;
+}
+
+static bool thread_mining(int t)
+{
+	return !pthr[t].parked && !cgroup_thread_parked(t) && !governor_thread_parked(t);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* total rate of the mining threads, median and dispersion */
+static double park_read_rates(double *median)
+{
+	double rates[MAX_GPUS], total = 0., var = 0., mean;
+	int n = 0;
+	pthread_mutex_lock(&stats_lock);
+	for (int t = 0; t < park_threads; t++) {
+		pthr[t].rate = thread_mining(t) ? thr_hashrates[t] : 0.;
+		if (pthr[t].rate > 0.)
+			rates[n++] = pthr[t].rate;
+	}
+	pthread_mutex_unlock(&stats_lock);
+	if (!n) {
+		*median = 0.;
+		return 0.;
+	}
+	for (int i = 0; i < n; i++)
+		total += rates[i];
+	mean = total / n;
+	for (int i = 0; i < n; i++)
+		var += (rates[i] - mean) * (rates[i] - mean) / n;
+	park_dispersion = mean > 0. ? sqrt(var) / mean : 0.;
+	qsort(rates, n, sizeof(double), cmp_double);
+	*median = rates[n / 2];
+	return total;
+}
+
+/* quiet allowed cpu without mining thread, -1 if none */
+static int park_free_cpu()
+{
+	int best = -1;
+	for (int c = 0; c < PARK_MAX_CPUS && c < topology_cpu_count(); c++) {
+		bool used = false;
+		if (!topology_cpu_allowed(c) || pcpu[c].busy >= PARK_BUSY_LOW)
+			continue;
+		for (int t = 0; t < park_threads && !used; t++)
+			used = thread_mining(t) && topology_thread_cpu(t) == c;
+		if (!used && (best < 0 || pcpu[c].busy < pcpu[best].busy))
+			best = c;
+	}
+	return best;
+}
+
+static void park_act(int type, int t, double total)
+{
+	act_type = type;
+	act_thread = t;
+	act_age = 0;
+	act_before = total;
+	act_after = 0.;
+	pthr[t].slow = 0;
+	switch (type) {
+	case PARK_MOVE:
+		act_from = topology_thread_cpu(t);
+		topology_move_thread(t, park_free_cpu());
+		move_count++;
+		applog(LOG_NOTICE, "CPU T%d: contended cpu %d (%.0f%% steal/irq), moved to cpu %d",
+			t, act_from, cpu_busy(act_from) * 100., topology_thread_cpu(t));
+		break;
+	case PARK_PARK:
+		pthr[t].parked = true;
+		park_count++;
+		applog(LOG_NOTICE, "CPU T%d: parked, %.0f%% steal/irq on cpu %d", t,
+			cpu_busy(topology_thread_cpu(t)) * 100., topology_thread_cpu(t));
+		break;
+	case PARK_RESUME:
+		pthr[t].parked = false;
+		applog(LOG_NOTICE, "CPU T%d: resumed, host steal/irq %.1f%%", t, pall.busy * 100.);
+		break;
+	}
+}
+
+/* keep the action only if the total rate improved */
+static void park_check_action()
+{
+	int t = act_thread;
+	double need = act_type == PARK_RESUME ? act_before : act_before * (1. + PARK_GAIN);
+	if (act_after / PARK_HOLD >= need) {
+		act_type = PARK_NONE;
+		return;
+	}
+	revert_count++;
+	pthr[t].cooldown = PARK_COOLDOWN;
+	switch (act_type) {
+	case PARK_MOVE:
+		topology_move_thread(t, act_from);
+		applog(LOG_INFO, "CPU T%d: move reverted, no gain", t);
+		break;
+	case PARK_PARK:
+		pthr[t].parked = false;
+		applog(LOG_INFO, "CPU T%d: resumed, parking did not help", t);
+		break;
+	case PARK_RESUME:
+		pthr[t].parked = true;
+		applog(LOG_INFO, "CPU T%d: parked again, still contended", t);
+		break;
+	}
+	act_type = PARK_NONE;
+}
+
+static void park_sample()
+{
+	double median, total;
+	int worst = -1, mining = 0;
+
+	if (!park_read_stat())
+		return;
+	total = park_read_rates(&median);
+	if (total <= 0.)
+		return;
+
+	if (act_type != PARK_NONE) {
+		act_after += total;
+		if (++act_age >= PARK_HOLD)
+			park_check_action();
+		return;
+	}
+
+	for (int t = 0; t < park_threads; t++) {
+		struct park_thread *pt = &pthr[t];
+		bool slow;
+		if (pt->cooldown) pt->cooldown--;
+		if (!thread_mining(t)) {
+			pt->slow = 0;
+			continue;
+		}
+		mining++;
+		slow = cpu_busy(topology_thread_cpu(t)) > PARK_BUSY_HIGH || pt->rate < median * PARK_SLOW_RATIO;
+		pt->slow = slow ? pt->slow + 1 : 0;
+		if (pt->slow >= PARK_HOLD && !pt->cooldown && (worst < 0 || pt->rate < pthr[worst].rate))
+			worst = t;
+	}
+
+	if (worst >= 0) {
+		calm = 0;
+		if (topology_thread_cpu(worst) >= 0 && park_free_cpu() >= 0)
+			park_act(PARK_MOVE, worst, total);
+		else if (mining > 1 && worst > 0) // the thread 0 always mines
+			park_act(PARK_PARK, worst, total);
+		return;
+	}
+
+	// the noisy neighbours are gone, resume the last parked thread
+	calm = pall.busy < PARK_BUSY_LOW ? calm + 1 : 0;
+	if (calm >= PARK_HOLD) {
+		for (int t = park_threads - 1; t >= 0; t--) {
+			if (pthr[t].parked && !pthr[t].cooldown) {
+				park_act(PARK_RESUME, t, total);
+				calm = 0;
+				break;
+			}
+		}
+	}
+}
+
+static void *park_ctl_thread(void *userdata)
+{
+	topology_bind_service();
+	park_read_stat();
+	while (!abort_flag) {
+		sleep(PARK_INTERVAL);
+		if (!autotune_running())
+			park_sample();
+	}
+	return NULL;
+}
+
+void park_start(int nthreads)
+{
+	pthread_t pth;
+	park_threads = min(nthreads, MAX_GPUS);
+	if (!opt_thread_parking)
+		return;
+	if (pthread_create(&pth, NULL, park_ctl_thread, NULL)) {
+		applog(LOG_WARNING, "thread parking controller create failed");
+		return;
+	}
+	pthread_detach(pth);
+}
+
+/* thread count changed at runtime, the removed threads are not parked here */
+void park_set_threads(int nthreads)
+{
+	for (int t = nthreads; t < park_threads; t++)
+		pthr[t].parked = false;
+	park_threads = min(nthreads, MAX_GPUS);
+}
+
+bool park_thread_parked(int thr_id)
+{
+	return thr_id < MAX_GPUS && pthr[thr_id].parked;
+}
+
+/* api */
+void park_get(struct park_data *data)
+{
+	memset(data, 0, sizeof(*data));
+	data->enabled = opt_thread_parking;
+	data->busy = pall.busy;
+	data->dispersion = park_dispersion;
+	data->parks = park_count;
+	data->moves = move_count;
+	data->reverts = revert_count;
+	for (int t = 0; t < park_threads; t++)
+		if (pthr[t].parked) data->parked++;
+}
+
+bool park_get_thread(int thr_id, struct park_thread_data *data)
+{
+	memset(data, 0, sizeof(*data));
+	if (thr_id < 0 || thr_id >= park_threads)
+		return false;
+	data->cpu = topology_thread_cpu(thr_id);
+	data->busy = cpu_busy(data->cpu);
+	data->rate = pthr[thr_id].rate;
+	data->slow = pthr[thr_id].slow;
+	data->parked = pthr[thr_id].parked;
+	return true;
+}
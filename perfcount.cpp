@@ -0,0 +1,119 @@
+/**
+ * Hardware performance counters per mining thread (linux perf_event_open)
+ *
+ * Each miner thread opens its own counters (user space only), they
+ * keep running and can be read at any time by the api thread.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "miner.h"
+
+#ifdef __linux
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+struct perf_thread {
+	bool enabled;
+	int fd[PERF_COUNTERS];
+	uint64_t hashes;
+};
+
+static struct perf_thread perf_thr[MAX_GPUS];
+static bool perf_warned = false;
+
+static const char *perf_names[PERF_COUNTERS] = {
+	"cycles", "instructions", "branch-misses", "L1D-misses"
+};
+
+#ifdef __linux
+static int perf_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	// to scale the values if the pmu is multiplexed
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	// calling thread, any cpu
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/* called by each miner thread, counters are attached to the caller */
+bool perf_thread_init(int thr_id)
+{
+	struct perf_thread *pt = &perf_thr[thr_id % MAX_GPUS];
+	for (int c = 0; c < PERF_COUNTERS; c++)
+		pt->fd[c] = -1;
+#ifdef __linux
+	const uint32_t types[PERF_COUNTERS] = {
+		PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+	};
+	const uint64_t configs[PERF_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+	};
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		pt->fd[c] = perf_open(types[c], configs[c]);
+		if (pt->fd[c] >= 0) {
+			pt->enabled = true;
+		} else if (!perf_warned) {
+			int err = errno;
+			applog(LOG_WARNING, "perf counter %s not available (%s)", perf_names[c], strerror(err));
+			if (err == EACCES || err == EPERM)
+				applog(LOG_WARNING, "check /proc/sys/kernel/perf_event_paranoid");
+		}
+	}
+	perf_warned = true;
+	if (pt->enabled && opt_debug)
+		applog(LOG_DEBUG, "CPU T%d: perf counters enabled", thr_id);
+#else
+	if (!perf_warned)
+		applog(LOG_WARNING, "perf counters are only supported on linux");
+	perf_warned = true;
+#endif
+	return pt->enabled;
+}
+
+void perf_thread_add_hashes(int thr_id, uint64_t hashes)
+{
+	struct perf_thread *pt = &perf_thr[thr_id % MAX_GPUS];
+	if (pt->enabled)
+		pt->hashes += hashes;
+}
+
+/**
+ * Read the current thread counters (can be called by any thread)
+ * unavailable values are set to -1
+ */
+bool perf_thread_read(int thr_id, struct perf_data *data)
+{
+	struct perf_thread *pt = &perf_thr[thr_id % MAX_GPUS];
+
+	memset(data, 0, sizeof(*data));
+	if (!pt->enabled)
+		return false;
+
+	data->hashes = pt->hashes;
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		data->values[c] = -1.;
+#ifdef __linux
+		uint64_t rd[3]; // value, time enabled, time running
+		if (pt->fd[c] < 0 || read(pt->fd[c], rd, sizeof(rd)) != sizeof(rd))
+			continue;
+		if (rd[2] && rd[2] < rd[1])
+			data->values[c] = (double) rd[0] * (double) rd[1] / (double) rd[2];
+		else
+			data->values[c] = (double) rd[0];
+#endif
+	}
+	return true;
+}
@@ -0,0 +1,81 @@
+/**
+ * Cycle accounting of the verus pipeline phases (rdtsc)
+ *
+ * Per hash phases are only timed every --phase-sample hashes,
+ * per scan phases and the miner thread waits are always timed
+ * when the feature is enabled.
+ */
+#include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#include "miner.h"
+
+struct phase_thread {
+	uint64_t cycles[PHASES];
+	uint64_t calls[PHASES];
+	uint64_t hashes;
+};
+
+static struct phase_thread phase_thr[MAX_GPUS];
+
+static const char *phase_names[PHASES] = {
+	"hash_half", "gen_key", "clhash", "haraka_keyed", "fix_key", "target",
+	"hash_total", "lock_wait", "queue_wait"
+};
+
+uint64_t phase_tsc()
+{
+	return __rdtsc();
+}
+
+/* the thread slot is only written by its miner thread */
+void phase_add(int thr_id, int phase, uint64_t cycles)
+{
+	struct phase_thread *pt = &phase_thr[thr_id % MAX_GPUS];
+	pt->cycles[phase] += cycles;
+	pt->calls[phase]++;
+}
+
+void phase_add_hashes(int thr_id, uint64_t hashes)
+{
+	phase_thr[thr_id % MAX_GPUS].hashes += hashes;
+}
+
+/**
+ * Sum the phases of one thread, or all if thr_id is -1
+ * cph is the cost in cycles per hash (amortized for per scan phases)
+ */
+int phase_get_stats(int thr_id, struct phase_data *data, int max_records)
+{
+	int records = min(max_records, PHASES);
+	uint64_t hashes = 0;
+
+	memset(data, 0, sizeof(struct phase_data) * records);
+	for (int t = 0; t < opt_n_threads && t < MAX_GPUS; t++) {
+		struct phase_thread *pt = &phase_thr[t];
+		if (thr_id >= 0 && t != thr_id)
+			continue;
+		hashes += pt->hashes;
+		for (int p = 0; p < records; p++) {
+			data[p].cycles += pt->cycles[p];
+			data[p].calls += pt->calls[p];
+		}
+	}
+
+	for (int p = 0; p < records; p++) {
+		data[p].name = phase_names[p];
+		if (!data[p].calls)
+			continue;
+		data[p].avg = (double) data[p].cycles / (double) data[p].calls;
+		if (p <= PHASE_HASH_TOTAL && p >= PHASE_CLHASH)
+			data[p].cph = data[p].avg; // sampled per hash
+		else if (hashes)
+			data[p].cph = (double) data[p].cycles / (double) hashes;
+	}
+	return records;
+}
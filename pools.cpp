@@ -232,9 +232,13 @@ bool pool_switch(int thr_id, int pooln)
 	if (prevn != cur_pooln) {
 
 		pool_switch_count++;
+		PROBE3(pool_switch, prevn, cur_pooln, p->short_url);
+		api_push_event(API_PUSH_POOLS, "POOL=%d;NAME=%s;URL=%s;PREV=%d",
+			cur_pooln, strlen(p->name) ? p->name : p->short_url, p->short_url, prevn);
 		net_diff = 0;
 		g_work_time = 0;
 		g_work.data[0] = 0;
+		numa_work_updated();
 		pool_is_switching = true;
 		stratum_need_reset = true;
 		// used to get the pool uptime
@@ -273,6 +277,7 @@ bool pool_switch(int thr_id, int pooln)
 			// will issue a lp_url request to unlock the longpoll thread
 			have_longpoll = false;
 			get_work(&thr_info[0], &g_work);
+			numa_work_updated();
 			pthread_mutex_unlock(&stratum_work_lock);
 		}
 
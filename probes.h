@@ -0,0 +1,42 @@
+/**
+ * USDT static tracepoints (systemtap sys/sdt.h)
+ *
+ * When sys/sdt.h is found by configure, each probe is a single nop in
+ * the code plus a note in the elf, they can be attached at runtime:
+ *   bpftrace -e 'usdt:./ccminer:ccminer:share_result { printf("%d\n", arg0); }'
+ *   bpftrace -l 'usdt:./ccminer:*'
+ *
+ * Without sdt support (or --disable-usdt), the probes are empty.
+ */
+#ifndef CCMINER_PROBES_H
+#define CCMINER_PROBES_H
+
+#if defined(HAVE_SYS_SDT_H) && !defined(_MSC_VER)
+#include <sys/sdt.h>
+#define PROBE0(name)             DTRACE_PROBE(ccminer, name)
+#define PROBE1(name,a)           DTRACE_PROBE1(ccminer, name, a)
+#define PROBE2(name,a,b)         DTRACE_PROBE2(ccminer, name, a, b)
+#define PROBE3(name,a,b,c)       DTRACE_PROBE3(ccminer, name, a, b, c)
+#define PROBE4(name,a,b,c,d)     DTRACE_PROBE4(ccminer, name, a, b, c, d)
+#else
+#define PROBE0(name)             do {} while (0)
+#define PROBE1(name,a)           do {} while (0)
+#define PROBE2(name,a,b)         do {} while (0)
+#define PROBE3(name,a,b,c)       do {} while (0)
+#define PROBE4(name,a,b,c,d)     do {} while (0)
+#endif
+
+/*
+ * Available probes and args:
+ *  stratum_recv  (line, pooln)
+ *  job_publish   (job_id, height, clean, pooln)
+ *  thread_job    (thr_id, job_id)
+ *  scan_start    (thr_id, first nonce, max_nonce)
+ *  scan_end      (thr_id, hashes_done, valid_nonces)
+ *  share_found   (thr_id, nonce, hash[7])
+ *  share_submit  (job_id, submit id, nonce index)
+ *  share_result  (accepted, pooln, answer ms, reason or NULL)
+ *  pool_switch   (prev pooln, new pooln, url)
+ */
+
+#endif /* CCMINER_PROBES_H */
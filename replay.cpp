@@ -0,0 +1,451 @@
+/**
+ * Stratum session record (--record) and replay (--replay)
+ *
+ * --record writes each stratum line received and sent with its monotonic
+ * time in a json lines file (the first line is a header):
+ *   {"us": 1234, "dir": "recv", "pool": 0, "line": "{\"id\":null,...}"}
+ *
+ * --replay serves a recorded file on a loopback socket, the miner connects
+ * to it like to a pool so all the stratum path is used, without network.
+ * The handshake gets the recorded answers, then the pool methods (notify,
+ * set_target...) are sent at their recorded times, divided by
+ * --replay-speed (0 for max speed). The submits are accepted without any
+ * check. At the end of the file, the jobs rate, the notify->hash latencies
+ * and the cpu time of the stratum thread are logged, then the miner exits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "miner.h"
+
+#ifndef WIN32
+# include <errno.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+# define SOCKETTYPE long
+# define SOCKETFAIL(a) ((a) < 0)
+# define INVSOCK -1
+# define CLOSESOCKET close
+#else
+# define SOCKETTYPE SOCKET
+# define SOCKETFAIL(a) ((a) == SOCKET_ERROR)
+# define INVSOCK INVALID_SOCKET
+# define CLOSESOCKET closesocket
+# define socklen_t int
+#endif
+
+#define REPLAY_DRAIN_MS 1000  /* let the miner hash the last job */
+#define REPLAY_POLL_US  100000
+
+char *opt_record = NULL;
+char *opt_replay = NULL;
+double opt_replay_speed = 1.;
+
+/* record */
+static FILE *rec_file = NULL;
+static uint64_t rec_start = 0;
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* replay */
+struct replay_line {
+	uint64_t us;
+	char *line;
+	bool notify;
+};
+
+enum {
+	HS_SUBSCRIBE = 0,
+	HS_AUTHORIZE,
+	HS_EXTRANONCE,
+	HS_METHODS
+};
+
+static const char *hs_methods[HS_METHODS] = {
+	"mining.subscribe", "mining.authorize", "mining.extranonce.subscribe"
+};
+
+/* used if the answer is not in the file */
+static const char *hs_defaults[HS_METHODS] = {
+	"[null, \"81000000\"]", "true", "true"
+};
+
+static struct replay_line *rp_lines = NULL;
+static int rp_count = 0;
+static int rp_pos = 0;
+static char *hs_results[HS_METHODS];
+static SOCKETTYPE rp_sock = INVSOCK;
+static int rp_port = 0;
+static uint32_t rp_notifies = 0, rp_submits = 0, rp_sessions = 0;
+static uint64_t rp_tm_start = 0, rp_tm_end = 0;
+
+bool record_open(const char *path)
+{
+	json_t *hdr;
+	char *s;
+
+	rec_file = fopen(path, "w");
+	if (!rec_file) {
+		applog(LOG_ERR, "Unable to create the record file %s", path);
+		return false;
+	}
+	rec_start = latency_now();
+	hdr = json_object();
+	json_object_set_new(hdr, "record", json_integer(1));
+	json_object_set_new(hdr, "version", json_string(PACKAGE_VERSION));
+	json_object_set_new(hdr, "time", json_integer((json_int_t) time(NULL)));
+	s = json_dumps(hdr, JSON_COMPACT | JSON_PRESERVE_ORDER);
+	if (s) {
+		fprintf(rec_file, "%s\n", s);
+		free(s);
+	}
+	json_decref(hdr);
+	applog(LOG_INFO, "Recording the stratum session to %s", path);
+	return true;
+}
+
+/* called by stratum_send_line and stratum_recv_line */
+void record_line(int pooln, bool sent, const char *line)
+{
+	json_t *rec;
+	char *s;
+
+	if (!rec_file)
+		return;
+	rec = json_object();
+	json_object_set_new(rec, "us", json_integer((json_int_t) ((latency_now() - rec_start) / 1000)));
+	json_object_set_new(rec, "dir", json_string(sent ? "send" : "recv"));
+	json_object_set_new(rec, "pool", json_integer(pooln));
+	json_object_set_new(rec, "line", json_string(line));
+	s = json_dumps(rec, JSON_COMPACT | JSON_PRESERVE_ORDER);
+	json_decref(rec);
+	if (!s)
+		return;
+	pthread_mutex_lock(&rec_lock);
+	if (rec_file) {
+		fprintf(rec_file, "%s\n", s);
+		fflush(rec_file);
+	}
+	pthread_mutex_unlock(&rec_lock);
+	free(s);
+}
+
+void record_close()
+{
+	pthread_mutex_lock(&rec_lock);
+	if (rec_file)
+		fclose(rec_file);
+	rec_file = NULL;
+	pthread_mutex_unlock(&rec_lock);
+}
+
+static char *read_file(const char *path, long *size)
+{
+	FILE *fd = fopen(path, "rb");
+	char *buf;
+	if (!fd)
+		return NULL;
+	fseek(fd, 0, SEEK_END);
+	*size = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	buf = (char*) malloc(*size + 1);
+	if (buf && fread(buf, 1, *size, fd) != (size_t) *size) {
+		free(buf);
+		buf = NULL;
+	}
+	if (buf)
+		buf[*size] = '\0';
+	fclose(fd);
+	return buf;
+}
+
+/* pool methods to stream and the recorded handshake answers */
+static bool replay_load(const char *path)
+{
+	json_int_t hs_ids[HS_METHODS] = { -1, -1, -1 };
+	char *buf, *line, *next;
+	long size = 0;
+	int alloc = 0;
+
+	buf = read_file(path, &size);
+	if (!buf) {
+		applog(LOG_ERR, "Unable to read the replay file %s", path);
+		return false;
+	}
+	for (line = buf; line && *line; line = next) {
+		json_t *rec, *msg, *id;
+		json_error_t err;
+		const char *dir, *text, *method;
+
+		next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+		rec = JSON_LOADS(line, &err);
+		if (!rec)
+			continue;
+		dir = json_string_value(json_object_get(rec, "dir"));
+		text = json_string_value(json_object_get(rec, "line"));
+		msg = text ? JSON_LOADS(text, &err) : NULL;
+		if (!dir || !msg) {
+			if (msg) json_decref(msg);
+			json_decref(rec);
+			continue;
+		}
+		method = json_string_value(json_object_get(msg, "method"));
+		id = json_object_get(msg, "id");
+		if (!strcmp(dir, "send") && method && json_is_integer(id)) {
+			for (int h = 0; h < HS_METHODS; h++)
+				if (!strcmp(method, hs_methods[h]) && !hs_results[h])
+					hs_ids[h] = json_integer_value(id);
+		} else if (!strcmp(dir, "recv") && method) {
+			if (rp_count >= alloc) {
+				alloc = alloc ? alloc * 2 : 256;
+				rp_lines = (struct replay_line*) realloc(rp_lines, alloc * sizeof(*rp_lines));
+			}
+			rp_lines[rp_count].us = (uint64_t) json_integer_value(json_object_get(rec, "us"));
+			rp_lines[rp_count].line = strdup(text);
+			rp_lines[rp_count].notify = !strcmp(method, "mining.notify");
+			rp_count++;
+		} else if (!strcmp(dir, "recv") && json_is_integer(id)) {
+			for (int h = 0; h < HS_METHODS; h++) {
+				json_t *res = json_object_get(msg, "result");
+				if (hs_ids[h] == json_integer_value(id) && res && !hs_results[h]) {
+					hs_results[h] = json_dumps(res, JSON_COMPACT | JSON_ENCODE_ANY);
+					hs_ids[h] = -1;
+				}
+			}
+		}
+		json_decref(msg);
+		json_decref(rec);
+	}
+	free(buf);
+	if (!rp_count) {
+		applog(LOG_ERR, "No pool method to replay in %s", path);
+		return false;
+	}
+	return true;
+}
+
+static bool replay_send(SOCKETTYPE c, const char *s)
+{
+	size_t len = strlen(s), sent = 0;
+	while (sent < len) {
+		int n = (int) send(c, s + sent, (int) (len - sent), 0);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+/* a client request, returns false if the connection failed */
+static bool replay_request(SOCKETTYPE c, const char *line, bool *authorized)
+{
+	json_t *msg, *id;
+	json_error_t err;
+	const char *method, *result = "true";
+	char *ids, *answer;
+	bool ret;
+
+	msg = JSON_LOADS(line, &err);
+	if (!msg)
+		return true;
+	method = json_string_value(json_object_get(msg, "method"));
+	id = json_object_get(msg, "id");
+	if (!method || !id || json_is_null(id)) {
+		json_decref(msg);
+		return true;
+	}
+	for (int h = 0; h < HS_METHODS; h++)
+		if (!strcmp(method, hs_methods[h]))
+			result = hs_results[h] ? hs_results[h] : hs_defaults[h];
+	if (!strcmp(method, "mining.authorize"))
+		*authorized = true;
+	else if (!strcmp(method, "mining.submit"))
+		rp_submits++;
+
+	ids = json_dumps(id, JSON_COMPACT | JSON_ENCODE_ANY);
+	answer = (char*) malloc(strlen(result) + 64);
+	sprintf(answer, "{\"id\":%s,\"result\":%s,\"error\":null}\n", ids ? ids : "null", result);
+	ret = replay_send(c, answer);
+	free(answer);
+	free(ids);
+	json_decref(msg);
+	return ret;
+}
+
+/* a pool method, the reconnections are sent to the replay socket */
+static bool replay_method(SOCKETTYPE c, struct replay_line *rl)
+{
+	char buf[128];
+	if (rl->notify)
+		rp_notifies++;
+	if (strstr(rl->line, "\"client.reconnect\"")) {
+		snprintf(buf, sizeof(buf), "{\"id\":null,\"method\":\"client.reconnect\",\"params\":[\"127.0.0.1\",%d,0]}\n", rp_port);
+		return replay_send(c, buf);
+	}
+	return replay_send(c, rl->line) && replay_send(c, "\n");
+}
+
+/* one connection of the miner, kept open REPLAY_DRAIN_MS after the last line */
+static void replay_session(SOCKETTYPE c)
+{
+	char *buf = (char*) calloc(1, 4096);
+	size_t blen = 0, bsize = 4096;
+	bool authorized = false, was_auth = false;
+	uint64_t t0_play = 0, t0_rec = 0, drain_end = 0;
+
+	rp_sessions++;
+	while (!abort_flag) {
+		struct timeval tv;
+		fd_set rd;
+		uint64_t now_us = latency_now() / 1000, wait_us = REPLAY_POLL_US, due = 0;
+		bool ready = false;
+
+		if (rp_pos >= rp_count) {
+			// the submits of the last job are still answered
+			if (!drain_end) {
+				rp_tm_end = latency_now();
+				drain_end = now_us + REPLAY_DRAIN_MS * 1000;
+			}
+			if (now_us >= drain_end)
+				break;
+			wait_us = min(drain_end - now_us, (uint64_t) REPLAY_POLL_US);
+		} else if (authorized) {
+			if (opt_replay_speed > 0.)
+				due = t0_play + (uint64_t) ((double) (rp_lines[rp_pos].us - t0_rec) / opt_replay_speed);
+			ready = (now_us >= due);
+			wait_us = ready ? 0 : min(due - now_us, (uint64_t) REPLAY_POLL_US);
+		}
+
+		FD_ZERO(&rd);
+		FD_SET(c, &rd);
+		tv.tv_sec = 0;
+		tv.tv_usec = (long) wait_us;
+		if (select((int) c + 1, &rd, NULL, NULL, &tv) > 0) {
+			char *eol;
+			int n;
+			if (bsize - blen < 2048) {
+				bsize *= 2;
+				buf = (char*) realloc(buf, bsize);
+			}
+			n = (int) recv(c, buf + blen, (int) (bsize - blen - 1), 0);
+			if (n <= 0)
+				break;
+			blen += n;
+			buf[blen] = '\0';
+			while ((eol = strchr(buf, '\n')) != NULL) {
+				*eol = '\0';
+				if (!replay_request(c, buf, &authorized))
+					goto out;
+				blen -= (eol + 1 - buf);
+				memmove(buf, eol + 1, blen + 1);
+			}
+			if (authorized && !was_auth) {
+				// the stream restarts at the current line
+				was_auth = true;
+				t0_play = latency_now() / 1000;
+				t0_rec = rp_lines[rp_pos].us;
+				if (!rp_tm_start)
+					rp_tm_start = latency_now();
+			}
+		}
+		if (ready) {
+			if (!replay_method(c, &rp_lines[rp_pos]))
+				break;
+			rp_pos++;
+		}
+	}
+out:
+	free(buf);
+}
+
+static void replay_summary()
+{
+	double secs = 1e-9 * (double) (rp_tm_end - rp_tm_start);
+	double cpu = 0.;
+#if !defined(WIN32) && defined(_POSIX_THREAD_CPUTIME)
+	clockid_t cid;
+	struct timespec ts;
+	if (stratum_thr_id >= 0 && !pthread_getcpuclockid(thr_info[stratum_thr_id].pth, &cid) &&
+	    !clock_gettime(cid, &ts))
+		cpu = (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+#endif
+	applog(LOG_NOTICE, "Replay: %d lines, %u jobs in %.2fs (%.1f jobs/s), %u shares, %u session%s",
+		rp_count, rp_notifies, secs, secs > 0. ? rp_notifies / secs : 0., rp_submits,
+		rp_sessions, rp_sessions > 1 ? "s" : "");
+	if (cpu > 0.)
+		applog(LOG_NOTICE, "Replay: stratum thread cpu time %.3fs, %.1f us per line",
+			cpu, 1e6 * cpu / rp_count);
+}
+
+static void *replay_thread(void *userdata)
+{
+	topology_bind_service();
+	while (!abort_flag && rp_pos < rp_count) {
+		SOCKETTYPE c = accept(rp_sock, NULL, NULL);
+		if (SOCKETFAIL(c))
+			continue;
+		replay_session(c);
+		// the last one is closed by the exit, not seen as a disconnection
+		if (rp_pos < rp_count || abort_flag)
+			CLOSESOCKET(c);
+	}
+	if (!rp_tm_end)
+		rp_tm_end = latency_now();
+	if (abort_flag)
+		return NULL;
+	replay_summary();
+	proper_exit(EXIT_CODE_OK);
+	return NULL;
+}
+
+/**
+ * Load the file and listen on a loopback port,
+ * returns the pool url to use (allocated) or NULL
+ */
+char *replay_start(const char *path)
+{
+	struct sockaddr_in serv;
+	socklen_t len = sizeof(serv);
+	pthread_t pth;
+	char *url;
+
+	if (!replay_load(path))
+		return NULL;
+
+	rp_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (rp_sock == INVSOCK) {
+		applog(LOG_ERR, "replay socket failed");
+		return NULL;
+	}
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = inet_addr("127.0.0.1");
+	serv.sin_port = 0;
+	if (SOCKETFAIL(bind(rp_sock, (struct sockaddr *) &serv, sizeof(serv))) ||
+	    SOCKETFAIL(listen(rp_sock, 4)) ||
+	    SOCKETFAIL(getsockname(rp_sock, (struct sockaddr *) &serv, &len))) {
+		applog(LOG_ERR, "replay socket bind failed");
+		CLOSESOCKET(rp_sock);
+		return NULL;
+	}
+	rp_port = ntohs(serv.sin_port);
+
+	if (pthread_create(&pth, NULL, replay_thread, NULL)) {
+		applog(LOG_ERR, "replay thread create failed");
+		CLOSESOCKET(rp_sock);
+		return NULL;
+	}
+	pthread_detach(pth);
+
+	url = (char*) malloc(64);
+	sprintf(url, "stratum+tcp://127.0.0.1:%d", rp_port);
+	if (opt_replay_speed > 0.)
+		applog(LOG_INFO, "Replaying %d pool lines of %s, speed x%g", rp_count, path, opt_replay_speed);
+	else
+		applog(LOG_INFO, "Replaying %d pool lines of %s at max speed", rp_count, path);
+	return url;
+}
@@ -147,6 +147,18 @@ void stats_purge_old(void)
 	}
 }
 
+/**
+ * Forget the samples of a paused thread, stats_lock must be held
+ */
+void stats_ignore_thread(int thr_id)
+{
+	std::map<uint64_t, stats_data>::iterator i = tlastscans.begin();
+	for (; i != tlastscans.end(); ++i) {
+		if (i->second.thr_id == thr_id)
+			i->second.ignored = 1;
+	}
+}
+
 /**
  * Reset the cache
  */
@@ -0,0 +1,392 @@
+/**
+ * Stratum path benchmark (--bench-stratum)
+ *
+ * Drives the stratum functions of the miner in-process, on a loopback
+ * socket pair, with a synthetic verus job (bench_work): the line framer
+ * (stratum_recv_line), the json decode, mining.notify with the solution
+ * hex decode (stratum_handle_method), mining.set_target, stratum_gen_work
+ * and the mining.submit formatting and send (equi_stratum_submit).
+ *
+ * Each stage is timed on each message, the mean and median ns, the json
+ * allocations per call (jansson allocator) and the messages per second of
+ * the receive path are logged and written with --bench-json.
+ */
+#include <ccminer-config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "miner.h"
+#include "algos.h"
+
+#ifndef WIN32
+# include <sys/socket.h>
+# include <sys/select.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <arpa/inet.h>
+# define SOCKETTYPE long
+# define SOCKETFAIL(a) ((a) < 0)
+# define INVSOCK -1
+# define CLOSESOCKET close
+#else
+# define SOCKETTYPE SOCKET
+# define SOCKETFAIL(a) ((a) == SOCKET_ERROR)
+# define INVSOCK INVALID_SOCKET
+# define CLOSESOCKET closesocket
+# define socklen_t int
+#endif
+
+#define SB_TARGET_EVERY 8      /* a set_target each N notify */
+#define SB_CLEAN_EVERY  4      /* a clean job each N notify */
+#define SB_XNONCE1      "81000001"
+#define SB_TARGET       "0000f6b947ae147ae147ae147ae147ae147ae147ae147ae147ae147ae147ae14"
+
+extern struct stratum_ctx stratum;
+
+int opt_bench_stratum = 0;     /* messages, 0 = disabled */
+
+enum {
+	SB_RECV = 0,
+	SB_JSON,
+	SB_NOTIFY,
+	SB_TARGET_STAGE,
+	SB_GEN_WORK,
+	SB_SUBMIT,
+	SB_STAGES
+};
+
+static const char *sb_names[SB_STAGES] = {
+	"recv", "json", "notify", "target", "gen_work", "submit"
+};
+
+struct sb_stage {
+	uint32_t *ns;   /* samples */
+	int count;
+	uint64_t sum;
+	uint64_t allocs;
+};
+
+static struct sb_stage stages[SB_STAGES];
+static volatile uint64_t json_allocs = 0;
+
+static void *sb_malloc(size_t size)
+{
+	json_allocs++;
+	return malloc(size);
+}
+
+static void sb_free(void *ptr)
+{
+	free(ptr);
+}
+
+static void sb_record(int stage, uint64_t start, uint64_t allocs)
+{
+	struct sb_stage *s = &stages[stage];
+	uint64_t ns = latency_now() - start;
+	s->ns[s->count++] = (uint32_t) min(ns, (uint64_t) UINT32_MAX);
+	s->sum += ns;
+	s->allocs += json_allocs - allocs;
+}
+
+static bool sb_send(SOCKETTYPE sock, const char *line)
+{
+	size_t len = strlen(line), sent = 0;
+	while (sent < len) {
+		int n = (int) send(sock, line + sent, (int) (len - sent), 0);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+/* the submits of the miner, not timed */
+static void sb_drain(SOCKETTYPE sock)
+{
+	char buf[4096];
+	for (;;) {
+		struct timeval tv = { 0, 0 };
+		fd_set rd;
+		FD_ZERO(&rd);
+		FD_SET(sock, &rd);
+		if (select((int) sock + 1, &rd, NULL, NULL, &tv) < 1)
+			break;
+		if (recv(sock, buf, sizeof(buf), 0) <= 0)
+			break;
+	}
+}
+
+/* a connected loopback pair, the miner side is the stratum socket */
+static bool sb_socketpair(SOCKETTYPE *pool, SOCKETTYPE *miner)
+{
+	struct sockaddr_in serv;
+	socklen_t len = sizeof(serv);
+	SOCKETTYPE srv = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+
+	*pool = *miner = INVSOCK;
+	if (srv == INVSOCK)
+		return false;
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (SOCKETFAIL(bind(srv, (struct sockaddr *) &serv, sizeof(serv))) ||
+	    SOCKETFAIL(listen(srv, 1)) ||
+	    SOCKETFAIL(getsockname(srv, (struct sockaddr *) &serv, &len)))
+		goto err;
+	*miner = socket(AF_INET, SOCK_STREAM, 0);
+	if (*miner == INVSOCK || SOCKETFAIL(connect(*miner, (struct sockaddr *) &serv, sizeof(serv))))
+		goto err;
+	*pool = accept(srv, NULL, NULL);
+	if (*pool == INVSOCK)
+		goto err;
+	// like curl for the miner, and no nagle delay between the pool lines
+	setsockopt(*miner, IPPROTO_TCP, TCP_NODELAY, (const char *) &one, sizeof(one));
+	setsockopt(*pool, IPPROTO_TCP, TCP_NODELAY, (const char *) &one, sizeof(one));
+	CLOSESOCKET(srv);
+	return true;
+err:
+	if (*miner != INVSOCK)
+		CLOSESOCKET(*miner);
+	CLOSESOCKET(srv);
+	return false;
+}
+
+/* the notify line of the synthetic job, like the verus pools */
+static char *sb_notify_line(const struct work *job, uint32_t id, bool clean)
+{
+	char *line = (char *) malloc(4096);
+	char *version = bin2hex((uchar *) &job->data[0], 4);
+	char *prevhash = bin2hex((uchar *) &job->data[1], 32);
+	char *merkle = bin2hex((uchar *) &job->data[9], 32);
+	char *reserved = bin2hex((uchar *) &job->data[17], 32);
+	char *ntime = bin2hex((uchar *) &job->data[25], 4);
+	char *nbits = bin2hex((uchar *) &job->data[26], 4);
+	char *sol = bin2hex((uchar *) job->solution, 1344);
+
+	if (line)
+		snprintf(line, 4096, "{\"id\":null,\"method\":\"mining.notify\",\"params\":"
+			"[\"%x\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",%s,\"%s\"]}\n",
+			id, version, prevhash, merkle, reserved, ntime, nbits, clean ? "true" : "false", sol);
+	free(version); free(prevhash); free(merkle); free(reserved);
+	free(ntime); free(nbits); free(sol);
+	return line;
+}
+
+/* receive and handle one pool line, false on error */
+static bool sb_pool_line(SOCKETTYPE pool, const char *line, int stage)
+{
+	uint64_t start, allocs;
+	json_error_t err;
+	json_t *val;
+	char *s;
+	bool ret;
+
+	if (!sb_send(pool, line))
+		return false;
+
+	allocs = json_allocs;
+	start = latency_now();
+	s = stratum_recv_line(&stratum);
+	sb_record(SB_RECV, start, allocs);
+	if (!s)
+		return false;
+
+	if (stage == SB_NOTIFY) {
+		// the decode alone, a part of the notify stage
+		allocs = json_allocs;
+		start = latency_now();
+		val = JSON_LOADS(s, &err);
+		if (val)
+			json_decref(val);
+		sb_record(SB_JSON, start, allocs);
+	}
+
+	allocs = json_allocs;
+	start = latency_now();
+	ret = stratum_handle_method(&stratum, s);
+	sb_record(stage, start, allocs);
+	free(s);
+	return ret;
+}
+
+static int sb_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double sb_median(struct sb_stage *s)
+{
+	if (!s->count)
+		return 0.;
+	qsort(s->ns, s->count, sizeof(uint32_t), sb_cmp);
+	return s->count & 1 ? s->ns[s->count / 2] :
+		0.5 * ((double) s->ns[s->count / 2 - 1] + s->ns[s->count / 2]);
+}
+
+static void sb_write_json(int messages, double msgs_sec, double allocs_msg,
+	const double *mean, const double *median)
+{
+	json_t *root = json_object(), *obj = json_object();
+	int rc = 0;
+
+	for (int i = 0; i < SB_STAGES; i++) {
+		json_t *st = json_object();
+		json_object_set_new(st, "calls", json_integer(stages[i].count));
+		json_object_set_new(st, "ns_mean", json_real(mean[i]));
+		json_object_set_new(st, "ns_median", json_real(median[i]));
+		json_object_set_new(st, "json_allocs", json_real(stages[i].count ?
+			(double) stages[i].allocs / stages[i].count : 0.));
+		json_object_set_new(obj, sb_names[i], st);
+	}
+	json_object_set_new(root, "bench", json_string("stratum"));
+	json_object_set_new(root, "version", json_string(PACKAGE_VERSION));
+#ifdef __VERSION__
+	json_object_set_new(root, "compiler", json_string(__VERSION__));
+#endif
+	json_object_set_new(root, "messages", json_integer(messages));
+	json_object_set_new(root, "msgs_per_sec", json_real(msgs_sec));
+	json_object_set_new(root, "json_allocs_per_msg", json_real(allocs_msg));
+	json_object_set_new(root, "stages", obj);
+
+	if (!strcmp(opt_bench_json, "-")) {
+		char *s = json_dumps(root, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+		if (s) {
+			printf("%s\n", s);
+			fflush(stdout);
+			free(s);
+		}
+	} else {
+		rc = json_dump_file(root, opt_bench_json, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+	}
+	json_decref(root);
+	if (rc)
+		applog(LOG_ERR, "Unable to write the benchmark result to %s", opt_bench_json);
+}
+
+/**
+ * Run the stratum benchmark, instead of the pool connection and the miners
+ */
+int bench_stratum_run()
+{
+	struct pool_infos *p = &pools[cur_pooln];
+	SOCKETTYPE pool, miner;
+	struct work job, work;
+	double mean[SB_STAGES], median[SB_STAGES], msgs_sec, allocs_msg;
+	uint64_t rx_ns = 0, rx_allocs = 0;
+	int n = opt_bench_stratum, warmup = min(1000, n / 10), messages = 0;
+	int rc = EXIT_CODE_OK;
+	char line[256];
+
+	opt_algo = ALGO_EQUIHASH; // the verus stratum
+	for (int i = 0; i < SB_STAGES; i++) {
+		// the recv stage is timed for the notify and the set_target lines
+		stages[i].ns = (uint32_t *) calloc(2 * (warmup + n) + SB_TARGET_EVERY, sizeof(uint32_t));
+		if (!stages[i].ns)
+			return EXIT_CODE_SW_INIT_ERROR;
+	}
+	if (!sb_socketpair(&pool, &miner)) {
+		applog(LOG_ERR, "Stratum benchmark: loopback socket failed");
+		return EXIT_CODE_SW_INIT_ERROR;
+	}
+	stratum.sock = (curl_socket_t) miner;
+	stratum.sockbuf = (char *) calloc(2048, 1);
+	stratum.sockbuf_size = 2048;
+	stratum.pooln = cur_pooln;
+	json_set_alloc_funcs(sb_malloc, sb_free);
+	bench_work(&job, 0);
+
+	applog(LOG_BLUE, "Stratum benchmark: %d messages, %d warm-up", n, warmup);
+	snprintf(line, sizeof(line), "{\"id\":null,\"method\":\"mining.set_extranonce\",\"params\":[\"%s\",0]}\n",
+		SB_XNONCE1);
+	if (!sb_pool_line(pool, line, SB_TARGET_STAGE))
+		rc = EXIT_CODE_SW_INIT_ERROR;
+	snprintf(line, sizeof(line), "{\"id\":null,\"method\":\"mining.set_target\",\"params\":[\"%s\"]}\n",
+		SB_TARGET);
+
+	for (int i = 0; i < warmup + n && rc == EXIT_CODE_OK && !abort_flag; i++) {
+		char *notify;
+		uint64_t start, allocs;
+
+		if (i == warmup) {
+			// restart the counters
+			for (int s = 0; s < SB_STAGES; s++) {
+				stages[s].count = 0;
+				stages[s].sum = stages[s].allocs = 0;
+			}
+		}
+		if (i % SB_TARGET_EVERY == 0 && !sb_pool_line(pool, line, SB_TARGET_STAGE)) {
+			rc = EXIT_CODE_SW_INIT_ERROR;
+			break;
+		}
+
+		job.data[25]++; // ntime
+		notify = sb_notify_line(&job, (uint32_t) i + 1, i % SB_CLEAN_EVERY == 0);
+		if (!notify || !sb_pool_line(pool, notify, SB_NOTIFY)) {
+			free(notify);
+			rc = EXIT_CODE_SW_INIT_ERROR;
+			break;
+		}
+		free(notify);
+
+		memset(&work, 0, sizeof(work));
+		allocs = json_allocs;
+		start = latency_now();
+		if (!stratum_gen_work(&stratum, &work)) {
+			rc = EXIT_CODE_SW_INIT_ERROR;
+			break;
+		}
+		sb_record(SB_GEN_WORK, start, allocs);
+
+		// a found share of the job
+		work.valid_nonces = 1;
+		work.submit_nonce_id = 0;
+		work.nonces[0] = (uint32_t) i;
+		work.extra[0] = 0xfd; work.extra[1] = 0x40; work.extra[2] = 0x05;
+		memcpy(&work.extra[3], work.solution, 1344);
+		work.tm_found = latency_now();
+		allocs = json_allocs;
+		start = latency_now();
+		if (!equi_stratum_submit(p, &work)) {
+			rc = EXIT_CODE_SW_INIT_ERROR;
+			break;
+		}
+		sb_record(SB_SUBMIT, start, allocs);
+		sb_drain(pool);
+	}
+	json_set_alloc_funcs(malloc, free);
+
+	for (int i = 0; i < SB_STAGES; i++) {
+		struct sb_stage *s = &stages[i];
+		mean[i] = s->count ? (double) s->sum / s->count : 0.;
+		median[i] = sb_median(s);
+		if (i != SB_JSON && i != SB_GEN_WORK && i != SB_SUBMIT) {
+			rx_ns += s->sum;
+			rx_allocs += s->allocs;
+		}
+		if (!opt_quiet)
+			applog(LOG_INFO, "Stratum %-8s %6d calls, %8.0f ns (median %.0f), %.1f json allocs",
+				sb_names[i], s->count, mean[i], median[i], s->count ? (double) s->allocs / s->count : 0.);
+	}
+	messages = stages[SB_NOTIFY].count + stages[SB_TARGET_STAGE].count;
+	msgs_sec = rx_ns ? 1e9 * messages / (double) rx_ns : 0.;
+	allocs_msg = messages ? (double) rx_allocs / messages : 0.;
+	applog(LOG_NOTICE, "Stratum benchmark: %d messages, %.0f msgs/s, %.1f json allocs/msg, job to work %.0f ns",
+		messages, msgs_sec, allocs_msg, mean[SB_RECV] + mean[SB_NOTIFY] + mean[SB_GEN_WORK]);
+	if (rc != EXIT_CODE_OK)
+		applog(LOG_ERR, "Stratum benchmark: a stage failed, the result is partial");
+
+	if (opt_bench_json)
+		sb_write_json(messages, msgs_sec, allocs_msg, mean, median);
+
+	CLOSESOCKET(pool);
+	CLOSESOCKET(miner);
+	for (int i = 0; i < SB_STAGES; i++)
+		free(stages[i].ns);
+	return rc;
+}
@@ -1,6 +1,11 @@
 /**
  * Unit to read cpu informations
  *
+ * Linux: temperatures of all the cpu hwmon devices (coretemp, k10temp,
+ * zenpower), frequency of each cpu, and energy counters of the rapl
+ * powercap zones (intel and amd) or of the amd_energy hwmon. All the
+ * paths are relative to the sysfs root (CCMINER_SYSFS).
+ *
  * TODO: WMI implementation for windows
  *
  * tpruvot 2014
@@ -10,50 +15,227 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "miner.h"
 
 #ifndef WIN32
 
-#define HWMON_PATH \
- "/sys/class/hwmon/hwmon1/device/temp1_input"
-#define HWMON_ALT \
- "/sys/class/hwmon/hwmon0/temp1_input"
+#include <dirent.h>
+
+#define MAX_SENSORS 256
+#define MAX_ZONES   64
+
+struct temp_sensor {
+	int package;
+	int core;   /* core_id, -1 for a package sensor */
+	char path[128];
+};
+
+struct energy_zone {
+	char name[32];
+	char path[128];
+	int package;       /* -1 if not a cpu package (psys) */
+	bool domain;       /* sub zone of the package (core, uncore, dram, amd core) */
+	uint64_t range;    /* wrap value, 0 = 64-bit counter */
+	uint64_t last;
+	double joules;     /* since the first sample */
+	double watts;
+};
 
-static double linux_cputemp(int core)
+static struct temp_sensor sensors[MAX_SENSORS];
+static int sensors_count = 0;
+static struct energy_zone zones[MAX_ZONES];
+static int zones_count = 0;
+static bool sensors_read = false;
+
+static pthread_mutex_t energy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timeval energy_tv = { 0 };
+static double energy_hashes = 0.;
+static double energy_seconds = 0.;
+
+static bool read_u64(const char *path, uint64_t *val)
 {
-	double tc = 0.0;
-	FILE *fd = fopen(HWMON_PATH, "r");
-	uint32_t val = 0;
+	char buf[64];
+	if (!sysfs_read(path, buf, sizeof(buf)) || !isdigit(buf[0]))
+		return false;
+	*val = strtoull(buf, NULL, 10);
+	return true;
+}
 
-	if (!fd)
-		fd = fopen(HWMON_ALT, "r");
+static int cpu_topo_int(int cpu, const char *file)
+{
+	char path[128];
+	snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/%s", cpu, file);
+	return sysfs_read_int(path, 0);
+}
 
-	if (!fd)
-		return tc;
+static void add_sensor(int package, int core, const char *path)
+{
+	if (sensors_count >= MAX_SENSORS)
+		return;
+	sensors[sensors_count].package = package;
+	sensors[sensors_count].core = core;
+	snprintf(sensors[sensors_count].path, sizeof(sensors[0].path), "%s", path);
+	sensors_count++;
+}
+
+static void add_zone(const char *name, const char *path, int package, bool domain, uint64_t range)
+{
+	struct energy_zone *z;
+	if (zones_count >= MAX_ZONES)
+		return;
+	z = &zones[zones_count++];
+	memset(z, 0, sizeof(*z));
+	snprintf(z->name, sizeof(z->name), "%s", name);
+	snprintf(z->path, sizeof(z->path), "%s", path);
+	z->package = package;
+	z->domain = domain;
+	z->range = range;
+	read_u64(path, &z->last);
+}
+
+/* temp*_label / temp*_input (and energy*_) pairs of a hwmon device */
+static void scan_hwmon(const char *dir, const char *name, int *kpackage)
+{
+	char path[192], label[64];
+	bool coretemp = !strcmp(name, "coretemp");
+	bool amd = !strcmp(name, "k10temp") || !strcmp(name, "zenpower");
+	int package = -1, first = sensors_count;
 
-	if (fscanf(fd, "%d", &val))
-		tc = (double)val / 1000.0;
+	for (int i = 1; i < 64; i++) {
+		int core = -1;
+		snprintf(path, sizeof(path), "%s/temp%d_input", dir, i);
+		if (sysfs_read_int(path, -1) < 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/temp%d_label", dir, i);
+		if (!sysfs_read(path, label, sizeof(label)))
+			label[0] = '\0';
+		if (coretemp && !strncmp(label, "Package id ", 11))
+			package = atoi(&label[11]);
+		else if (coretemp && !strncmp(label, "Core ", 5))
+			core = atoi(&label[5]);
+		else if (amd && strcmp(label, "Tctl") && strcmp(label, "Tdie") && label[0])
+			continue; // Tccd*, the control temp is enough
+		snprintf(path, sizeof(path), "%s/temp%d_input", dir, i);
+		add_sensor(-1, core, path);
+	}
+	// one device per package, in order if there is no package label
+	if (package < 0)
+		package = (*kpackage)++;
+	for (int s = first; s < sensors_count; s++)
+		sensors[s].package = package;
 
-	fclose(fd);
-	return tc;
+	if (strcmp(name, "amd_energy"))
+		return;
+	for (int i = 1; i < 1024; i++) {
+		snprintf(path, sizeof(path), "%s/energy%d_label", dir, i);
+		if (!sysfs_read(path, label, sizeof(label)))
+			break;
+		snprintf(path, sizeof(path), "%s/energy%d_input", dir, i);
+		if (!strncmp(label, "Esocket", 7))
+			add_zone(label, path, atoi(&label[7]), false, 0);
+		else
+			add_zone(label, path, package, true, 0);
+	}
+}
+
+/* intel-rapl:N package zones and intel-rapl:N:M domains, in name order */
+static void scan_powercap()
+{
+	char dir[256], path[192], name[32];
+	struct dirent **list;
+	int count;
+	snprintf(dir, sizeof(dir), "%s/class/powercap", sysfs_root());
+	count = scandir(dir, &list, NULL, alphasort);
+	for (int i = 0; i < count; i++) {
+		const char *zone = list[i]->d_name;
+		int pkg = -1, sub = -1;
+		uint64_t range = 0;
+		if (sscanf(zone, "intel-rapl:%d:%d", &pkg, &sub) >= 1) {
+			snprintf(path, sizeof(path), "class/powercap/%s/name", zone);
+			if (sysfs_read(path, name, sizeof(name))) {
+				snprintf(path, sizeof(path), "class/powercap/%s/max_energy_range_uj", zone);
+				read_u64(path, &range);
+				snprintf(path, sizeof(path), "class/powercap/%s/energy_uj", zone);
+				if (sub >= 0)
+					add_zone(name, path, pkg, true, range);
+				else if (!strncmp(name, "package-", 8))
+					add_zone(name, path, atoi(&name[8]), false, range);
+				else
+					add_zone(name, path, -1, false, range); // psys
+			}
+		}
+		free(list[i]);
+	}
+	if (count >= 0)
+		free(list);
 }
 
-#define CPUFREQ_PATH \
- "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_cur_freq"
-static uint32_t linux_cpufreq(int core)
+static void read_sensors()
 {
-	FILE *fd = fopen(CPUFREQ_PATH, "r");
-	uint32_t freq = 0;
+	char dir[256], path[192], name[32];
+	int kpackage = 0;
+	if (sensors_read)
+		return;
+	sensors_read = true;
+	for (int h = 0; h < 64; h++) {
+		snprintf(dir, sizeof(dir), "class/hwmon/hwmon%d", h);
+		snprintf(path, sizeof(path), "%s/name", dir);
+		if (!sysfs_read(path, name, sizeof(name)))
+			continue;
+		if (!strcmp(name, "coretemp") || !strcmp(name, "k10temp") || !strcmp(name, "zenpower") ||
+		    !strcmp(name, "cpu_thermal") || !strcmp(name, "amd_energy"))
+			scan_hwmon(dir, name, &kpackage);
+	}
+	scan_powercap();
+	gettimeofday(&energy_tv, NULL);
+	if (opt_debug)
+		applog(LOG_DEBUG, "sysinfos: %d cpu temp sensors, %d energy zones", sensors_count, zones_count);
+}
 
-	if (!fd)
-		return freq;
+static double sensor_value(struct temp_sensor *s)
+{
+	return (double) sysfs_read_int(s->path, 0) / 1000.0;
+}
 
-	if (!fscanf(fd, "%d", &freq))
-		;
+/* core sensor of the cpu, else its package, -1 for the hottest package */
+static double linux_cputemp(int cpu)
+{
+	double tc = 0.0;
+	int pkg, core;
+	read_sensors();
+	if (cpu < 0) {
+		for (int s = 0; s < sensors_count; s++)
+			if (sensors[s].core < 0) tc = max(tc, sensor_value(&sensors[s]));
+		if (tc == 0.0 && sensors_count)
+			tc = sensor_value(&sensors[0]);
+		return tc;
+	}
+	pkg = cpu_topo_int(cpu, "physical_package_id");
+	core = cpu_topo_int(cpu, "core_id");
+	for (int s = 0; s < sensors_count; s++)
+		if (sensors[s].package == pkg && sensors[s].core == core)
+			return sensor_value(&sensors[s]);
+	for (int s = 0; s < sensors_count; s++)
+		if (sensors[s].package == pkg && sensors[s].core < 0)
+			return sensor_value(&sensors[s]);
+	return linux_cputemp(-1);
+}
 
-	fclose(fd);
-	return freq;
+/* kHz */
+static uint32_t linux_cpufreq(int cpu)
+{
+	char path[128];
+	int freq;
+	snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", max(cpu, 0));
+	freq = sysfs_read_int(path, 0);
+	if (freq <= 0) {
+		snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/cpufreq/cpuinfo_cur_freq", max(cpu, 0));
+		freq = sysfs_read_int(path, 0);
+	}
+	return (uint32_t) max(freq, 0);
 }
 
 #else /* WIN32 */
@@ -70,6 +252,7 @@ static float win32_cputemp(int core)
 /* exports */
 
 
+/* core is a cpu index, -1 for the hottest package */
 float cpu_temp(int core)
 {
 #ifdef WIN32
@@ -93,3 +276,110 @@ int cpu_fanpercent()
 	return 0;
 }
 
+/**
+ * Read the energy counters, called by the api, the governor and the
+ * energy thread (often enough to not miss a counter wrap)
+ */
+void energy_update()
+{
+#ifndef WIN32
+	struct timeval now, diff;
+	double dt;
+	read_sensors();
+	if (!zones_count)
+		return;
+	pthread_mutex_lock(&energy_lock);
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, &energy_tv);
+	dt = (double) diff.tv_sec + 1e-6 * diff.tv_usec;
+	if (dt < 0.5) {
+		pthread_mutex_unlock(&energy_lock);
+		return;
+	}
+	for (int i = 0; i < zones_count; i++) {
+		struct energy_zone *z = &zones[i];
+		uint64_t val, delta;
+		if (!read_u64(z->path, &val))
+			continue;
+		delta = val >= z->last ? val - z->last : (z->range ? z->range - z->last + val : 0);
+		z->last = val;
+		z->joules += 1e-6 * (double) delta;
+		z->watts = 1e-6 * (double) delta / dt;
+	}
+	energy_hashes += (double) global_hashrate * dt;
+	energy_seconds += dt;
+	energy_tv = now;
+	pthread_mutex_unlock(&energy_lock);
+#endif
+}
+
+/* package totals, false without energy counters */
+bool energy_get(struct energy_data *data)
+{
+	memset(data, 0, sizeof(*data));
+#ifndef WIN32
+	read_sensors();
+	pthread_mutex_lock(&energy_lock);
+	for (int i = 0; i < zones_count; i++) {
+		if (zones[i].domain || zones[i].package < 0)
+			continue;
+		data->packages++;
+		data->watts += zones[i].watts;
+		data->joules += zones[i].joules;
+	}
+	data->hashes = energy_hashes;
+	data->seconds = energy_seconds;
+	pthread_mutex_unlock(&energy_lock);
+	if (data->joules > 0.)
+		data->hpj = data->hashes / data->joules;
+	if (data->watts > 0.)
+		data->hpw = (double) global_hashrate / data->watts;
+#endif
+	return data->packages > 0;
+}
+
+/* each zone, false after the last one */
+bool energy_get_zone(int index, struct energy_zone_data *data)
+{
+	memset(data, 0, sizeof(*data));
+#ifndef WIN32
+	read_sensors();
+	if (index < 0 || index >= zones_count)
+		return false;
+	pthread_mutex_lock(&energy_lock);
+	data->name = zones[index].name;
+	data->package = zones[index].package;
+	data->domain = zones[index].domain;
+	data->watts = zones[index].watts;
+	data->joules = zones[index].joules;
+	pthread_mutex_unlock(&energy_lock);
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifndef WIN32
+static void *energy_thread(void *userdata)
+{
+	topology_bind_service();
+	while (!abort_flag) {
+		energy_update();
+		sleep(5);
+	}
+	return NULL;
+}
+#endif
+
+void energy_start()
+{
+#ifndef WIN32
+	pthread_t pth;
+	read_sensors();
+	if (!zones_count)
+		return;
+	if (pthread_create(&pth, NULL, energy_thread, NULL))
+		return;
+	pthread_detach(pth);
+#endif
+}
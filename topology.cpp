@@ -0,0 +1,629 @@
+/**
+ * CPU topology (linux sysfs) and mining threads placement
+ *
+ * The sysfs root can be changed with the CCMINER_SYSFS environment
+ * variable, to check the placement of another machine:
+ *   CCMINER_SYSFS=/tmp/epyc-sys ccminer --cpu-placement=scatter ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "miner.h"
+
+#ifdef __linux
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define TOPO_CPUID
+#endif
+#elif defined(__FreeBSD__)
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#endif
+
+#define TOPO_MAX_CPUS 1024
+
+extern int num_cpus;
+extern int64_t opt_affinity;
+
+struct topo_cpu {
+	bool online;
+	bool allowed;
+	bool reserved;
+	int core;    /* first thread sibling, unique per core */
+	int smt;     /* index in the core siblings */
+	int package;
+	int node;
+	int l2;      /* first cpu sharing the cache */
+	int l3;
+	int rank;    /* core index in its L3 (scatter) */
+	int type;    /* CORE_TYPE_*, hybrid cpus */
+};
+
+static struct topo_cpu tcpu[TOPO_MAX_CPUS];
+static int topo_max = 0; /* highest cpu id + 1 */
+static bool topo_sysfs = false;
+static bool topo_hybrid = false;
+static bool topo_read = false;
+static volatile uint32_t topo_generation = 0;
+
+static int thr_cpu[MAX_GPUS];
+static int placement_count = 0;
+static int service_cpus[TOPO_MAX_CPUS];
+static int service_count = 0;
+
+char *opt_cpu_exclude = NULL;
+bool opt_cpu_reserve = false;
+int opt_core_type = CORE_TYPE_ANY;
+
+static const char *core_type_names[] = { "any", "P", "E" };
+
+static const char *placement_names[] = {
+	"cores", "compact", "scatter", "linear", "none"
+};
+enum topo_placement {
+	PLACE_CORES = 0,
+	PLACE_COMPACT,
+	PLACE_SCATTER,
+	PLACE_LINEAR,
+	PLACE_NONE
+};
+static int placement = PLACE_CORES;
+
+const char* sysfs_root()
+{
+	const char *root = getenv("CCMINER_SYSFS");
+	return (root && strlen(root)) ? root : "/sys";
+}
+
+bool sysfs_read(const char *path, char *buf, size_t len)
+{
+	char file[512];
+	FILE *fd;
+	snprintf(file, sizeof(file), "%s/%s", sysfs_root(), path);
+	fd = fopen(file, "r");
+	if (!fd)
+		return false;
+	if (!fgets(buf, (int) len, fd)) {
+		fclose(fd);
+		return false;
+	}
+	fclose(fd);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return true;
+}
+
+int sysfs_read_int(const char *path, int defval)
+{
+	char buf[64];
+	if (!sysfs_read(path, buf, sizeof(buf)) || (!isdigit(buf[0]) && buf[0] != '-'))
+		return defval;
+	return atoi(buf);
+}
+
+/**
+ * Parse a cpu list like "0-3,8,10-11", set[] must have max entries
+ * returns the count of cpus set
+ */
+int cpulist_parse(const char *list, bool *set, int max)
+{
+	const char *p = list;
+	int count = 0;
+	while (p && *p) {
+		char *end;
+		long a = strtol(p, &end, 10), b;
+		if (end == p)
+			break;
+		b = a;
+		if (*end == '-')
+			b = strtol(end + 1, &end, 10);
+		for (long c = a; c <= b && c < max; c++) {
+			if (c >= 0 && !set[c]) {
+				set[c] = true;
+				count++;
+			}
+		}
+		p = (*end == ',') ? end + 1 : NULL;
+	}
+	return count;
+}
+
+static int cpulist_first(const char *list)
+{
+	return isdigit(list[0]) ? atoi(list) : -1;
+}
+
+static void topo_read_cpu(int c)
+{
+	struct topo_cpu *t = &tcpu[c];
+	char path[128], buf[512];
+	bool sib[TOPO_MAX_CPUS];
+
+	t->core = c;
+	t->smt = 0;
+	t->package = 0;
+	t->node = 0;
+	t->l2 = t->l3 = -1;
+
+	snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/physical_package_id", c);
+	t->package = max(0, sysfs_read_int(path, 0));
+
+	snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/thread_siblings_list", c);
+	if (sysfs_read(path, buf, sizeof(buf))) {
+		memset(sib, 0, sizeof(sib));
+		cpulist_parse(buf, sib, TOPO_MAX_CPUS);
+		t->core = cpulist_first(buf);
+		for (int s = 0; s < c; s++)
+			if (sib[s]) t->smt++;
+	}
+
+	for (int i = 0; i < 10; i++) {
+		int level;
+		snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/cache/index%d/level", c, i);
+		level = sysfs_read_int(path, -1);
+		if (level < 0)
+			break;
+		snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/cache/index%d/type", c, i);
+		if (sysfs_read(path, buf, sizeof(buf)) && !strcmp(buf, "Instruction"))
+			continue;
+		snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", c, i);
+		if (!sysfs_read(path, buf, sizeof(buf)))
+			continue;
+		if (level == 2) t->l2 = cpulist_first(buf);
+		if (level == 3) t->l3 = cpulist_first(buf);
+	}
+	if (t->l2 < 0) t->l2 = t->core;
+	// no shared L3 info, one domain per package
+	if (t->l3 < 0) t->l3 = TOPO_MAX_CPUS + t->package;
+}
+
+static void topo_read_nodes()
+{
+	char path[128], buf[1024];
+	bool nodes[256] = { 0 };
+	if (!sysfs_read("devices/system/node/online", buf, sizeof(buf)))
+		return;
+	cpulist_parse(buf, nodes, 256);
+	for (int n = 0; n < 256; n++) {
+		bool set[TOPO_MAX_CPUS] = { 0 };
+		if (!nodes[n])
+			continue;
+		snprintf(path, sizeof(path), "devices/system/node/node%d/cpulist", n);
+		if (!sysfs_read(path, buf, sizeof(buf)))
+			continue;
+		cpulist_parse(buf, set, TOPO_MAX_CPUS);
+		for (int c = 0; c < topo_max; c++)
+			if (set[c]) tcpu[c].node = n;
+	}
+}
+
+static bool bind_cpus(const int *cpus, int count);
+
+#ifdef TOPO_CPUID
+/* cpuid leaf 0x1a of each cpu, the thread has to run on it */
+static void topo_cpuid_types()
+{
+	unsigned int eax, ebx, ecx, edx;
+	cpu_set_t saved;
+	// hybrid flag
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(edx & (1U << 15)))
+		return;
+	if (sched_getaffinity(0, sizeof(saved), &saved))
+		return;
+	for (int c = 0; c < topo_max; c++) {
+		if (!tcpu[c].online || !bind_cpus(&c, 1))
+			continue;
+		if (!__get_cpuid_count(0x1a, 0, &eax, &ebx, &ecx, &edx))
+			continue;
+		if ((eax >> 24) == 0x40) tcpu[c].type = CORE_TYPE_P;
+		if ((eax >> 24) == 0x20) tcpu[c].type = CORE_TYPE_E;
+		topo_hybrid |= (tcpu[c].type != CORE_TYPE_ANY);
+	}
+	sched_setaffinity(0, sizeof(saved), &saved);
+}
+#endif
+
+/* core types of hybrid cpus, from the cpu_core/cpu_atom pmus or cpuid */
+static void topo_read_types()
+{
+	const char *pmus[] = { "devices/cpu_core/cpus", "devices/cpu_atom/cpus" };
+	char buf[4096];
+	topo_hybrid = false;
+	for (int k = 0; k < 2; k++) {
+		bool set[TOPO_MAX_CPUS] = { 0 };
+		if (!sysfs_read(pmus[k], buf, sizeof(buf)))
+			continue;
+		cpulist_parse(buf, set, TOPO_MAX_CPUS);
+		for (int c = 0; c < topo_max; c++)
+			if (set[c]) tcpu[c].type = k ? CORE_TYPE_E : CORE_TYPE_P;
+		topo_hybrid = true;
+	}
+#ifdef TOPO_CPUID
+	if (!topo_hybrid && !getenv("CCMINER_SYSFS"))
+		topo_cpuid_types();
+#endif
+}
+
+/* restrict to the process affinity (taskset, cpuset), the cgroup and --cpu-affinity */
+static void topo_apply_masks()
+{
+	bool excl[TOPO_MAX_CPUS] = { 0 };
+	bool cgset[TOPO_MAX_CPUS];
+	bool use_cg = cgroup_cpuset(cgset, TOPO_MAX_CPUS);
+#ifdef __linux
+	cpu_set_t set;
+	bool use_set = !getenv("CCMINER_SYSFS") && !sched_getaffinity(0, sizeof(set), &set);
+#endif
+	if (opt_cpu_exclude)
+		cpulist_parse(opt_cpu_exclude, excl, TOPO_MAX_CPUS);
+	for (int c = 0; c < topo_max; c++) {
+		struct topo_cpu *t = &tcpu[c];
+		t->allowed = t->online && !excl[c];
+		if (use_cg && !cgset[c])
+			t->allowed = false;
+#ifdef __linux
+		if (use_set && c < CPU_SETSIZE && !CPU_ISSET(c, &set))
+			t->allowed = false;
+#endif
+		if (opt_affinity != -1L && (c >= 64 || !((opt_affinity >> c) & 1)))
+			t->allowed = false;
+		if (opt_core_type && topo_hybrid && t->type != opt_core_type)
+			t->allowed = false;
+	}
+}
+
+/* reserve the last allowed core for the network, api and log threads */
+static void topo_reserve_core()
+{
+	int core = -1, left = 0;
+	for (int c = topo_max - 1; c >= 0; c--) {
+		if (tcpu[c].allowed && core < 0)
+			core = tcpu[c].core;
+	}
+	if (core < 0)
+		return;
+	for (int c = 0; c < topo_max; c++) {
+		if (tcpu[c].allowed && tcpu[c].core != core)
+			left++;
+	}
+	if (!left) {
+		applog(LOG_WARNING, "No cpu left for the miners, core %d not reserved", core);
+		return;
+	}
+	for (int c = 0; c < topo_max; c++) {
+		if (tcpu[c].allowed && tcpu[c].core == core) {
+			tcpu[c].allowed = false;
+			tcpu[c].reserved = true;
+			service_cpus[service_count++] = c;
+		}
+	}
+}
+
+static int topo_compare(const void *pa, const void *pb)
+{
+	const struct topo_cpu *a = &tcpu[*(const int*) pa];
+	const struct topo_cpu *b = &tcpu[*(const int*) pb];
+	int keys_a[6], keys_b[6];
+	// hybrid: P cores before the E cores, E cores before the P smt siblings
+	int ta = a->type == CORE_TYPE_E, tb = b->type == CORE_TYPE_E;
+	switch (placement) {
+	case PLACE_COMPACT: // fill all the siblings of a core, then the next one
+		keys_a[0] = ta; keys_a[1] = a->node; keys_a[2] = a->l3; keys_a[3] = a->core; keys_a[4] = a->smt;
+		keys_b[0] = tb; keys_b[1] = b->node; keys_b[2] = b->l3; keys_b[3] = b->core; keys_b[4] = b->smt;
+		break;
+	case PLACE_SCATTER: // one core per L3 domain in turn
+		keys_a[0] = a->smt; keys_a[1] = ta; keys_a[2] = a->rank; keys_a[3] = a->l3; keys_a[4] = a->core;
+		keys_b[0] = b->smt; keys_b[1] = tb; keys_b[2] = b->rank; keys_b[3] = b->l3; keys_b[4] = b->core;
+		break;
+	case PLACE_CORES: // physical cores first, then the smt siblings
+	default:
+		keys_a[0] = a->smt; keys_a[1] = ta; keys_a[2] = a->node; keys_a[3] = a->l3; keys_a[4] = a->core;
+		keys_b[0] = b->smt; keys_b[1] = tb; keys_b[2] = b->node; keys_b[3] = b->l3; keys_b[4] = b->core;
+		break;
+	}
+	keys_a[5] = *(const int*) pa;
+	keys_b[5] = *(const int*) pb;
+	for (int k = 0; k < 6; k++) {
+		if (keys_a[k] != keys_b[k])
+			return keys_a[k] < keys_b[k] ? -1 : 1;
+	}
+	return 0;
+}
+
+static void topo_rank_cores()
+{
+	for (int c = 0; c < topo_max; c++) {
+		int rank = 0;
+		if (!tcpu[c].allowed)
+			continue;
+		for (int o = 0; o < topo_max; o++) {
+			if (tcpu[o].allowed && tcpu[o].smt == 0 && tcpu[o].l3 == tcpu[c].l3 && tcpu[o].core < tcpu[c].core)
+				rank++;
+		}
+		tcpu[c].rank = rank;
+	}
+}
+
+const char* topology_placement_name()
+{
+	return placement_names[placement];
+}
+
+bool topology_set_placement(const char *name)
+{
+	for (int p = 0; p < (int) ARRAY_SIZE(placement_names); p++) {
+		if (!strcasecmp(name, placement_names[p])) {
+			placement = p;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Read the topology, only done once
+ */
+void topology_read()
+{
+	char buf[4096];
+
+	if (topo_read)
+		return;
+	memset(tcpu, 0, sizeof(tcpu));
+	service_count = 0;
+
+	if (sysfs_read("devices/system/cpu/online", buf, sizeof(buf))) {
+		bool online[TOPO_MAX_CPUS] = { 0 };
+		cpulist_parse(buf, online, TOPO_MAX_CPUS);
+		for (int c = 0; c < TOPO_MAX_CPUS; c++) {
+			if (!online[c]) continue;
+			tcpu[c].online = true;
+			topo_max = c + 1;
+		}
+		topo_sysfs = true;
+	} else {
+		topo_max = min(num_cpus, TOPO_MAX_CPUS);
+		for (int c = 0; c < topo_max; c++)
+			tcpu[c].online = true;
+	}
+	for (int c = 0; c < topo_max; c++) {
+		if (!tcpu[c].online) continue;
+		if (topo_sysfs)
+			topo_read_cpu(c);
+		else {
+			tcpu[c].core = tcpu[c].l2 = c;
+			tcpu[c].l3 = TOPO_MAX_CPUS;
+		}
+	}
+	if (topo_sysfs)
+		topo_read_nodes();
+	topo_read_types();
+
+	topo_apply_masks();
+	if (opt_cpu_reserve)
+		topo_reserve_core();
+	topo_rank_cores();
+	topo_read = true;
+}
+
+/**
+ * Compute the cpu of each mining thread with the current placement
+ * returns the count of usable cpus
+ */
+int topology_compute(int nthreads)
+{
+	int order[TOPO_MAX_CPUS];
+	int count = 0;
+
+	topology_read();
+	placement_count = 0;
+	for (int c = 0; c < topo_max; c++)
+		if (tcpu[c].allowed) order[count++] = c;
+	if (placement != PLACE_LINEAR && placement != PLACE_NONE)
+		qsort(order, count, sizeof(int), topo_compare);
+
+	if (!count || placement == PLACE_NONE) {
+		for (int t = 0; t < MAX_GPUS; t++)
+			thr_cpu[t] = -1;
+	} else {
+		for (int t = 0; t < MAX_GPUS; t++)
+			thr_cpu[t] = order[t % count];
+		placement_count = min(nthreads, MAX_GPUS);
+	}
+	topo_generation++;
+	return count;
+}
+
+/* read the allowed cpus again (cgroup change) and place the threads */
+int topology_reload(int nthreads)
+{
+	topo_read = false;
+	return topology_compute(nthreads);
+}
+
+/**
+ * Read the topology, place the mining threads and log them
+ */
+void topology_init(int nthreads)
+{
+	char buf[4096];
+
+	if (!topology_compute(nthreads))
+		applog(LOG_WARNING, "No cpu allowed, threads are not pinned");
+
+	if (!opt_quiet) {
+		struct topology_data d;
+		topology_get(&d);
+		applog(LOG_INFO, "CPU topology: %d package(s), %d node(s), %d L3, %d cores, %d threads",
+			d.packages, d.nodes, d.l3, d.cores, d.threads);
+		if (topo_hybrid && opt_core_type)
+			applog(LOG_INFO, "Hybrid cpu: %d P-core and %d E-core threads, mining on the %s cores only",
+				d.p_threads, d.e_threads, core_type_names[opt_core_type]);
+		else if (topo_hybrid)
+			applog(LOG_INFO, "Hybrid cpu: %d P-core and %d E-core threads", d.p_threads, d.e_threads);
+		if (placement_count) {
+			int len = snprintf(buf, 120, "Threads placement (%s):", placement_names[placement]);
+			for (int t = 0; t < placement_count && len < (int) sizeof(buf) - 32; t++)
+				len += snprintf(&buf[len], sizeof(buf) - len, " %d", thr_cpu[t]);
+			applog(LOG_INFO, "%s", buf);
+		}
+		if (service_count)
+			applog(LOG_INFO, "Core of cpu %d reserved for the network threads", service_cpus[0]);
+	}
+	if (opt_debug) {
+		for (int t = 0; t < placement_count; t++) {
+			struct topo_cpu *tc = &tcpu[thr_cpu[t]];
+			applog(LOG_DEBUG, "CPU T%d: cpu %d, core %d smt %d, L2 %d, L3 %d, package %d, node %d",
+				t, thr_cpu[t], tc->core, tc->smt, tc->l2, tc->l3, tc->package, tc->node);
+		}
+	}
+}
+
+/* changed on each topology_compute(), to rebind the running threads */
+uint32_t topology_generation()
+{
+	return topo_generation;
+}
+
+static int count_distinct(int field)
+{
+	int count = 0;
+	for (int c = 0; c < topo_max; c++) {
+		int v, o;
+		if (!tcpu[c].online) continue;
+		v = field == 0 ? tcpu[c].package : field == 1 ? tcpu[c].node : field == 2 ? tcpu[c].l3 : tcpu[c].core;
+		for (o = 0; o < c; o++) {
+			if (!tcpu[o].online) continue;
+			if (v == (field == 0 ? tcpu[o].package : field == 1 ? tcpu[o].node : field == 2 ? tcpu[o].l3 : tcpu[o].core))
+				break;
+		}
+		if (o == c) count++;
+	}
+	return count;
+}
+
+void topology_get(struct topology_data *data)
+{
+	memset(data, 0, sizeof(*data));
+	data->packages = count_distinct(0);
+	data->nodes = count_distinct(1);
+	data->l3 = count_distinct(2);
+	data->cores = count_distinct(3);
+	for (int c = 0; c < topo_max; c++) {
+		if (tcpu[c].online) data->threads++;
+		if (tcpu[c].allowed) data->allowed++;
+		if (tcpu[c].allowed && !tcpu[c].smt) data->allowed_cores++;
+	}
+	data->placement = placement_names[placement];
+	data->reserved = service_count ? service_cpus[0] : -1;
+	for (int c = 0; c < topo_max; c++) {
+		if (!tcpu[c].online) continue;
+		if (tcpu[c].type == CORE_TYPE_P) data->p_threads++;
+		if (tcpu[c].type == CORE_TYPE_E) data->e_threads++;
+	}
+}
+
+/* CORE_TYPE_ANY if not hybrid or not pinned */
+int topology_cpu_type(int cpu)
+{
+	if (cpu < 0 || cpu >= topo_max)
+		return CORE_TYPE_ANY;
+	return tcpu[cpu].type;
+}
+
+const char* topology_core_type_name(int type)
+{
+	return core_type_names[type % 3];
+}
+
+/* --core-type=P|E|any */
+bool topology_set_core_type(const char *name)
+{
+	for (int t = 0; t < (int) ARRAY_SIZE(core_type_names); t++) {
+		if (!strcasecmp(name, core_type_names[t])) {
+			opt_core_type = t;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* -1 if not pinned */
+int topology_thread_cpu(int thr_id)
+{
+	if (!placement_count)
+		return -1;
+	return thr_cpu[thr_id % MAX_GPUS];
+}
+
+/* highest cpu id + 1 */
+int topology_cpu_count()
+{
+	return topo_max;
+}
+
+bool topology_cpu_allowed(int cpu)
+{
+	return cpu >= 0 && cpu < topo_max && tcpu[cpu].allowed;
+}
+
+/* pin one thread elsewhere, it rebinds on its next scan */
+void topology_move_thread(int thr_id, int cpu)
+{
+	if (thr_id < 0 || thr_id >= placement_count || !topology_cpu_allowed(cpu))
+		return;
+	thr_cpu[thr_id] = cpu;
+	topo_generation++;
+}
+
+int topology_cpu_node(int cpu)
+{
+	if (cpu < 0 || cpu >= topo_max)
+		return 0;
+	return tcpu[cpu].node;
+}
+
+static bool bind_cpus(const int *cpus, int count)
+{
+#ifdef __linux
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < count; i++)
+		if (cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+	// thread only
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(__FreeBSD__)
+	cpuset_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < count; i++)
+		CPU_SET(cpus[i], &set);
+	return cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1, sizeof(cpuset_t), &set) == 0;
+#elif defined(WIN32)
+	DWORD_PTR mask = 0;
+	for (int i = 0; i < count; i++)
+		if (cpus[i] < 64) mask |= (DWORD_PTR) 1 << cpus[i];
+	return mask && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	return false;
+#endif
+}
+
+/* called by each mining thread */
+void topology_bind_miner(int thr_id)
+{
+	int cpu = topology_thread_cpu(thr_id);
+	if (cpu < 0 || getenv("CCMINER_SYSFS"))
+		return;
+	if (!bind_cpus(&cpu, 1))
+		applog(LOG_WARNING, "CPU T%d: unable to bind to cpu %d", thr_id, cpu);
+}
+
+/* network, api and log threads, only if a core is reserved */
+void topology_bind_service()
+{
+	if (!service_count || getenv("CCMINER_SYSFS"))
+		return;
+	bind_cpus(service_cpus, service_count);
+}
@@ -75,40 +75,24 @@ struct thread_q {
 	pthread_cond_t		cond;
 };
 
-void applog(int prio, const char *fmt, ...)
+/* write a log line, called by applog or the async log thread */
+void applog_output(int prio, time_t now, const char *msg)
 {
-	va_list ap;
-
-	va_start(ap, fmt);
-
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
-		va_list ap2;
-		char *buf;
-		int len;
-
 		/* custom colors to syslog prio */
 		if (prio > LOG_DEBUG) {
 			switch (prio) {
 				case LOG_BLUE: prio = LOG_NOTICE; break;
 			}
 		}
-
-		va_copy(ap2, ap);
-		len = vsnprintf(NULL, 0, fmt, ap2) + 1;
-		va_end(ap2);
-		buf = (char*) alloca(len);
-		if (vsnprintf(buf, len, fmt, ap) >= 0)
-			syslog(prio, "%s", buf);
+		syslog(prio, "%s", msg);
 	}
 #else
 	if (0) {}
 #endif
 	else {
 		const char* color = "";
-		const time_t now = time(NULL);
-		char *f;
-		int len;
 		struct tm tm;
 
 		localtime_r(&now, &tm);
@@ -128,29 +112,55 @@ void applog(int prio, const char *fmt, ...)
 		if (!use_colors)
 			color = "";
 
-		len = 40 + (int) strlen(fmt) + 2;
-		f = (char*) alloca(len);
-		sprintf(f, "[%d-%02d-%02d %02d:%02d:%02d]%s %s%s\n",
-			tm.tm_year + 1900,
-			tm.tm_mon + 1,
-			tm.tm_mday,
-			tm.tm_hour,
-			tm.tm_min,
-			tm.tm_sec,
-			color,
-			fmt,
-			use_colors ? CL_N : ""
-		);
+		pthread_mutex_lock(&applog_lock);
 		if (prio == LOG_RAW) {
 			// no time prefix, for ccminer -n
-			sprintf(f, "%s%s\n", fmt, CL_N);
+			fprintf(stdout, "%s%s\n", msg, CL_N);
+		} else {
+			fprintf(stdout, "[%d-%02d-%02d %02d:%02d:%02d]%s %s%s\n",
+				tm.tm_year + 1900,
+				tm.tm_mon + 1,
+				tm.tm_mday,
+				tm.tm_hour,
+				tm.tm_min,
+				tm.tm_sec,
+				color,
+				msg,
+				use_colors ? CL_N : ""
+			);
 		}
-		pthread_mutex_lock(&applog_lock);
-		vfprintf(stdout, f, ap);	/* atomic write to stdout */
 		fflush(stdout);
 		pthread_mutex_unlock(&applog_lock);
 	}
+}
+
+void applog(int prio, const char *fmt, ...)
+{
+	char _ALIGN(64) line[1024];
+	char *buf = line;
+	va_list ap, ap2;
+	int len;
+
+	va_start(ap, fmt);
+	va_copy(ap2, ap);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	if (len >= (int) sizeof(line)) {
+		// long lines (--protocol)
+		buf = (char*) malloc(len + 1);
+		if (buf)
+			vsnprintf(buf, len + 1, fmt, ap2);
+		else
+			buf = line;
+	}
+	va_end(ap2);
 	va_end(ap);
+	if (len < 0)
+		return;
+
+	if (!log_async_push(prio, buf))
+		applog_output(prio, time(NULL), buf);
+	if (buf != line)
+		free(buf);
 }
 
 extern int gpu_threads;
@@ -913,6 +923,7 @@ bool stratum_send_line(struct stratum_ctx *sctx, char *s)
 
 	if (opt_protocol)
 		applog(LOG_DEBUG, "> %s", s);
+	record_line(sctx->pooln, true, s);
 
 	pthread_mutex_lock(&stratum_sock_lock);
 	ret = send_line(sctx->sock, s);
@@ -1013,6 +1024,11 @@ char *stratum_recv_line(struct stratum_ctx *sctx)
 		sctx->sockbuf[0] = '\0';
 
 out:
+	if (sret) {
+		latency_mark_recv();
+		PROBE2(stratum_recv, sret, sctx->pooln);
+		record_line(sctx->pooln, false, sret);
+	}
 	if (sret && opt_protocol)
 		applog(LOG_DEBUG, "< %s", sret);
 	return sret;
@@ -1841,6 +1857,8 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
 
 	if (!strcasecmp(method, "mining.notify")) {
 		ret = stratum_notify(sctx, params);
+		if (ret)
+			latency_job_notified(sctx->job.clean);
 		restart_threads();
 		goto out;
 	}
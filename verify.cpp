@@ -0,0 +1,181 @@
+/**
+ * Share verifier (--verify-shares)
+ *
+ * The shares found by the mining threads are queued to a low priority
+ * thread which hashes them again with the portable haraka (plain C, no
+ * aes-ni) before the submit. A share over the target is a hardware error
+ * of the thread and of its cpu: it is logged and dropped, and with
+ * --verify-disable=N the thread is stopped once its cpu has N errors
+ * (overclocked or undervolted cores).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+#include "verus/verusscan.h"
+#include "miner.h"
+
+#define VERIFY_MAX_CPUS 1024
+
+struct verify_cmd {
+	struct thr_info *thr;
+	struct work *work;
+};
+
+static const struct verus_backend reference = {
+	"portable", haraka512_port, haraka256_port, haraka512_port_keyed, verusclhashv2_2
+};
+
+static struct thread_q *verify_q = NULL;
+static u128 *verify_key = NULL;
+static volatile bool disabled[MAX_GPUS];
+static uint16_t cpu_errors[VERIFY_MAX_CPUS];
+static uint32_t checked = 0, hw_total = 0;
+static uint64_t verify_ns = 0;
+
+bool opt_verify_shares = false;
+int opt_verify_disable = 0;
+
+/* the data hashed by scanhash_verus, kept in the work by the share */
+static bool verify_share(struct work *work, u128 *key)
+{
+	alignas(32) uint8_t full_data[140 + 3 + 1344];
+	alignas(32) unsigned char half[64];
+	alignas(32) uint32_t hash[8] = { 0 };
+	uint32_t fixrand[32], fixrandex[32];
+
+	memcpy(full_data, work->data, 140);
+	memcpy(full_data + 140, work->extra, 1347);
+	VerusHashHalfBackend(&reference, half, full_data, (int) sizeof(full_data));
+	GenNewCLKeyBackend(&reference, half, key);
+	Verus2hashBackend(&reference, (unsigned char *) hash, half, &work->extra[1332], key, fixrand, fixrandex,
+		key + VERUS_KEY_SIZE128, key + VERUS_KEY_SIZE128 + 32);
+
+	return hash[7] <= work->target[7];
+}
+
+static void verify_hw_error(int thr_id, struct work *work)
+{
+	struct cgpu_info *cgpu = &thr_info[thr_id].gpu;
+	int cpu = topology_thread_cpu(thr_id);
+	uint16_t errors = 0;
+
+	hw_total++;
+	cgpu->hw_errors++;
+	if (cpu >= 0 && cpu < VERIFY_MAX_CPUS)
+		errors = ++cpu_errors[cpu];
+	applog(LOG_ERR, "CPU T%d: hardware error on cpu %d, invalid share of job %s (%u on the thread, %u on the cpu)",
+		thr_id, cpu, work->job_id + 8, cgpu->hw_errors, errors);
+	if (opt_verify_disable && errors >= opt_verify_disable && !disabled[thr_id]) {
+		disabled[thr_id] = true;
+		applog(LOG_WARNING, "CPU T%d: disabled after %u hardware errors on cpu %d", thr_id, errors, cpu);
+	}
+}
+
+static void *verify_thread(void *userdata)
+{
+	u128 *key = verify_key;
+
+	topology_bind_service();
+#ifdef WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#else
+	setpriority(PRIO_PROCESS, 0, 10); // the calling thread on linux
+#endif
+	load_constants_port();
+
+	while (!abort_flag) {
+		struct verify_cmd *vc = (struct verify_cmd *) tq_pop(verify_q, NULL);
+		uint64_t start;
+		bool valid;
+		if (!vc)
+			break;
+		start = latency_now();
+		valid = verify_share(vc->work, key);
+		verify_ns += latency_now() - start;
+		checked++;
+		if (valid) {
+			if (!submit_work(vc->thr, vc->work))
+				applog(LOG_ERR, "verified share submit failed");
+		} else {
+			verify_hw_error(vc->thr->id, vc->work);
+		}
+		aligned_free(vc->work);
+		free(vc);
+	}
+	free(key);
+	verify_key = NULL;
+	return NULL;
+}
+
+void verify_start()
+{
+	pthread_t pth;
+	if (!opt_verify_shares)
+		return;
+	verify_key = (u128 *) alloc_aligned_buffer(VERUS_KEY_SIZE + 1024);
+	if (!verify_key) {
+		applog(LOG_WARNING, "share verifier key allocation failed, the shares are not verified");
+		opt_verify_shares = false;
+		return;
+	}
+	verify_q = tq_new();
+	if (!verify_q || pthread_create(&pth, NULL, verify_thread, NULL)) {
+		applog(LOG_WARNING, "share verifier create failed, the shares are not verified");
+		opt_verify_shares = false;
+		free(verify_key);
+		verify_key = NULL;
+		return;
+	}
+	pthread_detach(pth);
+}
+
+/* called instead of submit_work() by the mining threads */
+bool verify_submit(struct thr_info *thr, const struct work *work)
+{
+	struct verify_cmd *vc;
+	if (!opt_verify_shares || !verify_q)
+		return submit_work(thr, work);
+	vc = (struct verify_cmd *) calloc(1, sizeof(*vc));
+	if (!vc)
+		return false;
+	vc->thr = thr;
+	vc->work = (struct work *) aligned_calloc(sizeof(*work));
+	if (!vc->work) {
+		free(vc);
+		return false;
+	}
+	memcpy(vc->work, work, sizeof(*work));
+	if (!tq_push(verify_q, vc)) {
+		aligned_free(vc->work);
+		free(vc);
+		return false;
+	}
+	return true;
+}
+
+bool verify_thread_disabled(int thr_id)
+{
+	return thr_id < MAX_GPUS && disabled[thr_id];
+}
+
+/* api */
+void verify_get(struct verify_data *data)
+{
+	memset(data, 0, sizeof(*data));
+	data->enabled = opt_verify_shares;
+	data->checked = checked;
+	data->hw_errors = hw_total;
+	data->avg_ms = checked ? 1e-6 * (double) verify_ns / checked : 0.;
+	for (int t = 0; t < opt_n_threads && t < MAX_GPUS; t++)
+		data->disabled += disabled[t] ? 1 : 0;
+}
+
+uint16_t verify_cpu_errors(int cpu)
+{
+	return (cpu >= 0 && cpu < VERIFY_MAX_CPUS) ? cpu_errors[cpu] : 0;
+}
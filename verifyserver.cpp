@@ -0,0 +1,463 @@
+/**
+ * Share verification server (--verify-server)
+ *
+ * The binary becomes a local verifier for the pool side: the jobs and the
+ * shares are read from stdin (--verify-server) or from the clients of a
+ * unix socket (--verify-server=PATH), hashed by -t threads pinned like the
+ * miners, and the verdicts with the hashes are written back as soon as
+ * they are done (not in order). In the stdin mode the logs go to stderr.
+ *
+ * Each frame is a type byte, a 32-bit payload length and the payload, all
+ * the integers are little endian:
+ *   'J' job     u32 id, header[140], solution[1344], target[32] (uint256)
+ *   'S' share   u32 seq, u32 job id, u32 ntime, nonce[32], nonce space[15]
+ *   'F' flush   u32 tag, answered once all the shares before are verified
+ *   'V' verdict u32 seq, u8 result (0 valid, 1 above target, 2 unknown
+ *               job), hash[32]                                  (answer)
+ *
+ * A job id can be sent again to replace the job. Each thread keeps the
+ * prepared contexts (libverushash) of its last jobs, the merged mining
+ * jobs clear the header nonce so one context verifies all their shares.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "miner.h"
+#include "verus/verushash.h"
+
+#ifndef WIN32
+# include <sys/socket.h>
+# include <sys/un.h>
+#endif
+
+#define VS_JOBS      256    /* job slots, by id */
+#define VS_QUEUE     16384  /* shares waiting for a thread */
+#define VS_CHUNK     64     /* shares taken at once by a thread */
+#define VS_CACHE     4      /* prepared jobs per thread */
+#define VS_FRAME_MAX (4 + 140 + 1344 + 32)
+
+#define VS_JOB_SIZE     (4 + 140 + 1344 + 32)
+#define VS_SHARE_SIZE   (4 + 4 + 4 + 32 + 15)
+#define VS_VERDICT_SIZE (4 + 1 + 32)
+
+enum {
+	VS_VALID = 0,
+	VS_ABOVE_TARGET,
+	VS_UNKNOWN_JOB
+};
+
+struct vs_job {
+	uint32_t id;
+	uint32_t gen;     /* 0 = free */
+	uint8_t header[140];
+	uint8_t solution[1344];
+	uint8_t target[32];
+};
+
+struct vs_share {
+	uint32_t seq;
+	uint32_t job_id;
+	uint32_t gen;     /* of the job when the share was read */
+	uint32_t ntime;
+	uint8_t nonce[32];
+	uint8_t nonce_space[15];
+};
+
+struct vs_cache {
+	verushash_ctx *ctx;
+	uint32_t gen;     /* 0 = empty */
+	uint32_t ntime;
+	uint8_t nonce[32];
+	uint8_t target[32];
+	uint64_t used;
+};
+
+struct vs_thread {
+	pthread_t pth;
+	int thr_id;
+	struct vs_cache cache[VS_CACHE];
+	uint64_t tick;
+};
+
+char *opt_verify_server = NULL;  /* "-" for stdin */
+
+static int vs_out_fd = -1;
+static pthread_mutex_t vs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vs_cond = PTHREAD_COND_INITIALIZER;  /* queue and done */
+static pthread_mutex_t vs_out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct vs_job jobs[VS_JOBS];
+static uint32_t job_gen = 0;
+static struct vs_share queue[VS_QUEUE];
+static uint32_t q_head = 0, q_tail = 0;  /* taken, added */
+static uint64_t enqueued = 0, done = 0;
+static bool vs_stop = false;
+
+static uint64_t st_valid = 0, st_above = 0, st_unknown = 0, st_prepares = 0;
+
+static inline uint32_t le32(const uint8_t *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t) v; p[1] = (uint8_t) (v >> 8); p[2] = (uint8_t) (v >> 16); p[3] = (uint8_t) (v >> 24);
+}
+
+static bool vs_read(int fd, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *) buf;
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool vs_write(const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+	while (len) {
+		ssize_t n = write(vs_out_fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool vs_merged(const uint8_t *solution)
+{
+	return solution[0] >= 7 && solution[5] > 0;
+}
+
+/* the prepared context of the share job, NULL if the job was replaced */
+static struct vs_cache *vs_context(struct vs_thread *vt, const struct vs_share *sh)
+{
+	struct vs_job *job = &jobs[sh->job_id % VS_JOBS];
+	struct vs_cache *c, *lru = &vt->cache[0];
+	uint8_t header[140], solution[1344];
+	uint8_t nonce[32] = { 0 };
+	bool merged;
+
+	if (!sh->gen)
+		return NULL;
+	pthread_mutex_lock(&vs_lock);
+	if (job->gen != sh->gen || job->id != sh->job_id) {
+		pthread_mutex_unlock(&vs_lock);
+		return NULL;
+	}
+	merged = vs_merged(job->solution);
+	pthread_mutex_unlock(&vs_lock);
+
+	// the merged mining layout clears the header nonce
+	if (!merged)
+		memcpy(nonce, sh->nonce, 32);
+	for (int i = 0; i < VS_CACHE; i++) {
+		c = &vt->cache[i];
+		if (c->gen == sh->gen && c->ntime == sh->ntime && !memcmp(c->nonce, nonce, 32)) {
+			c->used = ++vt->tick;
+			return c;
+		}
+		if (c->used < lru->used)
+			lru = c;
+	}
+
+	pthread_mutex_lock(&vs_lock);
+	if (job->gen != sh->gen) {
+		pthread_mutex_unlock(&vs_lock);
+		return NULL;
+	}
+	memcpy(header, job->header, 140);
+	memcpy(solution, job->solution, 1344);
+	memcpy(lru->target, job->target, 32);
+	st_prepares++;
+	pthread_mutex_unlock(&vs_lock);
+
+	put_le32(&header[100], sh->ntime);
+	memcpy(&header[108], sh->nonce, 32);
+	verushash_ctx_prepare(lru->ctx, header, solution);
+	lru->gen = sh->gen;
+	lru->ntime = sh->ntime;
+	memcpy(lru->nonce, nonce, 32);
+	lru->used = ++vt->tick;
+	return lru;
+}
+
+static void *vs_thread(void *userdata)
+{
+	struct vs_thread *vt = (struct vs_thread *) userdata;
+	struct vs_share shares[VS_CHUNK];
+	uint8_t out[VS_CHUNK * (5 + VS_VERDICT_SIZE)];
+
+	topology_bind_miner(vt->thr_id);
+	while (true) {
+		uint32_t valid = 0, above = 0, unknown = 0;
+		size_t len = 0;
+		int n = 0;
+
+		pthread_mutex_lock(&vs_lock);
+		while (q_head == q_tail && !vs_stop)
+			pthread_cond_wait(&vs_cond, &vs_lock);
+		if (q_head == q_tail) {
+			pthread_mutex_unlock(&vs_lock);
+			break;
+		}
+		while (q_head != q_tail && n < VS_CHUNK)
+			shares[n++] = queue[q_head++ % VS_QUEUE];
+		pthread_cond_broadcast(&vs_cond);
+		pthread_mutex_unlock(&vs_lock);
+
+		for (int i = 0; i < n; i++) {
+			struct vs_cache *c = vs_context(vt, &shares[i]);
+			uint8_t *v = &out[len];
+			v[0] = 'V';
+			put_le32(&v[1], VS_VERDICT_SIZE);
+			put_le32(&v[5], shares[i].seq);
+			if (!c) {
+				v[9] = VS_UNKNOWN_JOB;
+				memset(&v[10], 0, 32);
+				unknown++;
+			} else if (verushash_ctx_verify(c->ctx, shares[i].nonce_space, c->target, &v[10])) {
+				v[9] = VS_VALID;
+				valid++;
+			} else {
+				v[9] = VS_ABOVE_TARGET;
+				above++;
+			}
+			len += 5 + VS_VERDICT_SIZE;
+		}
+
+		pthread_mutex_lock(&vs_out_lock);
+		if (!vs_write(out, len) && !vs_stop)
+			applog(LOG_ERR, "verify server: verdicts write failed");
+		pthread_mutex_unlock(&vs_out_lock);
+
+		pthread_mutex_lock(&vs_lock);
+		done += n;
+		st_valid += valid;
+		st_above += above;
+		st_unknown += unknown;
+		pthread_cond_broadcast(&vs_cond);
+		pthread_mutex_unlock(&vs_lock);
+	}
+	return NULL;
+}
+
+static void vs_job(const uint8_t *p)
+{
+	uint32_t id = le32(p);
+	struct vs_job *job = &jobs[id % VS_JOBS];
+
+	pthread_mutex_lock(&vs_lock);
+	job->id = id;
+	if (++job_gen == 0)
+		job_gen = 1;
+	job->gen = job_gen;
+	memcpy(job->header, p + 4, 140);
+	memcpy(job->solution, p + 4 + 140, 1344);
+	memcpy(job->target, p + 4 + 140 + 1344, 32);
+	pthread_mutex_unlock(&vs_lock);
+}
+
+static void vs_share(const uint8_t *p)
+{
+	struct vs_share sh;
+	struct vs_job *job;
+
+	sh.seq = le32(p);
+	sh.job_id = le32(p + 4);
+	sh.ntime = le32(p + 8);
+	memcpy(sh.nonce, p + 12, 32);
+	memcpy(sh.nonce_space, p + 44, 15);
+
+	pthread_mutex_lock(&vs_lock);
+	job = &jobs[sh.job_id % VS_JOBS];
+	sh.gen = job->id == sh.job_id ? job->gen : 0;
+	while (q_tail - q_head >= VS_QUEUE)
+		pthread_cond_wait(&vs_cond, &vs_lock);
+	queue[q_tail++ % VS_QUEUE] = sh;
+	enqueued++;
+	pthread_cond_signal(&vs_cond);
+	pthread_mutex_unlock(&vs_lock);
+}
+
+static bool vs_flush(const uint8_t *p)
+{
+	uint8_t f[5 + 4];
+	bool ret;
+
+	pthread_mutex_lock(&vs_lock);
+	while (done < enqueued)
+		pthread_cond_wait(&vs_cond, &vs_lock);
+	pthread_mutex_unlock(&vs_lock);
+
+	f[0] = 'F';
+	put_le32(&f[1], 4);
+	memcpy(&f[5], p, 4);
+	pthread_mutex_lock(&vs_out_lock);
+	ret = vs_write(f, sizeof(f));
+	pthread_mutex_unlock(&vs_out_lock);
+	return ret;
+}
+
+/* read the frames of a client until the end or an error */
+static void vs_session(int in_fd)
+{
+	static uint8_t payload[VS_FRAME_MAX];
+	uint8_t hdr[5];
+
+	while (!abort_flag && vs_read(in_fd, hdr, sizeof(hdr))) {
+		uint32_t len = le32(&hdr[1]);
+		bool valid = (hdr[0] == 'J' && len == VS_JOB_SIZE) ||
+			(hdr[0] == 'S' && len == VS_SHARE_SIZE) || (hdr[0] == 'F' && len == 4);
+		if (!valid) {
+			applog(LOG_ERR, "verify server: bad frame '%c' of %u bytes", hdr[0] >= 0x20 ? hdr[0] : '?', len);
+			break;
+		}
+		if (!vs_read(in_fd, payload, len))
+			break;
+		if (hdr[0] == 'J')
+			vs_job(payload);
+		else if (hdr[0] == 'S')
+			vs_share(payload);
+		else if (!vs_flush(payload))
+			break;
+	}
+
+	// the shares already read are answered
+	pthread_mutex_lock(&vs_lock);
+	while (done < enqueued)
+		pthread_cond_wait(&vs_cond, &vs_lock);
+	pthread_mutex_unlock(&vs_lock);
+}
+
+/* stdout is for the verdicts, before the banner and the logs */
+void verify_server_stdio()
+{
+	if (!opt_verify_server || strcmp(opt_verify_server, "-"))
+		return;
+	vs_out_fd = dup(1);
+	dup2(2, 1);
+}
+
+/**
+ * Run the verification server, instead of the pool connection and the miners
+ */
+int verify_server_run(int nthreads)
+{
+	struct vs_thread *vt;
+	uint64_t start, shares;
+	double secs;
+	int started = 0, rc = EXIT_CODE_OK;
+
+	if (verushash_init() != VERUSHASH_OK) {
+		applog(LOG_ERR, "verify server: this cpu has no AES/AVX");
+		return EXIT_CODE_SW_INIT_ERROR;
+	}
+#ifndef WIN32
+	// a client which leaves is a write error, not a signal
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	nthreads = min(max(nthreads, 1), MAX_GPUS);
+	vt = (struct vs_thread *) calloc(nthreads, sizeof(*vt));
+	if (!vt)
+		return EXIT_CODE_SW_INIT_ERROR;
+	for (int t = 0; t < nthreads; t++) {
+		vt[t].thr_id = t;
+		for (int i = 0; i < VS_CACHE; i++) {
+			vt[t].cache[i].ctx = verushash_ctx_new();
+			if (!vt[t].cache[i].ctx)
+				rc = EXIT_CODE_SW_INIT_ERROR;
+		}
+		if (rc == EXIT_CODE_OK && pthread_create(&vt[t].pth, NULL, vs_thread, &vt[t])) {
+			applog(LOG_ERR, "verify server thread %d create failed", t);
+			rc = EXIT_CODE_SW_INIT_ERROR;
+		}
+		if (rc != EXIT_CODE_OK)
+			break;
+		started++;
+	}
+
+	start = latency_now();
+	if (rc != EXIT_CODE_OK) {
+		// the threads started are stopped below
+	} else if (!strcmp(opt_verify_server, "-")) {
+		if (vs_out_fd < 0)
+			vs_out_fd = 1;
+		applog(LOG_BLUE, "Verify server: %d threads on stdin", started);
+		vs_session(0);
+	} else {
+#ifndef WIN32
+		struct sockaddr_un addr;
+		int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opt_verify_server);
+		unlink(opt_verify_server);
+		if (srv < 0 || bind(srv, (struct sockaddr *) &addr, sizeof(addr)) || listen(srv, 4)) {
+			applog(LOG_ERR, "verify server: unable to listen on %s", opt_verify_server);
+			rc = EXIT_CODE_SW_INIT_ERROR;
+		} else {
+			applog(LOG_BLUE, "Verify server: %d threads on %s", started, opt_verify_server);
+		}
+		while (rc == EXIT_CODE_OK && !abort_flag) {
+			int client = accept(srv, NULL, NULL);
+			if (client < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			applog(LOG_INFO, "verify server: client connected");
+			vs_out_fd = client;
+			vs_session(client);
+			pthread_mutex_lock(&vs_out_lock);
+			vs_out_fd = -1;
+			pthread_mutex_unlock(&vs_out_lock);
+			close(client);
+			applog(LOG_INFO, "verify server: client disconnected, %llu shares verified",
+				(unsigned long long) done);
+		}
+		if (srv >= 0)
+			close(srv);
+		unlink(opt_verify_server);
+#else
+		applog(LOG_ERR, "verify server: no unix socket on windows, use stdin");
+		rc = EXIT_CODE_USAGE;
+#endif
+	}
+
+	pthread_mutex_lock(&vs_lock);
+	vs_stop = true;
+	pthread_cond_broadcast(&vs_cond);
+	pthread_mutex_unlock(&vs_lock);
+	for (int t = 0; t < started; t++)
+		pthread_join(vt[t].pth, NULL);
+
+	secs = 1e-9 * (double) (latency_now() - start);
+	shares = st_valid + st_above + st_unknown;
+	applog(LOG_NOTICE, "Verify server: %llu shares in %.1fs (%.0f/s), %llu valid, %llu above target, "
+		"%llu unknown job, %llu job contexts prepared", (unsigned long long) shares, secs,
+		secs > 0. ? shares / secs : 0., (unsigned long long) st_valid, (unsigned long long) st_above,
+		(unsigned long long) st_unknown, (unsigned long long) st_prepares);
+
+	for (int t = 0; t < nthreads; t++)
+		for (int i = 0; i < VS_CACHE; i++)
+			verushash_ctx_free(vt[t].cache[i].ctx);
+	free(vt);
+	return rc;
+}
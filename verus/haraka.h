@@ -239,6 +239,7 @@ void haraka256_8x(unsigned char *out, const unsigned char *in);
 void haraka512(unsigned char *out, const unsigned char *in);
 void haraka512_zero(unsigned char *out, const unsigned char *in);
 void haraka512_keyed(unsigned char *out, const unsigned char *in, const u128 *rc);
+void haraka512_keyed_full(unsigned char *out, const unsigned char *in, const u128 *rc);
 void haraka512_4x(unsigned char *out, const unsigned char *in);
 void haraka512_8x(unsigned char *out, const unsigned char *in);
 
@@ -258,6 +259,7 @@ void haraka256_8x(unsigned char *out, const unsigned char *in);
 void haraka512(unsigned char *out, const unsigned char *in);
 void haraka512_zero(unsigned char *out, const unsigned char *in);
 void haraka512_keyed(unsigned char *out, const unsigned char *in, const u128 *rc);
+void haraka512_keyed_full(unsigned char *out, const unsigned char *in, const u128 *rc);
 void haraka512_4x(unsigned char *out, const unsigned char *in);
 void haraka512_8x(unsigned char *out, const unsigned char *in);
 
@@ -31,6 +31,20 @@
 #endif
 
 
+#ifdef VERUS_BRANCH_STATS
+// verus-bench copy (verus_clhash_stats.cpp), tsc cycles of each selector branch
+#include <x86intrin.h>
+uint64_t verus_branch_count[8], verus_branch_cycles[8];
+#define BRANCH_START() const uint64_t branch_tsc = __rdtsc()
+#define BRANCH_END(sel) { verus_branch_cycles[((sel) & 0x1c) >> 2] += __rdtsc() - branch_tsc; \
+	verus_branch_count[((sel) & 0x1c) >> 2]++; }
+// the helpers are in the plain object
+__m128i lazyLengthHash(uint64_t keylength, uint64_t length);
+uint64_t precompReduction64(__m128i A);
+#else
+#define BRANCH_START()
+#define BRANCH_END(sel)
+
 int __cpuverusoptimized = 0x80;
 
 // multiply the length and the some key, no modulo
@@ -56,6 +70,7 @@ __m128i precompReduction64_si128(__m128i A) {
 uint64_t precompReduction64(__m128i A) {
 	return _mm_cvtsi128_si64(precompReduction64_si128(A));
 }
+#endif /* VERUS_BRANCH_STATS */
 
 __m128i __verusclmulwithoutreduction64alignedrepeatv2_2(__m128i *randomsource, const __m128i buf[4], uint64_t keyMask,
 	uint32_t *fixrand, uint32_t *fixrandex, u128 *g_prand, u128 *g_prandex)
@@ -88,6 +103,7 @@ __m128i __verusclmulwithoutreduction64alignedrepeatv2_2(__m128i *randomsource, c
 		fixrand[i] = prand_idx;
 		fixrandex[i] = prandex_idx;
 
+		BRANCH_START();
 		switch (selector & 0x1c)
 		{
 		case 0:
@@ -339,6 +355,7 @@ __m128i __verusclmulwithoutreduction64alignedrepeatv2_2(__m128i *randomsource, c
 			break;
 		}
 		}
+		BRANCH_END(selector);
 	}
 	return acc;
 }
@@ -355,6 +372,7 @@ uint64_t verusclhashv2_2(void * random, const unsigned char buf[64], uint64_t ke
 	return precompReduction64(acc);
 }
 
+#ifndef VERUS_BRANCH_STATS
 #ifdef _WIN32
 
 #define posix_memalign(p, a, s) (((*(p)) = _aligned_malloc((s), (a))), *(p) ?0 :errno)
@@ -372,3 +390,4 @@ void *alloc_aligned_buffer(uint64_t bufSize)
 		return answer;
 	}
 }
+#endif
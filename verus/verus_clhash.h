@@ -130,6 +130,11 @@ uint64_t verusclhashv2_2(void * random, const unsigned char buf[64], uint64_t ke
 uint64_t verusclhash_port(void * random, const unsigned char buf[64], uint64_t keyMask, uint32_t *fixrand, uint32_t *fixrandex,
 	u128 *g_prand, u128 *g_prandex);
 
+// verus-bench only, verus_clhash.cpp built with VERUS_BRANCH_STATS
+uint64_t verusclhashv2_2_stats(void * random, const unsigned char buf[64], uint64_t keyMask, uint32_t *fixrand, uint32_t *fixrandex,
+	u128 *g_prand, u128 *g_prandex);
+extern uint64_t verus_branch_count[8], verus_branch_cycles[8];
+
 void *alloc_aligned_buffer(uint64_t bufSize);
 
 #ifdef __cplusplus
@@ -0,0 +1,9 @@
+/**
+ * verus_clhash.cpp with the tsc cycles of each selector branch, linked
+ * in verus-bench next to the plain object (the miner has no counter)
+ */
+#define VERUS_BRANCH_STATS
+#define verusclhashv2_2 verusclhashv2_2_stats
+#define __verusclmulwithoutreduction64alignedrepeatv2_2 __verusclmulwithoutreduction64alignedrepeatv2_2_stats
+
+#include "verus_clhash.cpp"
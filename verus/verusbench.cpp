@@ -0,0 +1,412 @@
+/**
+ * Kernel microbenchmark of the verus 2.2 primitives (make verus-bench)
+ *
+ * Only links the verus/ sources: each primitive is called in a loop of
+ * dependent calls on a pinned cpu, the loop is repeated and the median
+ * tsc cycles and ns per call are reported, per backend (native is the
+ * miner build, portable the C haraka). The clhash selector branches are
+ * timed with the verus_clhash_stats.cpp copy.
+ *
+ * -k and -f check the backends instead (veruscheck.cpp, also make check)
+ *
+ * usage: verus-bench [-c cpu] [-r repeats] [-t ms] [-j] [-k] [-f nonces [-s seed]]
+ */
+#include <ccminer-config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "verusscan.h"
+
+#define BENCH_MAX_REPEATS 101
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
+
+/* veruscheck.cpp */
+int verus_check_kat();
+int verus_check_fuzz(uint64_t nonces, uint32_t seed);
+
+struct bench_ctx {
+	u128 *key;
+	u128 *key_prand;
+	u128 *key_prandex;
+	uint32_t fixrand[32];
+	uint32_t fixrandex[32];
+	alignas(32) unsigned char in[64];
+	alignas(32) unsigned char out[64];
+	alignas(32) unsigned char half[64];
+	alignas(32) unsigned char nonce[16];
+	unsigned char data[1487];
+	uint64_t sink;
+};
+
+typedef void (*bench_fn)(struct bench_ctx *c, uint64_t ops);
+
+struct bench_prim {
+	const char *name;
+	const char *backend;
+	bench_fn fn;
+	// results
+	double cycles, ns, cycles_min, spread;
+	double runs[BENCH_MAX_REPEATS];  /* ns of each repeat, for verus-benchcmp */
+	uint64_t ops;
+};
+
+static int opt_cpu = 0;
+static int opt_repeats = 11;
+static int opt_ms = 50;
+static bool opt_json = false;
+static bool opt_kat = false;
+static uint64_t opt_fuzz = 0;
+static uint32_t opt_seed = 0;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run_haraka512(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		haraka512(c->out, c->in);
+		memcpy(c->in, c->out, 32);
+	}
+}
+
+static void run_haraka512_port(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		haraka512_port(c->out, c->in);
+		memcpy(c->in, c->out, 32);
+	}
+}
+
+static void run_haraka512_keyed(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		haraka512_keyed(c->out, c->in, c->key + (c->out[0] & 511));
+		memcpy(c->in, c->out, 32);
+	}
+}
+
+static void run_haraka512_port_keyed(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		haraka512_port_keyed(c->out, c->in, c->key + (c->out[0] & 511));
+		memcpy(c->in, c->out, 32);
+	}
+}
+
+static void run_haraka256(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++)
+		haraka256(c->in, c->in);
+}
+
+static void run_haraka256_port(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		haraka256_port(c->out, c->in);
+		memcpy(c->in, c->out, 32);
+	}
+}
+
+static void run_genclkey(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		c->half[0] = (unsigned char) i;
+		GenNewCLKey(c->half, c->key);
+	}
+}
+
+static void run_hashhalf(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		VerusHashHalf(c->half, c->data, (int) sizeof(c->data));
+		c->data[0] = c->half[0];
+	}
+}
+
+// the key is mutated and not fixed, like in the mining loop before FixKey
+static void run_clhash(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		c->in[32] = (unsigned char) i;
+		c->sink += verusclhashv2_2(c->key, c->in, 511, c->fixrand, c->fixrandex, c->key_prand, c->key_prandex);
+	}
+}
+
+static void run_clhash_stats(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++) {
+		c->in[32] = (unsigned char) i;
+		c->sink += verusclhashv2_2_stats(c->key, c->in, 511, c->fixrand, c->fixrandex, c->key_prand, c->key_prandex);
+	}
+}
+
+static void run_fixkey(struct bench_ctx *c, uint64_t ops)
+{
+	for (uint64_t i = 0; i < ops; i++)
+		FixKey(c->fixrand, c->fixrandex, c->key, c->key_prand, c->key_prandex);
+}
+
+static void run_verus2hash(struct bench_ctx *c, uint64_t ops)
+{
+	uint8_t gpuinit = 0;
+	for (uint64_t i = 0; i < ops; i++) {
+		((uint32_t *) &c->nonce[11])[0] = (uint32_t) i;
+		Verus2hash(c->out, c->half, c->nonce, c->key, &gpuinit, c->fixrand, c->fixrandex,
+			c->key_prand, c->key_prandex, 7, NULL);
+	}
+}
+
+static struct bench_prim prims[] = {
+	{ "haraka512",       "native",   run_haraka512 },
+	{ "haraka512",       "portable", run_haraka512_port },
+	{ "haraka512_keyed", "native",   run_haraka512_keyed },
+	{ "haraka512_keyed", "portable", run_haraka512_port_keyed },
+	{ "haraka256",       "native",   run_haraka256 },
+	{ "haraka256",       "portable", run_haraka256_port },
+	{ "GenNewCLKey",     "native",   run_genclkey },
+	{ "VerusHashHalf",   "native",   run_hashhalf },
+	{ "verusclhashv2_2", "native",   run_clhash },
+	{ "FixKey",          "native",   run_fixkey },
+	{ "Verus2hash",      "native",   run_verus2hash },
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* same key and input for each primitive */
+static void bench_reset(struct bench_ctx *c)
+{
+	uint32_t x = 0x56525553U;
+	for (size_t i = 0; i < sizeof(c->data); i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		c->data[i] = (unsigned char) x;
+	}
+	c->data[0] = 4;
+	memcpy(c->in, c->data + 64, sizeof(c->in));
+	memset(c->nonce, 0, sizeof(c->nonce));
+	VerusHashHalf(c->half, c->data, (int) sizeof(c->data));
+	GenNewCLKey(c->half, c->key);
+	// fixrand/fixrandex entries for FixKey
+	memcpy(c->in, c->half, sizeof(c->in));
+	c->sink += verusclhashv2_2(c->key, c->in, 511, c->fixrand, c->fixrandex, c->key_prand, c->key_prandex);
+	FixKey(c->fixrand, c->fixrandex, c->key, c->key_prand, c->key_prandex);
+}
+
+static void bench_prim(struct bench_ctx *c, struct bench_prim *p)
+{
+	double cycles[BENCH_MAX_REPEATS], ns[BENCH_MAX_REPEATS];
+	uint64_t t0, ops = 16;
+
+	bench_reset(c);
+	// calibrate the loop length, also the warm-up
+	do {
+		ops *= 2;
+		t0 = now_ns();
+		p->fn(c, ops);
+	} while (now_ns() - t0 < (uint64_t) opt_ms * 100000ULL);
+	ops = std::max(ops * 10, (uint64_t) 64);
+
+	for (int r = 0; r < opt_repeats; r++) {
+		uint64_t tsc, tm;
+		tm = now_ns();
+		tsc = __rdtsc();
+		p->fn(c, ops);
+		tsc = __rdtsc() - tsc;
+		tm = now_ns() - tm;
+		cycles[r] = (double) tsc / (double) ops;
+		ns[r] = (double) tm / (double) ops;
+		p->runs[r] = ns[r];
+	}
+	qsort(cycles, opt_repeats, sizeof(double), cmp_double);
+	qsort(ns, opt_repeats, sizeof(double), cmp_double);
+	p->ops = ops;
+	p->cycles = cycles[opt_repeats / 2];
+	p->ns = ns[opt_repeats / 2];
+	p->cycles_min = cycles[0];
+	p->spread = p->cycles > 0. ? (cycles[opt_repeats - 1] - cycles[0]) / p->cycles : 0.;
+}
+
+/* median cost of two back to back rdtsc, removed from the branch times */
+static double tsc_overhead()
+{
+	double d[255];
+	for (int i = 0; i < 255; i++) {
+		uint64_t a = __rdtsc();
+		uint64_t b = __rdtsc();
+		d[i] = (double) (b - a);
+	}
+	qsort(d, 255, sizeof(double), cmp_double);
+	return d[127];
+}
+
+static bool bench_pin(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+static void usage()
+{
+	printf("usage: verus-bench [-c cpu] [-r repeats] [-t ms] [-j] [-k] [-f nonces [-s seed]]\n"
+		"  -c  cpu to pin the benchmark (default 0)\n"
+		"  -r  repetitions of each loop, the median is reported (default 11)\n"
+		"  -t  duration of each loop in ms (default 50)\n"
+		"  -j  json output\n"
+		"  -k  check the known answer vectors on each backend\n"
+		"  -f  compare each backend with the reference on random nonces\n"
+		"  -s  seed of the random jobs (default: time)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_ctx *c;
+	uint64_t branch_ops = 0, clhash_ops = 0;
+	double overhead;
+	bool pinned;
+	int key;
+
+	while ((key = getopt(argc, argv, "c:r:t:jkf:s:h")) != -1) {
+		switch (key) {
+		case 'c':
+			opt_cpu = atoi(optarg);
+			break;
+		case 'r':
+			opt_repeats = atoi(optarg);
+			if (opt_repeats < 1 || opt_repeats > BENCH_MAX_REPEATS) {
+				fprintf(stderr, "repeats must be between 1 and %d\n", BENCH_MAX_REPEATS);
+				return 1;
+			}
+			break;
+		case 't':
+			opt_ms = std::max(atoi(optarg), 1);
+			break;
+		case 'j':
+			opt_json = true;
+			break;
+		case 'k':
+			opt_kat = true;
+			break;
+		case 'f':
+			opt_fuzz = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			opt_seed = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return key == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!IsCPUVerusOptimized()) {
+		fprintf(stderr, "this cpu has no AES/AVX, the native primitives can't run\n");
+		return 1;
+	}
+	if (opt_kat || opt_fuzz) {
+		int rc = opt_kat ? verus_check_kat() : 0;
+		if (!rc && opt_fuzz)
+			rc = verus_check_fuzz(opt_fuzz, opt_seed ? opt_seed : (uint32_t) time(NULL));
+		return rc;
+	}
+
+	pinned = bench_pin(opt_cpu);
+	if (!pinned)
+		fprintf(stderr, "unable to pin the benchmark on cpu %d, results may vary\n", opt_cpu);
+
+	c = (struct bench_ctx *) alloc_aligned_buffer(sizeof(*c));
+	if (!c)
+		return 1;
+	memset(c, 0, sizeof(*c));
+	c->key = (u128 *) alloc_aligned_buffer(VERUS_KEY_SIZE + 1024);
+	if (!c->key)
+		return 1;
+	c->key_prand = c->key + VERUS_KEY_SIZE128;
+	c->key_prandex = c->key + VERUS_KEY_SIZE128 + 32;
+	load_constants();
+	load_constants_port();
+
+	for (size_t i = 0; i < ARRAY_SIZE(prims); i++) {
+		bench_prim(c, &prims[i]);
+		if (prims[i].fn == run_clhash)
+			clhash_ops = prims[i].ops * opt_repeats;
+	}
+
+	// clhash selector branches, same loop as verusclhashv2_2
+	overhead = tsc_overhead();
+	bench_reset(c);
+	memset(verus_branch_count, 0, sizeof(verus_branch_count));
+	memset(verus_branch_cycles, 0, sizeof(verus_branch_cycles));
+	run_clhash_stats(c, clhash_ops);
+	for (int b = 0; b < 8; b++)
+		branch_ops += verus_branch_count[b];
+
+	if (!opt_json) {
+		printf("verus-bench %s, cpu %d%s, %d repeats of %d ms\n\n", PACKAGE_VERSION, opt_cpu,
+			pinned ? "" : " (not pinned)", opt_repeats, opt_ms);
+		printf("%-16s %-9s %12s %10s %12s %8s\n", "primitive", "backend", "cycles/op", "ns/op", "min cycles", "spread");
+		for (size_t i = 0; i < ARRAY_SIZE(prims); i++) {
+			struct bench_prim *p = &prims[i];
+			printf("%-16s %-9s %12.1f %10.2f %12.1f %7.1f%%\n", p->name, p->backend,
+				p->cycles, p->ns, p->cycles_min, p->spread * 100.);
+		}
+		printf("\nverusclhashv2_2 selector branches (tsc overhead %.0f cycles removed)\n", overhead);
+		printf("%-8s %10s %12s\n", "branch", "share", "cycles/op");
+	}
+	if (opt_json) {
+		printf("{\n  \"version\": \"%s\",\n", PACKAGE_VERSION);
+#ifdef __VERSION__
+		printf("  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+		printf("  \"cpu\": %d,\n  \"pinned\": %s,\n  \"repeats\": %d,\n  \"loop_ms\": %d,\n",
+			opt_cpu, pinned ? "true" : "false", opt_repeats, opt_ms);
+		printf("  \"cycles\": \"tsc\",\n  \"primitives\": [\n");
+		for (size_t i = 0; i < ARRAY_SIZE(prims); i++) {
+			struct bench_prim *p = &prims[i];
+			printf("    { \"name\": \"%s\", \"backend\": \"%s\", \"ops\": %llu, \"cycles\": %.2f, "
+				"\"ns\": %.3f, \"cycles_min\": %.2f, \"spread\": %.4f, \"ns_runs\": [", p->name, p->backend,
+				(unsigned long long) p->ops, p->cycles, p->ns, p->cycles_min, p->spread);
+			for (int r = 0; r < opt_repeats; r++)
+				printf("%s%.3f", r ? ", " : "", p->runs[r]);
+			printf("] }%s\n", i + 1 < ARRAY_SIZE(prims) ? "," : "");
+		}
+		printf("  ],\n  \"tsc_overhead\": %.1f,\n  \"clhash_branches\": [\n", overhead);
+	}
+	for (int b = 0; b < 8; b++) {
+		uint64_t n = verus_branch_count[b];
+		double cyc = n ? std::max((double) verus_branch_cycles[b] / (double) n - overhead, 0.) : 0.;
+		double share = branch_ops ? (double) n / (double) branch_ops : 0.;
+		if (opt_json)
+			printf("    { \"selector\": \"0x%02x\", \"count\": %llu, \"share\": %.4f, \"cycles\": %.2f }%s\n",
+				b << 2, (unsigned long long) n, share, cyc, b < 7 ? "," : "");
+		else
+			printf("0x%02x     %9.1f%% %12.1f\n", b << 2, share * 100., cyc);
+	}
+	if (opt_json)
+		printf("  ]\n}\n");
+
+	free(c->key);
+	free(c);
+	return branch_ops ? 0 : 1;
+}
@@ -0,0 +1,457 @@
+/**
+ * Comparison of two sets of benchmark results (make verus-benchcmp)
+ *
+ * Reads the json of the miner benchmark (--bench-json, the hashrate of
+ * each sample), of verus-bench -j (the ns of each repeat per primitive)
+ * and of --bench-stratum (the median ns per stage), each file is a run.
+ * The samples of a run are not independent (same process, same machine
+ * state), the noise between the builds is the one between the runs, so
+ * the run is the unit: its value is the median of its samples.
+ *
+ * For each metric the change of the median of the runs is given with a
+ * two level bootstrap interval (the runs, then the samples of each run)
+ * and the Mann-Whitney U test of the run values (exact without ties), the
+ * p-values are corrected for the number of metrics (Holm). A metric is a
+ * regression when the test is significant, the interval is on the worse
+ * side and the change is over -t percent.
+ *
+ * The runs needed on each side (-m) default to the smallest count which
+ * can reach alpha after the correction for the metrics loaded (6 for the
+ * 11 primitives of verus-bench at 0.05). A metric is "underpowered" if
+ * its run counts can't reach alpha.
+ *
+ * The exit code is 1 if there is a regression, 2 if a metric could not
+ * be compared (missing on one side, too few runs or underpowered), to
+ * gate the builds.
+ *
+ * usage: verus-benchcmp [-a alpha] [-t pct] [-m runs] [-B resamples] [-s seed] [-j]
+ *                       -b base.json [-b ...] -n new.json [-n ...]
+ */
+#include <ccminer-config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <jansson.h>
+
+#define CMP_EXACT_MAX 60   /* runs of both sides for the exact test */
+
+typedef std::vector<double> run_samples;
+
+struct metric {
+	bool higher_better;
+	std::vector<run_samples> base, cand;
+	// results
+	double base_med, cand_med, change, lo, hi, p, p_holm;
+	const char *verdict;
+};
+
+static double opt_alpha = 0.05;
+static double opt_threshold = 1.0;  /* % */
+static int opt_min_runs = 0;        /* 0: enough to reach alpha */
+static int need_runs = 2;
+static int opt_resamples = 2000;
+static uint32_t opt_seed = 0x56525553;
+static bool opt_json = false;
+
+static std::map<std::string, metric> metrics;
+static std::vector<std::string> order;  /* first seen */
+
+static uint32_t rand_state;
+
+static uint32_t cmp_rand()
+{
+	uint32_t x = rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return rand_state = x;
+}
+
+static metric &get_metric(const std::string &name, bool higher_better)
+{
+	if (!metrics.count(name)) {
+		order.push_back(name);
+		metrics[name].higher_better = higher_better;
+	}
+	return metrics[name];
+}
+
+/* one run of a metric, the summary value if the file has no samples */
+static void add_run(const std::string &name, bool higher_better, bool cand, json_t *arr, double fallback)
+{
+	metric &m = get_metric(name, higher_better);
+	run_samples run;
+	size_t i;
+	json_t *val;
+
+	if (json_is_array(arr) && json_array_size(arr)) {
+		json_array_foreach(arr, i, val)
+			run.push_back(json_number_value(val));
+	} else {
+		run.push_back(fallback);
+	}
+	(cand ? m.cand : m.base).push_back(run);
+}
+
+static bool load_file(const char *path, bool cand)
+{
+	json_error_t err;
+	json_t *root = json_load_file(path, 0, &err), *arr, *val;
+	size_t i;
+
+	if (!root) {
+		fprintf(stderr, "%s: %s (line %d)\n", path, err.text, err.line);
+		return false;
+	}
+	if ((arr = json_object_get(root, "primitives")) != NULL) {
+		// verus-bench -j
+		json_array_foreach(arr, i, val) {
+			std::string name = std::string(json_string_value(json_object_get(val, "name"))) + "/" +
+				json_string_value(json_object_get(val, "backend")) + " ns";
+			add_run(name, false, cand, json_object_get(val, "ns_runs"),
+				json_number_value(json_object_get(val, "ns")));
+		}
+	} else if (json_object_get(root, "hashrate")) {
+		// --bench-json
+		add_run("hashrate", true, cand, json_object_get(root, "rates"),
+			json_number_value(json_object_get(root, "hashrate")));
+	} else if ((arr = json_object_get(root, "stages")) != NULL) {
+		// --bench-stratum --bench-json
+		const char *key;
+		json_object_foreach(arr, key, val)
+			add_run(std::string("stratum ") + key + " ns", false, cand, NULL,
+				json_number_value(json_object_get(val, "ns_median")));
+		add_run("stratum msgs/s", true, cand, NULL,
+			json_number_value(json_object_get(root, "msgs_per_sec")));
+	} else {
+		fprintf(stderr, "%s: not a benchmark result\n", path);
+		json_decref(root);
+		return false;
+	}
+	json_decref(root);
+	return true;
+}
+
+static double median(std::vector<double> v)
+{
+	size_t n = v.size();
+	if (!n)
+		return 0.;
+	std::sort(v.begin(), v.end());
+	return n & 1 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+static std::vector<double> run_values(const std::vector<run_samples> &runs)
+{
+	std::vector<double> v;
+	for (const run_samples &r : runs)
+		v.push_back(median(r));
+	return v;
+}
+
+/* P(U <= u) of the Mann-Whitney U without ties, counts of the rank sums */
+static double mann_whitney_cdf(int n1, int n2, int u)
+{
+	// c[i][j][k]: arrangements of i and j values with U = k
+	std::vector<std::vector<std::vector<double> > > c(n1 + 1,
+		std::vector<std::vector<double> >(n2 + 1, std::vector<double>(n1 * n2 + 1, 0.)));
+	double total = 0., below = 0.;
+
+	for (int i = 0; i <= n1; i++) {
+		for (int j = 0; j <= n2; j++) {
+			if (!i || !j) {
+				c[i][j][0] = 1.;
+				continue;
+			}
+			for (int k = 0; k <= i * j; k++)
+				c[i][j][k] = (k >= j ? c[i - 1][j][k - j] : 0.) + c[i][j - 1][k];
+		}
+	}
+	for (int k = 0; k <= n1 * n2; k++) {
+		total += c[n1][n2][k];
+		if (k <= u)
+			below += c[n1][n2][k];
+	}
+	return below / total;
+}
+
+/* two-sided p-value of the Mann-Whitney U test, exact for the small sets
+ * without ties, else the normal approximation with the tie correction */
+static double mann_whitney(const std::vector<double> &a, const std::vector<double> &b)
+{
+	std::vector<std::pair<double, int> > all;
+	double n1 = (double) a.size(), n2 = (double) b.size(), n = n1 + n2;
+	double r1 = 0., ties = 0., u, mu, sigma, z;
+
+	for (double x : a) all.push_back(std::make_pair(x, 0));
+	for (double x : b) all.push_back(std::make_pair(x, 1));
+	std::sort(all.begin(), all.end());
+	for (size_t i = 0; i < all.size(); ) {
+		size_t j = i;
+		while (j < all.size() && all[j].first == all[i].first)
+			j++;
+		double rank = 0.5 * (double) (i + j + 1), t = (double) (j - i);
+		for (size_t k = i; k < j; k++)
+			if (!all[k].second)
+				r1 += rank;
+		ties += t * t * t - t;
+		i = j;
+	}
+	u = r1 - n1 * (n1 + 1.) / 2.;
+	mu = n1 * n2 / 2.;
+
+	if (ties == 0. && a.size() + b.size() <= CMP_EXACT_MAX) {
+		// U is symmetric around mu, the tail of the smallest side
+		int lo = (int) (u < mu ? u : n1 * n2 - u);
+		return std::min(1., 2. * mann_whitney_cdf((int) a.size(), (int) b.size(), lo));
+	}
+	sigma = sqrt(n1 * n2 / 12. * ((n + 1.) - ties / (n * (n - 1.))));
+	if (sigma <= 0.)
+		return 1.;
+	z = (fabs(u - mu) - 0.5) / sigma;
+	return z <= 0. ? 1. : erfc(z / sqrt(2.));
+}
+
+/* median of the run values of a resample: the runs, then the samples of each run */
+static double resample_median(const std::vector<run_samples> &runs)
+{
+	std::vector<double> values(runs.size());
+	run_samples rs;
+
+	for (size_t r = 0; r < runs.size(); r++) {
+		const run_samples &run = runs[cmp_rand() % runs.size()];
+		rs.resize(run.size());
+		for (size_t i = 0; i < run.size(); i++)
+			rs[i] = run[cmp_rand() % run.size()];
+		values[r] = median(rs);
+	}
+	return median(values);
+}
+
+/* percentile interval of the relative change of the medians, in % */
+static void bootstrap(const std::vector<run_samples> &a, const std::vector<run_samples> &b, double *lo, double *hi)
+{
+	std::vector<double> changes;
+
+	for (int r = 0; r < opt_resamples; r++) {
+		double ma = resample_median(a);
+		double mb = resample_median(b);
+		if (ma != 0.)
+			changes.push_back(100. * (mb - ma) / ma);
+	}
+	if (changes.empty()) {
+		*lo = *hi = 0.;
+		return;
+	}
+	std::sort(changes.begin(), changes.end());
+	*lo = changes[(size_t) (opt_alpha / 2. * (changes.size() - 1))];
+	*hi = changes[(size_t) ((1. - opt_alpha / 2.) * (changes.size() - 1))];
+}
+
+/* smallest two-sided p of the test with these run counts, without ties */
+static double min_p(int n1, int n2)
+{
+	return n1 + n2 <= CMP_EXACT_MAX ? std::min(1., 2. * mann_whitney_cdf(n1, n2, 0)) : 0.;
+}
+
+static void compare()
+{
+	std::vector<metric *> tested;
+	int compared = 0;
+
+	// the holm correction of the compared metrics must leave p < alpha reachable
+	for (const std::string &name : order)
+		compared += !metrics[name].base.empty() && !metrics[name].cand.empty();
+	need_runs = opt_min_runs;
+	if (!need_runs) {
+		need_runs = 2;
+		while (need_runs < CMP_EXACT_MAX / 2 && min_p(need_runs, need_runs) * compared >= opt_alpha)
+			need_runs++;
+	}
+
+	for (const std::string &name : order) {
+		metric &m = metrics[name];
+		std::vector<double> base = run_values(m.base), cand = run_values(m.cand);
+		m.base_med = median(base);
+		m.cand_med = median(cand);
+		m.change = m.lo = m.hi = 0.;
+		m.p = m.p_holm = 1.;
+		if (m.base.empty() || m.cand.empty()) {
+			m.verdict = "missing";
+			continue;
+		}
+		if (m.base_med != 0.)
+			m.change = m.lo = m.hi = 100. * (m.cand_med - m.base_med) / m.base_med;
+		m.verdict = "n/a";
+		if ((int) m.base.size() < need_runs || (int) m.cand.size() < need_runs)
+			continue;
+		if (min_p((int) m.base.size(), (int) m.cand.size()) * compared >= opt_alpha) {
+			m.verdict = "underpowered";
+			continue;
+		}
+		m.p = mann_whitney(base, cand);
+		bootstrap(m.base, m.cand, &m.lo, &m.hi);
+		tested.push_back(&m);
+	}
+
+	// holm step-down, the adjusted p-values are kept monotonic
+	std::sort(tested.begin(), tested.end(), [](const metric *x, const metric *y) { return x->p < y->p; });
+	double prev = 0.;
+	for (size_t i = 0; i < tested.size(); i++) {
+		metric *m = tested[i];
+		m->p_holm = std::min(1., std::max(prev, m->p * (double) (tested.size() - i)));
+		prev = m->p_holm;
+	}
+
+	for (metric *m : tested) {
+		// in % of better (+) or worse (-)
+		double sign = m->higher_better ? 1. : -1.;
+		double gain = sign * m->change, glo = std::min(sign * m->lo, sign * m->hi);
+		double ghi = std::max(sign * m->lo, sign * m->hi);
+		if (m->p_holm < opt_alpha && ghi < 0. && -gain >= opt_threshold)
+			m->verdict = "REGRESSION";
+		else if (m->p_holm < opt_alpha && glo > 0. && gain >= opt_threshold)
+			m->verdict = "improvement";
+		else
+			m->verdict = "same";
+	}
+}
+
+static int report()
+{
+	int regressions = 0, unchecked = 0;
+
+	for (const std::string &name : order) {
+		const char *v = metrics[name].verdict;
+		regressions += !strcmp(v, "REGRESSION");
+		unchecked += !strcmp(v, "missing") || !strcmp(v, "n/a") || !strcmp(v, "underpowered");
+	}
+
+	if (opt_json) {
+		json_t *root = json_object(), *arr = json_array();
+		for (const std::string &name : order) {
+			metric &m = metrics[name];
+			json_t *o = json_object();
+			json_object_set_new(o, "metric", json_string(name.c_str()));
+			json_object_set_new(o, "higher_better", json_boolean(m.higher_better));
+			json_object_set_new(o, "base_runs", json_integer((json_int_t) m.base.size()));
+			json_object_set_new(o, "new_runs", json_integer((json_int_t) m.cand.size()));
+			json_object_set_new(o, "base_median", json_real(m.base_med));
+			json_object_set_new(o, "new_median", json_real(m.cand_med));
+			json_object_set_new(o, "change_pct", json_real(m.change));
+			json_object_set_new(o, "ci_low_pct", json_real(m.lo));
+			json_object_set_new(o, "ci_high_pct", json_real(m.hi));
+			json_object_set_new(o, "p", json_real(m.p));
+			json_object_set_new(o, "p_holm", json_real(m.p_holm));
+			json_object_set_new(o, "verdict", json_string(m.verdict));
+			json_array_append_new(arr, o);
+		}
+		json_object_set_new(root, "alpha", json_real(opt_alpha));
+		json_object_set_new(root, "threshold_pct", json_real(opt_threshold));
+		json_object_set_new(root, "min_runs", json_integer(need_runs));
+		json_object_set_new(root, "resamples", json_integer(opt_resamples));
+		json_object_set_new(root, "metrics", arr);
+		json_object_set_new(root, "regressions", json_integer(regressions));
+		json_object_set_new(root, "unchecked", json_integer(unchecked));
+		char *s = json_dumps(root, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+		if (s) {
+			printf("%s\n", s);
+			free(s);
+		}
+		json_decref(root);
+	} else {
+		printf("%-28s %5s %5s %14s %14s %8s %20s %8s  %s\n", "metric", "base", "new", "base median",
+			"new median", "change", "ci (1-alpha)", "p holm", "verdict");
+		for (const std::string &name : order) {
+			metric &m = metrics[name];
+			char ci[32];
+			snprintf(ci, sizeof(ci), "[%+.2f%%, %+.2f%%]", m.lo, m.hi);
+			printf("%-28s %5zu %5zu %14.4g %14.4g %+7.2f%% %20s %8.4f  %s\n", name.c_str(), m.base.size(),
+				m.cand.size(), m.base_med, m.cand_med, m.change, ci, m.p_holm, m.verdict);
+		}
+		printf("\n%d regression%s, %d not compared (alpha %g, threshold %g%%, %d runs min, %d resamples)\n",
+			regressions, regressions == 1 ? "" : "s", unchecked, opt_alpha, opt_threshold, need_runs,
+			opt_resamples);
+	}
+	return regressions ? 1 : unchecked ? 2 : 0;
+}
+
+static void usage()
+{
+	printf("usage: verus-benchcmp [-a alpha] [-t pct] [-m runs] [-B resamples] [-s seed] [-j]\n"
+		"                      -b base.json [-b ...] -n new.json [-n ...]\n"
+		"  -b  a run of the reference build (--bench-json, verus-bench -j, --bench-stratum)\n"
+		"  -n  a run of the build to check, same kind\n"
+		"  -a  significance level, for the tests and the intervals (default 0.05)\n"
+		"  -t  smallest change reported, in %% (default 1)\n"
+		"  -m  runs needed on each side to compare a metric (default: enough to reach alpha)\n"
+		"  -B  bootstrap resamples (default 2000)\n"
+		"  -s  bootstrap seed\n"
+		"  -j  json output\n"
+		"exit code 1 on a regression, 2 if a metric is not compared\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int key, nbase = 0, ncand = 0;
+
+	while ((key = getopt(argc, argv, "b:n:a:t:m:B:s:jh")) != -1) {
+		switch (key) {
+		case 'b':
+		case 'n':
+			if (!load_file(optarg, key == 'n'))
+				return 2;
+			if (key == 'b')
+				nbase++;
+			else
+				ncand++;
+			break;
+		case 'a':
+			opt_alpha = atof(optarg);
+			if (opt_alpha <= 0. || opt_alpha >= 1.) {
+				fprintf(stderr, "alpha must be between 0 and 1\n");
+				return 2;
+			}
+			break;
+		case 't':
+			opt_threshold = std::max(atof(optarg), 0.);
+			break;
+		case 'm':
+			opt_min_runs = std::max(atoi(optarg), 2);
+			break;
+		case 'B':
+			opt_resamples = atoi(optarg);
+			if (opt_resamples < 100) {
+				fprintf(stderr, "at least 100 resamples\n");
+				return 2;
+			}
+			break;
+		case 's':
+			opt_seed = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			opt_json = true;
+			break;
+		default:
+			usage();
+			return key == 'h' ? 0 : 2;
+		}
+	}
+	if (!nbase || !ncand) {
+		usage();
+		return 2;
+	}
+
+	rand_state = opt_seed ? opt_seed : 1;
+	compare();
+	return report();
+}
@@ -0,0 +1,385 @@
+/**
+ * Known answers and differential check of the verus 2.2 backends
+ * (verus-bench -k, verus-bench -f nonces, make check)
+ *
+ * The haraka functions of each backend are first checked with the test
+ * vectors of the haraka v2 reference implementation, the keyed ones with
+ * the standard round constants as key. The reference is the miner path
+ * (verusscan.h, aes-ni haraka and verusclhashv2_2), checked with recorded
+ * vectors. Each other backend runs the hash with its own haraka and clhash
+ * functions and its own key, the fuzzer compares the clhash intermediate,
+ * the hash and the key after FixKey with the reference on random jobs and
+ * nonces, and stops on the first divergence.
+ *
+ * The miner only computes the last 32-bit word of the hash (the target
+ * check, see haraka512_keyed), so it is the compared part of the hash for
+ * the miner path. The backends with the whole hash (full) are compared on
+ * the 32 bytes, with the vectors and with each other.
+ */
+#include <ccminer-config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "verusscan.h"
+
+#define CHECK_JOB_NONCES 1024
+
+struct check_backend {
+	struct verus_backend fn;
+	bool full;         /* whole 256-bit hash, else only the last word */
+};
+
+/* the new kernels are added here, the reference is not in the list */
+static const struct check_backend backends[] = {
+	{ { "portable", haraka512_port, haraka256_port, haraka512_port_keyed, verusclhashv2_2 }, true },
+	{ { "stats",    haraka512,      haraka256,      haraka512_keyed,      verusclhashv2_2_stats }, false },
+	{ { "full",     haraka512,      haraka256,      haraka512_keyed_full, verusclhashv2_2 }, true },
+};
+
+#define BACKENDS (int) (sizeof(backends) / sizeof(backends[0]))
+
+static const struct check_backend reference = {
+	{ "ref", haraka512, haraka256, haraka512_keyed, verusclhashv2_2 }, false
+};
+
+/* haraka v2 reference implementation, input 0x00, 0x01 ... 0x3f */
+static const uint8_t haraka512_vector[32] = {
+	0xbe, 0x7f, 0x72, 0x3b, 0x4e, 0x80, 0xa9, 0x98, 0x13, 0xb2, 0x92, 0x28, 0x7f, 0x30, 0x6f, 0x62,
+	0x5a, 0x6d, 0x57, 0x33, 0x1c, 0xae, 0x5f, 0x34, 0xdd, 0x92, 0x77, 0xb0, 0x94, 0x5b, 0xe2, 0xaa
+};
+static const uint8_t haraka256_vector[32] = {
+	0x80, 0x27, 0xcc, 0xb8, 0x79, 0x49, 0x77, 0x4b, 0x78, 0xd0, 0x54, 0x5f, 0xb7, 0x2b, 0xf7, 0x0c,
+	0x69, 0x5c, 0x2a, 0x09, 0x23, 0xcb, 0xd4, 0x7b, 0xba, 0x11, 0x59, 0xef, 0xbf, 0x2b, 0x2c, 0x1c
+};
+
+struct verus_kat {
+	uint32_t seed;     /* of the header and solution bytes */
+	uint8_t version;   /* solution[0] */
+	uint8_t pbaas;     /* solution[5], merged mining layout if > 0 */
+	uint32_t nonce;    /* nonce space bytes 11-14 */
+	uint64_t intermediate;
+	const char *hash;  /* hex of the 32 bytes, the miner path has the last 4 */
+};
+
+/* recorded with the miner path and the full backends */
+static const struct verus_kat kat_vectors[] = {
+	{ 0x56525553, 7, 1, 0x00000000, 0xf66e43518438b042ULL,
+	  "c3b838a92a44047cf7bef86c291d9bd134ae0099bc5c5342df67f6c65d235154" },
+	{ 0x56525553, 7, 1, 0x00000001, 0xeaea7cd34d29d649ULL,
+	  "64880d2d27b39e0afb2a2b64ff4d946ab98af6b15bc36c892e9df0068a418839" },
+	{ 0x56525553, 7, 0, 0x0badcafe, 0x05816a5de46740ccULL,
+	  "170d92f2de5917c97ffc21a0bab0882f40581c04238278548a5c29892b1dee8c" },
+	{ 0x00000001, 7, 1, 0xffffffff, 0xa467e60ec28da55eULL,
+	  "40bda30a7b6e44924edc72bd786ed70144be668cba92005b61d9f9ce77145b5c" },
+	{ 0x9e3779b9, 7, 2, 0x12345678, 0x399c78346cccf77fULL,
+	  "b60ef08dce6c744754d40fb6c6596d797348841b7e58e8809f205b418c7ff3bd" },
+	{ 0xdeadbeef, 6, 0, 0x00010000, 0x1e9a632ba847e2c8ULL,
+	  "74d00fe2eb318ce25b5e7bbb9496905ef50f440d8919a823d03a6db171552c7d" },
+	{ 0x13579bdf, 8, 1, 0x80000000, 0x763f572d76bd43deULL,
+	  "928781bcfefad5db431c631867f525c9d2bd5ec54828126b9ab44e6174147afd" },
+	{ 0x2468ace0, 7, 1, 0x0000ffff, 0x29af71487f38eb49ULL,
+	  "fb3a4b50127f7202ba8f23b2ff1cec0cc13913b00f6597cbdf9d6f53b1e5492e" },
+};
+
+struct verus_state {
+	u128 *key;
+	u128 *prand;
+	u128 *prandex;
+	uint32_t fixrand[32];
+	uint32_t fixrandex[32];
+	alignas(32) unsigned char half[64];
+	alignas(32) uint32_t hash[8];
+};
+
+struct check_job {
+	uint32_t data[35];
+	uint8_t solution[1344];
+	uint8_t full_data[140 + 3 + 1344];
+	uint8_t nonce[15];
+};
+
+static uint32_t check_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void check_job_init(struct check_job *job, uint32_t seed, uint8_t version, uint8_t pbaas)
+{
+	memset(job, 0, sizeof(*job));
+	if (!seed) seed = 1;
+	for (int i = 0; i < 35; i++)
+		job->data[i] = check_rand(&seed);
+	job->data[0] = 4;
+	for (int i = 0; i < 1344; i++)
+		job->solution[i] = (uint8_t) check_rand(&seed);
+	job->solution[0] = version;
+	memset(&job->solution[1], 0, 4);
+	job->solution[5] = pbaas;
+	job->solution[6] = job->solution[7] = 0;
+	VerusPrepareData(job->full_data, job->nonce, job->data, job->solution);
+}
+
+static void check_set_nonce(struct check_job *job, uint32_t nonce)
+{
+	memcpy(&job->nonce[11], &nonce, 4);
+}
+
+static bool state_alloc(struct verus_state *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->key = (u128 *) alloc_aligned_buffer(VERUS_KEY_SIZE + 1024);
+	if (!st->key)
+		return false;
+	st->prand = st->key + VERUS_KEY_SIZE128;
+	st->prandex = st->key + VERUS_KEY_SIZE128 + 32;
+	return true;
+}
+
+/* clhash result, kept by the hash in the half buffer (curBuf) */
+static uint64_t state_intermediate(struct verus_state *st)
+{
+	uint64_t v = st->half[47];
+	for (int i = 1; i < 8; i++)
+		v |= (uint64_t) st->half[47 + i] << (8 * i);
+	return v;
+}
+
+static void ref_job(struct verus_state *st, struct check_job *job)
+{
+	VerusHashHalf(st->half, job->full_data, (int) sizeof(job->full_data));
+	GenNewCLKey(st->half, st->key);
+}
+
+static void ref_hash(struct verus_state *st, struct check_job *job)
+{
+	uint8_t gpuinit = 0;
+	Verus2hash((unsigned char *) st->hash, st->half, job->nonce, st->key, &gpuinit, st->fixrand, st->fixrandex,
+		st->prand, st->prandex, job->solution[0], NULL);
+}
+
+static void bk_job(const struct verus_backend *b, struct verus_state *st, struct check_job *job)
+{
+	VerusHashHalfBackend(b, st->half, job->full_data, (int) sizeof(job->full_data));
+	GenNewCLKeyBackend(b, st->half, st->key);
+}
+
+static void bk_hash(const struct verus_backend *b, struct verus_state *st, struct check_job *job)
+{
+	Verus2hashBackend(b, (unsigned char *) st->hash, st->half, job->nonce, st->key, st->fixrand,
+		st->fixrandex, st->prand, st->prandex);
+}
+
+static void to_hex(char *out, const void *in, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) in;
+	for (size_t i = 0; i < len; i++)
+		sprintf(&out[i * 2], "%02x", p[i]);
+}
+
+static void from_hex(uint8_t *out, const char *hex, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		unsigned int v = 0;
+		sscanf(&hex[i * 2], "%2x", &v);
+		out[i] = (uint8_t) v;
+	}
+}
+
+/* 0 if the 32 bytes are the expected ones, only the last word if not full */
+static int check_bytes(const char *what, const char *name, bool full, const uint8_t *out,
+	const uint8_t *expected)
+{
+	char h1[65], h2[65];
+	int from = full ? 0 : 28;
+
+	if (!memcmp(&out[from], &expected[from], 32 - from))
+		return 0;
+	to_hex(h1, &out[from], 32 - from);
+	to_hex(h2, &expected[from], 32 - from);
+	fprintf(stderr, "%s (%s): %s, expected %s\n", what, name, h1, h2);
+	return 1;
+}
+
+/* haraka v2 test vectors on the haraka functions of a backend */
+static int check_haraka(const struct check_backend *b)
+{
+	alignas(32) uint8_t in[64], out[32];
+	int failed = 0;
+
+	for (int i = 0; i < 64; i++)
+		in[i] = (uint8_t) i;
+	b->fn.haraka512(out, in);
+	failed += check_bytes("haraka512", b->fn.name, true, out, haraka512_vector);
+	b->fn.haraka256(out, in);
+	failed += check_bytes("haraka256", b->fn.name, true, out, haraka256_vector);
+	// the standard round constants as key (load_constants), same as haraka512
+	memset(out, 0, sizeof(out));
+	b->fn.haraka512_keyed(out, in, rc);
+	failed += check_bytes("haraka512_keyed", b->fn.name, b->full, out, haraka512_vector);
+	return failed;
+}
+
+/* 0 if the results and the keys are the same, else prints the state
+ * full is the state of the first full backend, to compare the 32 bytes */
+static int check_compare(const struct check_backend *b, struct verus_state *ref, struct verus_state *st,
+	struct verus_state *full, uint32_t seed, uint32_t nonce)
+{
+	char k1[65], k2[65];
+	bool same_hash = ref->hash[7] == st->hash[7] && state_intermediate(ref) == state_intermediate(st);
+	int kidx = -1;
+
+	if (b->full && full && full != st)
+		same_hash = same_hash && !memcmp(full->hash, st->hash, 32);
+	for (int i = 0; i < VERUS_KEY_SIZE128; i++) {
+		if (memcmp(&ref->key[i], &st->key[i], 16)) {
+			kidx = i;
+			break;
+		}
+	}
+	if (same_hash && kidx < 0)
+		return 0;
+
+	fprintf(stderr, "%s diverges, job seed %08x nonce %08x\n", b->fn.name, seed, nonce);
+	fprintf(stderr, "  intermediate ref %016llx %s %016llx\n", (unsigned long long) state_intermediate(ref),
+		b->fn.name, (unsigned long long) state_intermediate(st));
+	fprintf(stderr, "  hash[7] ref %08x %s %08x\n", ref->hash[7], b->fn.name, st->hash[7]);
+	if (b->full && full && full != st) {
+		to_hex(k1, full->hash, 32);
+		to_hex(k2, st->hash, 32);
+		int f = 0;
+		while (!backends[f].full)
+			f++;
+		fprintf(stderr, "  hash %s %s %s %s\n", backends[f].fn.name, k1, b->fn.name, k2);
+	}
+	if (kidx >= 0) {
+		to_hex(k1, &ref->key[kidx], 16);
+		to_hex(k2, &st->key[kidx], 16);
+		fprintf(stderr, "  key[%d] after FixKey ref %s %s %s\n", kidx, k1, b->fn.name, k2);
+	}
+	for (int i = 0; i < 32; i++) {
+		if (st->fixrand[i] != ref->fixrand[i] || st->fixrandex[i] != ref->fixrandex[i]) {
+			fprintf(stderr, "  clhash round %d key indexes ref %u/%u %s %u/%u\n", i, ref->fixrand[i],
+				ref->fixrandex[i], b->fn.name, st->fixrand[i], st->fixrandex[i]);
+			break;
+		}
+	}
+	return 1;
+}
+
+/* haraka vectors, then the recorded vectors on the reference and on each backend */
+int verus_check_kat()
+{
+	struct verus_state st;
+	struct check_job job;
+	int failed = 0, count = (int) (sizeof(kat_vectors) / sizeof(kat_vectors[0]));
+
+	if (!state_alloc(&st))
+		return 1;
+	load_constants();
+	load_constants_port();
+
+	failed += check_haraka(&reference);
+	for (int b = 0; b < BACKENDS; b++)
+		failed += check_haraka(&backends[b]);
+
+	for (int v = 0; v < count; v++) {
+		const struct verus_kat *kat = &kat_vectors[v];
+		uint8_t expected[32];
+		char what[16];
+		from_hex(expected, kat->hash, 32);
+		snprintf(what, sizeof(what), "kat %d", v);
+		check_job_init(&job, kat->seed, kat->version, kat->pbaas);
+		check_set_nonce(&job, kat->nonce);
+		for (int b = -1; b < BACKENDS; b++) {
+			const struct check_backend *bk = b < 0 ? &reference : &backends[b];
+			if (b < 0) {
+				ref_job(&st, &job);
+				ref_hash(&st, &job);
+			} else {
+				bk_job(&bk->fn, &st, &job);
+				bk_hash(&bk->fn, &st, &job);
+			}
+			if (state_intermediate(&st) != kat->intermediate) {
+				fprintf(stderr, "%s (%s): intermediate %016llx, expected %016llx\n", what, bk->fn.name,
+					(unsigned long long) state_intermediate(&st), (unsigned long long) kat->intermediate);
+				failed++;
+			}
+			failed += check_bytes(what, bk->fn.name, bk->full, (uint8_t *) st.hash, expected);
+		}
+	}
+	free(st.key);
+	printf("kat: haraka and %d vectors, %d backends, %d failed\n", count, BACKENDS + 1, failed);
+	return failed ? 1 : 0;
+}
+
+/* random jobs and nonces, each backend against the reference */
+int verus_check_fuzz(uint64_t nonces, uint32_t seed)
+{
+	struct verus_state ref, st[BACKENDS], *full = NULL;
+	struct check_job job;
+	uint32_t rnd = seed ? seed : 1;
+	uint64_t done = 0;
+	int rc = 0;
+
+	if (!state_alloc(&ref))
+		return 1;
+	for (int b = 0; b < BACKENDS; b++) {
+		if (!state_alloc(&st[b]))
+			return 1;
+		if (backends[b].full && !full)
+			full = &st[b];
+	}
+	load_constants();
+	load_constants_port();
+
+	printf("fuzz: %llu nonces, %d backends, seed %08x\n", (unsigned long long) nonces, BACKENDS, seed);
+	fflush(stdout);
+	while (done < nonces && !rc) {
+		uint32_t job_seed = check_rand(&rnd);
+		check_job_init(&job, job_seed, 7, (uint8_t) (check_rand(&rnd) & 1));
+		for (int i = 0; i < 11; i++)
+			job.nonce[i] = (uint8_t) check_rand(&rnd);
+		ref_job(&ref, &job);
+		for (int b = 0; b < BACKENDS; b++)
+			bk_job(&backends[b].fn, &st[b], &job);
+
+		for (int n = 0; n < CHECK_JOB_NONCES && done < nonces && !rc; n++, done++) {
+			uint32_t nonce = check_rand(&rnd);
+			check_set_nonce(&job, nonce);
+			ref_hash(&ref, &job);
+			for (int b = 0; b < BACKENDS; b++)
+				bk_hash(&backends[b].fn, &st[b], &job);
+			for (int b = 0; b < BACKENDS && !rc; b++)
+				rc = check_compare(&backends[b], &ref, &st[b], full, job_seed, nonce);
+		}
+		if (!(done % (1ULL << 20)) && done)
+			printf("fuzz: %llu nonces\n", (unsigned long long) done);
+	}
+	if (!rc)
+		printf("fuzz: %llu nonces, no divergence\n", (unsigned long long) done);
+
+	free(ref.key);
+	for (int b = 0; b < BACKENDS; b++)
+		free(st[b].key);
+	return rc;
+}
+
+#ifdef VERUS_CHECK_MAIN
+/* make check, the vectors and a short fuzz with a fixed seed */
+int main(int argc, char *argv[])
+{
+	if (!IsCPUVerusOptimized()) {
+		printf("no aes-ni/avx, skipped\n");
+		return 77;
+	}
+	if (verus_check_kat())
+		return 1;
+	return verus_check_fuzz(1 << 16, 0x56525553) ? 1 : 0;
+}
+#endif
@@ -0,0 +1,108 @@
+/**
+ * libverushash, the hash of scanhash_verus for one nonce at a time with
+ * the whole 256-bit result (see verushash.h)
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "verusscan.h"
+#include "verushash.h"
+
+struct verushash_ctx {
+	alignas(32) u128 key[VERUS_KEY_SIZE128 + 64]; // the key and the 2x32 saved lines of FixKey
+	alignas(32) unsigned char half[64];
+	uint32_t fixrand[32];
+	uint32_t fixrandex[32];
+};
+
+static const struct verus_backend native = {
+	"native", haraka512, haraka256, haraka512_keyed_full, verusclhashv2_2
+};
+
+static volatile bool initialized = false;
+
+int verushash_init(void)
+{
+	if (!IsCPUVerusOptimized())
+		return VERUSHASH_ERR_CPU;
+	if (!initialized) {
+		load_constants();
+		initialized = true;
+	}
+	return VERUSHASH_OK;
+}
+
+verushash_ctx *verushash_ctx_new(void)
+{
+	verushash_ctx *ctx = NULL;
+#ifdef _MSC_VER
+	ctx = (verushash_ctx *) _aligned_malloc(sizeof(*ctx), 32);
+#else
+	if (posix_memalign((void **) &ctx, 32, sizeof(*ctx)))
+		return NULL;
+#endif
+	if (ctx)
+		memset(ctx, 0, sizeof(*ctx));
+	return ctx;
+}
+
+void verushash_ctx_free(verushash_ctx *ctx)
+{
+#ifdef _MSC_VER
+	_aligned_free(ctx);
+#else
+	free(ctx);
+#endif
+}
+
+void verushash_ctx_prepare(verushash_ctx *ctx, const uint8_t *header, const uint8_t *solution)
+{
+	alignas(32) uint8_t full_data[VERUSHASH_HEADER_SIZE + 3 + VERUSHASH_SOLUTION_SIZE];
+	alignas(4) uint32_t pdata[VERUSHASH_HEADER_SIZE / 4];
+	uint8_t nonceSpace[VERUSHASH_NONCE_SIZE]; // the nonce is given to verushash_ctx_hash()
+
+	memcpy(pdata, header, sizeof(pdata));
+	VerusPrepareData(full_data, nonceSpace, pdata, solution);
+	VerusHashHalfBackend(&native, ctx->half, full_data, (int) sizeof(full_data));
+	GenNewCLKeyBackend(&native, ctx->half, ctx->key);
+}
+
+void verushash_ctx_hash(verushash_ctx *ctx, const uint8_t *nonce, uint8_t *hash)
+{
+	// Verus2hash fills the second half of the buffer, the first one is kept
+	alignas(32) unsigned char curBuf[64];
+
+	memcpy(curBuf, ctx->half, 64);
+	Verus2hashBackend(&native, hash, curBuf, nonce, ctx->key, ctx->fixrand, ctx->fixrandex,
+		ctx->key + VERUS_KEY_SIZE128, ctx->key + VERUS_KEY_SIZE128 + 32);
+}
+
+void verushash_ctx_hash_batch(verushash_ctx *ctx, const uint8_t *nonces, size_t n, uint8_t *hashes)
+{
+	for (size_t i = 0; i < n; i++)
+		verushash_ctx_hash(ctx, &nonces[i * VERUSHASH_NONCE_SIZE], &hashes[i * VERUSHASH_HASH_SIZE]);
+}
+
+int verushash_ctx_verify(verushash_ctx *ctx, const uint8_t *nonce, const uint8_t *target, uint8_t *hash)
+{
+	uint8_t buf[VERUSHASH_HASH_SIZE];
+	uint8_t *h = hash ? hash : buf;
+
+	verushash_ctx_hash(ctx, nonce, h);
+	for (int i = VERUSHASH_HASH_SIZE - 1; i >= 0; i--) {
+		if (h[i] != target[i])
+			return h[i] < target[i];
+	}
+	return 1;
+}
+
+int verushash(const uint8_t *header, const uint8_t *solution, uint8_t *hash)
+{
+	verushash_ctx ctx;
+
+	if (!initialized && verushash_init() != VERUSHASH_OK)
+		return VERUSHASH_ERR_CPU;
+	verushash_ctx_prepare(&ctx, header, solution);
+	verushash_ctx_hash(&ctx, &solution[VERUSHASH_SOLUTION_SIZE - VERUSHASH_NONCE_SIZE], hash);
+	return VERUSHASH_OK;
+}
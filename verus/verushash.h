@@ -0,0 +1,60 @@
+/**
+ * libverushash, the verus 2.2 hash of the miner for the pool side tools
+ * (make libverushash.a)
+ *
+ * A context holds the per job precompute (the hash of the header and the
+ * solution, and the clhash key), then each nonce only costs the clhash and
+ * the last haraka. A context is used by one thread at a time, the contexts
+ * are independent and nothing is allocated after verushash_ctx_new().
+ *
+ * The hashes and the targets are 256-bit little endian numbers (uint256),
+ * the nonce is the 15 bytes nonce space at the end of the solution. Like
+ * the miner, all the solution versions are hashed with verus 2.2.
+ */
+#ifndef VERUSHASH_H
+#define VERUSHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VERUSHASH_HEADER_SIZE   140   /* block header, nonce included */
+#define VERUSHASH_SOLUTION_SIZE 1344  /* without the compact size (fd4005) */
+#define VERUSHASH_NONCE_SIZE    15
+#define VERUSHASH_HASH_SIZE     32
+
+#define VERUSHASH_OK            0
+#define VERUSHASH_ERR_CPU      -1     /* no aes-ni/avx */
+
+typedef struct verushash_ctx verushash_ctx;
+
+/* checks the cpu and loads the constants, once before the other calls */
+int verushash_init(void);
+
+/* NULL if out of memory */
+verushash_ctx *verushash_ctx_new(void);
+void verushash_ctx_free(verushash_ctx *ctx);
+
+/* a new job, the merged mining layout (pbaas headers) is cleared like the daemon does */
+void verushash_ctx_prepare(verushash_ctx *ctx, const uint8_t *header, const uint8_t *solution);
+
+void verushash_ctx_hash(verushash_ctx *ctx, const uint8_t *nonce, uint8_t *hash);
+
+/* n nonces of VERUSHASH_NONCE_SIZE bytes, n hashes of VERUSHASH_HASH_SIZE bytes */
+void verushash_ctx_hash_batch(verushash_ctx *ctx, const uint8_t *nonces, size_t n, uint8_t *hashes);
+
+/* 1 if the hash is under or equal to the target, hash can be NULL */
+int verushash_ctx_verify(verushash_ctx *ctx, const uint8_t *nonce, const uint8_t *target, uint8_t *hash);
+
+/* one shot of a header and a solution with its nonce space, no allocation,
+ * VERUSHASH_ERR_CPU if verushash_init() failed */
+int verushash(const uint8_t *header, const uint8_t *solution, uint8_t *hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VERUSHASH_H */
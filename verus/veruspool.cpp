@@ -0,0 +1,655 @@
+/**
+ * Loopback verus stratum pool (make verus-pool)
+ *
+ * Speaks the stratum dialect of the verus pools (set_target, notify with
+ * the 1344 bytes solution, submit with the nonce and the solution) to any
+ * number of local miners. A job is sent every -j seconds and a new block
+ * (clean job) every -b jobs. Each share is hashed again with libverushash
+ * (verushash.h) and checked on the whole 256-bit target, like the daemon
+ * (it was the last target word before libverushash, the only word of the
+ * miner path). The miner only checks the last word, a share equal on it
+ * can be low.
+ *
+ * Latency (-l), disconnections (-x), client.reconnect (-r) can be injected
+ * to test the failover and the job switch, client.show_message gives the
+ * block height. The accepted, stale, duplicate, low difficulty and invalid
+ * shares are reported every -i seconds and at the exit, the exit code is 1
+ * if a share was invalid or under the target.
+ *
+ * usage: verus-pool [-p port] [-d diff] [-j secs] [-b jobs] [-n] [-l ms]
+ *                   [-x secs] [-r secs] [-i secs] [-T secs] [-v]
+ */
+#include <ccminer-config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <set>
+#include <algorithm>
+#include <jansson.h>
+
+#include "verushash.h"
+
+#define POOL_JOBS     16   /* kept for the submits, the older ones are stale */
+#define POOL_POLL_MS  20
+#define POOL_LINE_MAX (16 * 1024)
+
+struct pool_job {
+	uint32_t id;
+	uint32_t block;
+	uint32_t header[35];   /* 140 bytes, without the nonce */
+	uint8_t solution[1344];
+	char notify[4096];     /* params of mining.notify, clean flag as %s */
+};
+
+struct pool_stats {
+	uint64_t shares;
+	uint64_t accepted;
+	uint64_t stale;
+	uint64_t duplicate;
+	uint64_t lowdiff;
+	uint64_t invalid;
+};
+
+struct pool_client {
+	int sock;
+	int id;
+	uint8_t xnonce1[4];
+	bool authorized;
+	uint32_t job_sent;
+	uint32_t block;
+	time_t connected, reconnect;
+	std::set<uint64_t> submitted;  /* of the current block */
+	char buf[POOL_LINE_MAX];
+	size_t blen;
+	verushash_ctx *vh;
+};
+
+static int opt_port = 3334;
+static double opt_diff = 1.;
+static double opt_job_secs = 10.;
+static int opt_block_jobs = 1;
+static bool opt_merged = true;
+static int opt_latency = 0;     /* ms */
+static int opt_drop = 0;        /* secs */
+static int opt_reconnect = 0;   /* secs */
+static int opt_report = 10;     /* secs */
+static int opt_duration = 0;    /* secs */
+static bool opt_verbose = false;
+
+static volatile bool pool_stop = false;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_job jobs[POOL_JOBS];
+static uint32_t job_seq = 0, block_seq = 0;
+static struct pool_stats stats;
+static int clients = 0, connections = 0;
+static uint64_t jobs_sent = 0;
+
+static uint8_t target_be[32];   /* as sent */
+static uint8_t target_le[32];   /* compared with the hash */
+static char target_hex[65];
+
+static uint32_t rand_state = 0x56525553;
+
+static uint32_t pool_rand()
+{
+	uint32_t x = rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return rand_state = x;
+}
+
+static void to_hex(char *out, const void *in, size_t len)
+{
+	static const char hexd[] = "0123456789abcdef";
+	const uint8_t *p = (const uint8_t *) in;
+	for (size_t i = 0; i < len; i++) {
+		out[i * 2] = hexd[p[i] >> 4];
+		out[i * 2 + 1] = hexd[p[i] & 0xf];
+	}
+	out[len * 2] = '\0';
+}
+
+static bool from_hex(uint8_t *out, const char *hex, size_t len)
+{
+	if (!hex || strlen(hex) != len * 2)
+		return false;
+	for (size_t i = 0; i < len; i++) {
+		unsigned int v;
+		if (sscanf(&hex[i * 2], "%2x", &v) != 1)
+			return false;
+		out[i] = (uint8_t) v;
+	}
+	return true;
+}
+
+static void pool_log(const char *fmt, ...)
+{
+	char tm[16];
+	time_t now = time(NULL);
+	va_list ap;
+	strftime(tm, sizeof(tm), "%H:%M:%S", localtime(&now));
+	printf("[%s] ", tm);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	fflush(stdout);
+}
+
+/* the verus share target: diff 1 is 0f0f0f (nbits exponent 0x20) */
+static void diff_to_target(double diff)
+{
+	double t = (double) 0x0f0f0f / diff, frac;
+	uint64_t ip = t >= (double) 0xffffff ? 0xffffff : (uint64_t) t;
+
+	target_be[0] = (uint8_t) (ip >> 16);
+	target_be[1] = (uint8_t) (ip >> 8);
+	target_be[2] = (uint8_t) ip;
+	frac = t - (double) ip;
+	for (int i = 3; i < 32; i++) {
+		frac *= 256.;
+		target_be[i] = (uint8_t) frac;
+		frac -= target_be[i];
+	}
+	for (int i = 0; i < 32; i++)
+		target_le[i] = target_be[31 - i];
+	to_hex(target_hex, target_be, 32);
+}
+
+/* a new job, on the current or a new block */
+static void pool_new_job(bool clean)
+{
+	struct pool_job *job;
+	char version[9], prevhash[65], merkle[65], reserved[65], ntime[9], nbits[9];
+	char *sol = (char *) malloc(1344 * 2 + 1);
+	uint32_t now = (uint32_t) time(NULL), bits = 0x200f0f0f;
+
+	pthread_mutex_lock(&pool_lock);
+	if (clean)
+		block_seq++;
+	job_seq++;
+	job = &jobs[job_seq % POOL_JOBS];
+	if (clean || job_seq == 1) {
+		// prevhash of the block, kept by the jobs of the block
+		for (int i = 1; i < 9; i++)
+			job->header[i] = pool_rand();
+	} else {
+		memcpy(&job->header[1], &jobs[(job_seq - 1) % POOL_JOBS].header[1], 32);
+	}
+	job->id = job_seq;
+	job->block = block_seq;
+	job->header[0] = 4;
+	for (int i = 9; i < 25; i++)
+		job->header[i] = pool_rand();  // merkle root and final sapling root
+	memcpy(&job->header[25], &now, 4);
+	memcpy(&job->header[26], &bits, 4);
+	memset(&job->header[27], 0, 32);
+	for (int i = 0; i < 1344; i++)
+		job->solution[i] = (uint8_t) pool_rand();
+	memset(job->solution, 0, 8);
+	job->solution[0] = 7;
+	job->solution[5] = opt_merged ? 1 : 0;
+	memset(&job->solution[1344 - 15], 0, 15);  // nonce space
+
+	to_hex(version, &job->header[0], 4);
+	to_hex(prevhash, &job->header[1], 32);
+	to_hex(merkle, &job->header[9], 32);
+	to_hex(reserved, &job->header[17], 32);
+	to_hex(ntime, &job->header[25], 4);
+	to_hex(nbits, &job->header[26], 4);
+	to_hex(sol, job->solution, 1344);
+	snprintf(job->notify, sizeof(job->notify), "[\"%x\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",%%s,\"%s\"]",
+		job->id, version, prevhash, merkle, reserved, ntime, nbits, sol);
+	pthread_mutex_unlock(&pool_lock);
+	free(sol);
+}
+
+static bool client_send(struct pool_client *c, const char *line)
+{
+	size_t len = strlen(line), sent = 0;
+	if (opt_latency)
+		usleep(opt_latency * 1000);
+	if (opt_verbose)
+		pool_log("%d > %.160s", c->id, line);
+	while (sent < len) {
+		ssize_t n = send(c->sock, line + sent, len - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return send(c->sock, "\n", 1, MSG_NOSIGNAL) == 1;
+}
+
+static bool client_answer(struct pool_client *c, json_t *id, bool result, int code, const char *msg)
+{
+	char *ids = json_dumps(id, JSON_COMPACT | JSON_ENCODE_ANY);
+	char line[256];
+	bool ret;
+	if (result)
+		snprintf(line, sizeof(line), "{\"id\":%s,\"result\":true,\"error\":null}", ids ? ids : "null");
+	else
+		snprintf(line, sizeof(line), "{\"id\":%s,\"result\":false,\"error\":[%d,\"%s\",null]}",
+			ids ? ids : "null", code, msg);
+	ret = client_send(c, line);
+	free(ids);
+	return ret;
+}
+
+/* notify of the last job, with show_message on a new block */
+static bool client_notify(struct pool_client *c)
+{
+	char *line = (char *) malloc(sizeof(jobs[0].notify) + 64);
+	bool ret = true, clean;
+	uint32_t height;
+
+	pthread_mutex_lock(&pool_lock);
+	const struct pool_job *job = &jobs[job_seq % POOL_JOBS];
+	clean = job->block != c->block;
+	height = 1000000 + job->block;
+	c->block = job->block;
+	c->job_sent = job->id;
+	sprintf(line, "{\"id\":null,\"method\":\"mining.notify\",\"params\":");
+	sprintf(line + strlen(line), job->notify, clean ? "true" : "false");
+	strcat(line, "}");
+	jobs_sent++;
+	pthread_mutex_unlock(&pool_lock);
+
+	if (clean) {
+		char msg[128];
+		c->submitted.clear();
+		snprintf(msg, sizeof(msg), "{\"id\":null,\"method\":\"client.show_message\","
+			"\"params\":[\"equihash VRSC block %u\"]}", height);
+		ret = client_send(c, msg);
+	}
+	ret = ret && client_send(c, line);
+	free(line);
+	return ret;
+}
+
+static uint64_t fnv64(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+enum { SHARE_OK, SHARE_STALE, SHARE_DUP, SHARE_LOWDIFF, SHARE_INVALID };
+
+/* rebuild the hashed data of the miner and check the hash */
+static int client_check_share(struct pool_client *c, json_t *params)
+{
+	alignas(32) uint32_t header[35];
+	uint8_t sol[1347], job_sol[1344 - 15];
+	const char *jobid = json_string_value(json_array_get(params, 1));
+	const char *ntime = json_string_value(json_array_get(params, 2));
+	const char *nonce = json_string_value(json_array_get(params, 3));
+	const char *solhex = json_string_value(json_array_get(params, 4));
+	bool found = false;
+	uint64_t key;
+	uint32_t id;
+
+	if (!jobid || !ntime || !nonce || !solhex)
+		return SHARE_INVALID;
+	id = (uint32_t) strtoul(jobid, NULL, 16);
+	pthread_mutex_lock(&pool_lock);
+	if (id && id + POOL_JOBS > job_seq && id <= job_seq && jobs[id % POOL_JOBS].id == id) {
+		// copied, the slot is reused by pool_new_job() once unlocked
+		const struct pool_job *job = &jobs[id % POOL_JOBS];
+		if (job->block == block_seq) {
+			memcpy(header, job->header, sizeof(header));
+			memcpy(job_sol, job->solution, sizeof(job_sol));
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	if (!found)
+		return SHARE_STALE;
+
+	if (!from_hex((uint8_t *) &header[25], ntime, 4) ||
+	    !from_hex((uint8_t *) &header[27] + sizeof(c->xnonce1), nonce, 32 - sizeof(c->xnonce1)) ||
+	    !from_hex(sol, solhex, sizeof(sol)))
+		return SHARE_INVALID;
+	memcpy(&header[27], c->xnonce1, sizeof(c->xnonce1));
+	// the job solution, except the nonce space
+	if (sol[0] != 0xfd || sol[1] != 0x40 || sol[2] != 0x05 ||
+	    memcmp(&sol[3], job_sol, sizeof(job_sol)))
+		return SHARE_INVALID;
+
+	key = fnv64(0xcbf29ce484222325ULL, &id, 4);
+	key = fnv64(key, &header[25], 4);
+	key = fnv64(key, &header[27], 32);
+	key = fnv64(key, &sol[3 + 1344 - 15], 15);
+	if (!c->submitted.insert(key).second)
+		return SHARE_DUP;
+
+	verushash_ctx_prepare(c->vh, (const uint8_t *) header, &sol[3]);
+	if (!verushash_ctx_verify(c->vh, &sol[3 + 1344 - 15], target_le, NULL))
+		return SHARE_LOWDIFF;
+	return SHARE_OK;
+}
+
+static bool client_request(struct pool_client *c, const char *line)
+{
+	static const char *reasons[] = { "", "Job not found", "Duplicate share", "Low difficulty share", "Invalid share" };
+	json_error_t err;
+	json_t *msg = json_loads(line, 0, &err), *id, *params;
+	const char *method;
+	bool ret = true;
+
+	if (!msg)
+		return true;
+	method = json_string_value(json_object_get(msg, "method"));
+	id = json_object_get(msg, "id");
+	params = json_object_get(msg, "params");
+	if (!method || !id || json_is_null(id)) {
+		json_decref(msg);
+		return true;
+	}
+
+	if (!strcmp(method, "mining.subscribe")) {
+		char xn1[9], res[128], *ids = json_dumps(id, JSON_COMPACT | JSON_ENCODE_ANY);
+		to_hex(xn1, c->xnonce1, sizeof(c->xnonce1));
+		snprintf(res, sizeof(res), "{\"id\":%s,\"result\":[null,\"%s\"],\"error\":null}", ids, xn1);
+		ret = client_send(c, res);
+		free(ids);
+	} else if (!strcmp(method, "mining.authorize")) {
+		char tgt[128];
+		ret = client_answer(c, id, true, 0, NULL);
+		snprintf(tgt, sizeof(tgt), "{\"id\":null,\"method\":\"mining.set_target\",\"params\":[\"%s\"]}", target_hex);
+		ret = ret && client_send(c, tgt);
+		c->authorized = true;
+		c->block = 0;
+		ret = ret && client_notify(c);
+	} else if (!strcmp(method, "mining.submit")) {
+		int rc = c->authorized ? client_check_share(c, params) : SHARE_INVALID;
+		pthread_mutex_lock(&pool_lock);
+		stats.shares++;
+		switch (rc) {
+		case SHARE_OK: stats.accepted++; break;
+		case SHARE_STALE: stats.stale++; break;
+		case SHARE_DUP: stats.duplicate++; break;
+		case SHARE_LOWDIFF: stats.lowdiff++; break;
+		default: stats.invalid++; break;
+		}
+		pthread_mutex_unlock(&pool_lock);
+		if (rc == SHARE_LOWDIFF || rc == SHARE_INVALID)
+			pool_log("client %d: %s, job %s", c->id, reasons[rc],
+				json_string_value(json_array_get(params, 1)));
+		ret = client_answer(c, id, rc == SHARE_OK, 20 + rc, reasons[rc]);
+	} else if (!strcmp(method, "mining.extranonce.subscribe")) {
+		ret = client_answer(c, id, true, 0, NULL);
+	} else {
+		ret = client_answer(c, id, false, 20, "Unknown method");
+	}
+	json_decref(msg);
+	return ret;
+}
+
+static void *client_thread(void *userdata)
+{
+	struct pool_client *c = (struct pool_client *) userdata;
+
+	c->connected = c->reconnect = time(NULL);
+	while (!pool_stop) {
+		struct timeval tv = { 0, POOL_POLL_MS * 1000 };
+		time_t now = time(NULL);
+		fd_set rd;
+
+		if (opt_drop && now - c->connected >= opt_drop) {
+			pool_log("client %d: dropped", c->id);
+			break;
+		}
+		if (opt_reconnect && c->authorized && now - c->reconnect >= opt_reconnect) {
+			char line[128];
+			c->reconnect = now;
+			pool_log("client %d: client.reconnect", c->id);
+			snprintf(line, sizeof(line), "{\"id\":null,\"method\":\"client.reconnect\","
+				"\"params\":[\"127.0.0.1\",%d,0]}", opt_port);
+			if (!client_send(c, line))
+				break;
+		}
+		if (c->authorized && c->job_sent != job_seq && !client_notify(c))
+			break;
+
+		FD_ZERO(&rd);
+		FD_SET(c->sock, &rd);
+		if (select(c->sock + 1, &rd, NULL, NULL, &tv) > 0) {
+			char *eol;
+			ssize_t n = recv(c->sock, c->buf + c->blen, sizeof(c->buf) - c->blen - 1, 0);
+			if (n <= 0)
+				break;
+			c->blen += n;
+			c->buf[c->blen] = '\0';
+			while ((eol = strchr(c->buf, '\n')) != NULL) {
+				*eol = '\0';
+				if (opt_verbose)
+					pool_log("%d < %.160s", c->id, c->buf);
+				if (!client_request(c, c->buf))
+					goto out;
+				c->blen -= (eol + 1 - c->buf);
+				memmove(c->buf, eol + 1, c->blen + 1);
+			}
+			if (c->blen >= sizeof(c->buf) - 1) {
+				pool_log("client %d: line too long", c->id);
+				break;
+			}
+		}
+	}
+out:
+	close(c->sock);
+	pthread_mutex_lock(&pool_lock);
+	clients--;
+	pthread_mutex_unlock(&pool_lock);
+	verushash_ctx_free(c->vh);
+	delete c;
+	return NULL;
+}
+
+static void *accept_thread(void *userdata)
+{
+	int srv = *(int *) userdata;
+	while (!pool_stop) {
+		struct pool_client *c;
+		pthread_t pth;
+		int one = 1, sock = accept(srv, NULL, NULL);
+		if (sock < 0)
+			continue;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c = new pool_client();
+		c->sock = sock;
+		c->vh = verushash_ctx_new();
+		pthread_mutex_lock(&pool_lock);
+		c->id = ++connections;
+		clients++;
+		pthread_mutex_unlock(&pool_lock);
+		c->xnonce1[0] = 0x81;
+		memcpy(&c->xnonce1[1], &c->id, 3);
+		pool_log("client %d: connected", c->id);
+		if (!c->vh || pthread_create(&pth, NULL, client_thread, c)) {
+			close(sock);
+			verushash_ctx_free(c->vh);
+			delete c;
+			continue;
+		}
+		pthread_detach(pth);
+	}
+	return NULL;
+}
+
+static void *job_thread(void *userdata)
+{
+	struct timeval start, now;
+	uint64_t n = 1;
+	gettimeofday(&start, NULL);
+	while (!pool_stop) {
+		double elapsed;
+		usleep(POOL_POLL_MS * 1000);
+		gettimeofday(&now, NULL);
+		elapsed = (double) (now.tv_sec - start.tv_sec) + 1e-6 * (now.tv_usec - start.tv_usec);
+		if (elapsed >= opt_job_secs * n) {
+			pool_new_job(!(n % opt_block_jobs));
+			n++;
+		}
+	}
+	return NULL;
+}
+
+static void pool_report(double secs, bool final)
+{
+	struct pool_stats s;
+	uint64_t js;
+	int nc;
+	pthread_mutex_lock(&pool_lock);
+	s = stats;
+	js = jobs_sent;
+	nc = clients;
+	pthread_mutex_unlock(&pool_lock);
+	double n = s.shares ? (double) s.shares : 1.;
+	pool_log("%s%d client%s, %llu notify, %llu shares (%.2f/s), accepted %.1f%%, stale %.1f%%, "
+		"duplicate %.1f%%, low diff %.1f%%, invalid %.1f%%", final ? "total: " : "", nc, nc > 1 ? "s" : "",
+		(unsigned long long) js, (unsigned long long) s.shares, secs > 0. ? s.shares / secs : 0.,
+		100. * s.accepted / n, 100. * s.stale / n, 100. * s.duplicate / n, 100. * s.lowdiff / n,
+		100. * s.invalid / n);
+}
+
+static void signal_handler(int sig)
+{
+	pool_stop = true;
+}
+
+static void usage()
+{
+	printf("usage: verus-pool [-p port] [-d diff] [-j secs] [-b jobs] [-n] [-l ms] [-x secs] [-r secs]\n"
+		"                  [-i secs] [-T secs] [-v]\n"
+		"  -p  port on 127.0.0.1 (default 3334)\n"
+		"  -d  share difficulty (default 1)\n"
+		"  -j  seconds between the jobs (default 10)\n"
+		"  -b  jobs per block, the first job of a block is clean (default 1)\n"
+		"  -n  jobs without the merged mining layout (no pbaas header)\n"
+		"  -l  latency added to each message sent, in ms\n"
+		"  -x  drop the connections after N seconds\n"
+		"  -r  send client.reconnect every N seconds\n"
+		"  -i  report interval in seconds (default 10)\n"
+		"  -T  stop after N seconds (default: ctrl-c)\n"
+		"  -v  log the stratum lines\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in serv;
+	struct timeval start, now;
+	pthread_t pth;
+	int srv, one = 1, key, last = 0;
+
+	while ((key = getopt(argc, argv, "p:d:j:b:nl:x:r:i:T:vh")) != -1) {
+		switch (key) {
+		case 'p':
+			opt_port = atoi(optarg);
+			break;
+		case 'd':
+			opt_diff = atof(optarg);
+			if (opt_diff <= 0.) {
+				fprintf(stderr, "the difficulty must be positive\n");
+				return 1;
+			}
+			break;
+		case 'j':
+			opt_job_secs = std::max(atof(optarg), 0.01);
+			break;
+		case 'b':
+			opt_block_jobs = std::max(atoi(optarg), 1);
+			break;
+		case 'n':
+			opt_merged = false;
+			break;
+		case 'l':
+			opt_latency = std::max(atoi(optarg), 0);
+			break;
+		case 'x':
+			opt_drop = std::max(atoi(optarg), 0);
+			break;
+		case 'r':
+			opt_reconnect = std::max(atoi(optarg), 0);
+			break;
+		case 'i':
+			opt_report = std::max(atoi(optarg), 1);
+			break;
+		case 'T':
+			opt_duration = std::max(atoi(optarg), 0);
+			break;
+		case 'v':
+			opt_verbose = true;
+			break;
+		default:
+			usage();
+			return key == 'h' ? 0 : 1;
+		}
+	}
+
+	if (verushash_init() != VERUSHASH_OK) {
+		fprintf(stderr, "this cpu has no AES/AVX, the shares can't be verified\n");
+		return 1;
+	}
+	diff_to_target(opt_diff);
+	rand_state ^= (uint32_t) time(NULL);
+	pool_new_job(true);
+
+	srv = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = inet_addr("127.0.0.1");
+	serv.sin_port = htons((unsigned short) opt_port);
+	if (srv < 0 || bind(srv, (struct sockaddr *) &serv, sizeof(serv)) < 0 || listen(srv, 16) < 0) {
+		fprintf(stderr, "unable to listen on 127.0.0.1:%d\n", opt_port);
+		return 1;
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+	pool_log("verus-pool %s on 127.0.0.1:%d, diff %g (target %.16s), job every %gs, %d job%s per block",
+		PACKAGE_VERSION, opt_port, opt_diff, target_hex, opt_job_secs, opt_block_jobs,
+		opt_block_jobs > 1 ? "s" : "");
+
+	if (pthread_create(&pth, NULL, accept_thread, &srv) || pthread_detach(pth) ||
+	    pthread_create(&pth, NULL, job_thread, NULL) || pthread_detach(pth)) {
+		fprintf(stderr, "thread create failed\n");
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	while (!pool_stop) {
+		int secs;
+		usleep(100 * 1000);
+		gettimeofday(&now, NULL);
+		secs = (int) (now.tv_sec - start.tv_sec);
+		if (secs - last >= opt_report) {
+			last = secs;
+			pool_report(secs, false);
+		}
+		if (opt_duration && secs >= opt_duration)
+			pool_stop = true;
+	}
+	gettimeofday(&now, NULL);
+	pool_report((double) (now.tv_sec - start.tv_sec) + 1e-6 * (now.tv_usec - start.tv_usec), true);
+	return (stats.invalid || stats.lowdiff) ? 1 : 0;
+}
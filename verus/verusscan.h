@@ -0,0 +1,238 @@
+/**
+ * Verus 2.2 hash primitives, shared by the miner (verusscan.cpp) and the
+ * kernel microbenchmark (verusbench.cpp)
+ */
+#ifndef VERUSSCAN_H
+#define VERUSSCAN_H
+
+#include <string.h>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include "verus_clhash.h"
+
+#define VERUS_KEY_SIZE 8832
+#define VERUS_KEY_SIZE128 552
+#ifndef EQNONCE_OFFSET
+#define EQNONCE_OFFSET 30 /* 27:34 */
+#endif
+
+/**
+ * Header (140 bytes) and solution (1344) to the 1487 hashed bytes, the
+ * merged mining layout (solution version 7+ with pbaas headers) clears
+ * the non canonical fields and moves the header nonce to the nonce space
+ */
+static inline void VerusPrepareData(uint8_t *full_data, uint8_t *nonceSpace, const uint32_t *pdata,
+	const uint8_t *solution)
+{
+	static const unsigned char block_41970[3] = { 0xfd, 0x40, 0x05 };
+	uint8_t *sol_data = &full_data[140];
+
+	memcpy(full_data, pdata, 140);
+	memcpy(sol_data, block_41970, 3);
+	memcpy(sol_data + 3, solution, 1344);
+
+	if (solution[0] >= 7 && solution[5] > 0) {
+		// clear non-canonical data from header/solution before hashing; required for merged mining
+		memset(full_data + 4, 0, 96);                        // hashPrevBlock, hashMerkleRoot, hashFinalSaplingRoot
+		memset(full_data + 4 + 32 + 32 + 32 + 4, 0, 4);      // nBits
+		memset(full_data + 4 + 32 + 32 + 32 + 4 + 4, 0, 32); // nNonce
+		memset(sol_data + 3 + 8, 0, 64);                     // hashPrevMMRRoot, hashBlockMMRRoot
+		memcpy(nonceSpace, &pdata[EQNONCE_OFFSET - 3], 7);   // transfer the nonce values that would be in the header to
+		memcpy(nonceSpace + 7, &pdata[EQNONCE_OFFSET + 2], 4); // the 15 bytes available
+	}
+}
+
+static inline void GenNewCLKey(unsigned char *seedBytes32, u128 *keyback)
+{
+	// generate a new key by chain hashing with Haraka256 from the last curbuf
+	int n256blks = VERUS_KEY_SIZE >> 5;  //8832 >> 5
+	int nbytesExtra = VERUS_KEY_SIZE & 0x1f;  //8832 & 0x1f
+	unsigned char *pkey = (unsigned char*)keyback;
+	unsigned char *psrc = seedBytes32;
+	for (int i = 0; i < n256blks; i++)
+	{
+		haraka256(pkey, psrc);
+
+		psrc = pkey;
+		pkey += 32;
+	}
+	if (nbytesExtra)
+	{
+		unsigned char buf[32];
+		haraka256(buf, psrc);
+		memcpy(pkey, buf, nbytesExtra);
+	}
+}
+
+static inline void FixKey(uint32_t *fixrand, uint32_t *fixrandex, u128 *keyback,
+	u128 * g_prand, u128 *g_prandex)
+{
+
+	for (int i = 31; i > -1; i--)
+	{
+		keyback[fixrandex[i]] = g_prandex[i];
+		keyback[fixrand[i]] = g_prand[i];
+	}
+
+}
+
+
+static inline void VerusHashHalf(void *result2, unsigned char *data, int len)
+{
+	alignas(32) unsigned char buf1[64] = { 0 }, buf2[64];
+	unsigned char *curBuf = buf1, *result = buf2;
+	int curPos = 0;
+	//unsigned char result[64];
+	curBuf = buf1;
+	result = buf2;
+	curPos = 0;
+	std::fill(buf1, buf1 + sizeof(buf1), 0);
+
+	unsigned char *tmp;
+
+	// constant, written once to not dirty the shared lines on each scan
+	static volatile bool constants_loaded = false;
+	if (!constants_loaded) {
+		load_constants();
+		constants_loaded = true;
+	}
+
+	// digest up to 32 bytes at a time
+	for (int pos = 0; pos < len; )
+	{
+		int room = 32 - curPos;
+
+		if (len - pos >= room)
+		{
+			memcpy(curBuf + 32 + curPos, data + pos, room);
+			haraka512(result, curBuf);
+			tmp = curBuf;
+			curBuf = result;
+			result = tmp;
+			pos += room;
+			curPos = 0;
+		}
+		else
+		{
+			memcpy(curBuf + 32 + curPos, data + pos, len - pos);
+			curPos += len - pos;
+			pos = len;
+		}
+	}
+
+	memcpy(curBuf + 47, curBuf, 16);
+	memcpy(curBuf + 63, curBuf, 1);
+	//	FillExtra((u128 *)curBuf);
+	memcpy(result2, curBuf, 64);
+}
+
+static inline void Verus2hash(unsigned char *hash, unsigned char *curBuf, unsigned char *nonce,
+	u128  * __restrict data_key, uint8_t *gpu_init, uint32_t *fixrand, uint32_t *fixrandex, u128 *g_prand,
+	u128 *g_prandex, int version, uint64_t *tsc)
+{
+	//uint64_t mask = VERUS_KEY_SIZE128; //552
+	static const __m128i shuf1 = _mm_setr_epi8(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0);
+	const __m128i fill1 = _mm_shuffle_epi8(_mm_load_si128((u128 *)curBuf), shuf1);
+	static const __m128i shuf2 = _mm_setr_epi8(1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0);
+	unsigned char ch = curBuf[0];
+	_mm_store_si128((u128 *)(&curBuf[32 + 16]), fill1);
+	curBuf[32 + 15] = ch;
+	//	FillExtra((u128 *)curBuf);
+	uint64_t intermediate;
+	memcpy(curBuf + 32, nonce, 15);  //copy the 15bytes nonce
+
+	if (tsc) tsc[0] = __rdtsc();
+	intermediate = verusclhashv2_2(data_key, curBuf, 511, fixrand, fixrandex, g_prand, g_prandex);
+	if (tsc) tsc[1] = __rdtsc();
+		//FillExtra
+	__m128i fill2 = _mm_shuffle_epi8(_mm_loadl_epi64((u128 *)&intermediate), shuf2);
+	_mm_store_si128((u128 *)(&curBuf[32 + 16]), fill2);
+	curBuf[32 + 15] = *((unsigned char *)&intermediate);
+	intermediate &= 511;
+	haraka512_keyed(hash, curBuf, data_key + intermediate);
+	if (tsc) tsc[2] = __rdtsc();
+	FixKey(fixrand, fixrandex, data_key, g_prand, g_prandex);
+	if (tsc) tsc[3] = __rdtsc();
+}
+
+/**
+ * The same steps with other haraka and clhash functions and plain byte
+ * copies, for the backend checks (veruscheck.cpp) and the share verifier
+ * of the miner (--verify-shares)
+ */
+typedef void (*haraka_fn)(unsigned char *out, const unsigned char *in);
+typedef void (*haraka_keyed_fn)(unsigned char *out, const unsigned char *in, const u128 *rc);
+typedef uint64_t (*clhash_fn)(void *random, const unsigned char buf[64], uint64_t keyMask,
+	uint32_t *fixrand, uint32_t *fixrandex, u128 *g_prand, u128 *g_prandex);
+
+struct verus_backend {
+	const char *name;
+	haraka_fn haraka512;
+	haraka_fn haraka256;
+	haraka_keyed_fn haraka512_keyed;
+	clhash_fn clhash;
+};
+
+static inline void VerusHashHalfBackend(const struct verus_backend *b, unsigned char *half,
+	const unsigned char *data, int len)
+{
+	alignas(32) unsigned char buf1[64] = { 0 }, buf2[64];
+	unsigned char *curBuf = buf1, *result = buf2, *tmp;
+	int curPos = 0;
+
+	for (int pos = 0; pos < len; ) {
+		int room = 32 - curPos;
+		if (len - pos >= room) {
+			memcpy(curBuf + 32 + curPos, data + pos, room);
+			b->haraka512(result, curBuf);
+			tmp = curBuf; curBuf = result; result = tmp;
+			pos += room;
+			curPos = 0;
+		} else {
+			memcpy(curBuf + 32 + curPos, data + pos, len - pos);
+			curPos += len - pos;
+			pos = len;
+		}
+	}
+	memcpy(curBuf + 47, curBuf, 16);
+	memcpy(curBuf + 63, curBuf, 1);
+	memcpy(half, curBuf, 64);
+}
+
+static inline void GenNewCLKeyBackend(const struct verus_backend *b, const unsigned char *half, u128 *key)
+{
+	unsigned char *pkey = (unsigned char *) key;
+	const unsigned char *psrc = half;
+	for (int i = 0; i < (VERUS_KEY_SIZE >> 5); i++) {
+		b->haraka256(pkey, psrc);
+		psrc = pkey;
+		pkey += 32;
+	}
+}
+
+static inline void Verus2hashBackend(const struct verus_backend *b, unsigned char *hash, unsigned char *curBuf,
+	const unsigned char *nonce, u128 *key, uint32_t *fixrand, uint32_t *fixrandex, u128 *g_prand, u128 *g_prandex)
+{
+	unsigned char fill[16];
+	uint64_t intermediate;
+
+	for (int i = 0; i < 16; i++)
+		fill[i] = curBuf[(i + 1) & 15];
+	memcpy(curBuf + 48, fill, 16);
+	curBuf[47] = curBuf[0];
+	memcpy(curBuf + 32, nonce, 15);
+
+	intermediate = b->clhash(key, curBuf, 511, fixrand, fixrandex, g_prand, g_prandex);
+
+	for (int i = 0; i < 16; i++)
+		curBuf[48 + i] = (unsigned char) (intermediate >> (8 * ((i + 1) & 7)));
+	curBuf[47] = (unsigned char) intermediate;
+	b->haraka512_keyed(hash, curBuf, key + (intermediate & 511));
+	FixKey(fixrand, fixrandex, key, g_prand, g_prandex);
+}
+
+#endif /* VERUSSCAN_H */